@@ -7,10 +7,17 @@
 #ifndef PRODOSFS_PRODOS_HXX
 #define PRODOSFS_PRODOS_HXX
 
+#include "prodos/builder.hxx"
+#include "prodos/check.hxx"
 #include "prodos/directory.hxx"
 #include "prodos/entry.hxx"
 #include "prodos/file.hxx"
 #include "prodos/filetype.hxx"
+#include "prodos/index.hxx"
+#include "prodos/log.hxx"
+#include "prodos/salvage.hxx"
+#include "prodos/stats.hxx"
+#include "prodos/trace.hxx"
 #include "prodos/util.hxx"
 #include "prodos/volume.hxx"
 
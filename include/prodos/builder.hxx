@@ -0,0 +1,134 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_BUILDER_HXX
+#define PRODOSFS_BUILDER_HXX
+
+#include "prodos/entry.hxx"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace prodos
+{
+
+class volume_t;
+
+// What goes in the directory entry of a new file or directory, or in the volume header.
+struct entry_info_t
+{
+    std::string     name;
+    uint8_t         file_type       = 0;
+    uint16_t        aux_type        = 0;
+    uint8_t         access          = 0xC3;     // destroy, rename, write, read
+    uint8_t         version         = 0;
+    uint8_t         min_version     = 0;
+    timestamp_t     created         = {};       // a month of 0 for no date
+    timestamp_t     modified        = {};
+};
+
+/*
+** Assembles a new ProDOS volume image in memory, block by block. Blocks are handed out by an
+** allocator that keeps track of which are in use, so that the volume bitmap can be written
+** to match at the end.
+*/
+class volume_builder_t
+{
+public:
+    explicit volume_builder_t(unsigned total_blocks);
+    volume_builder_t(const volume_builder_t &)      = delete;
+
+    // Allocate the lowest run of count free blocks. Returns the first block, or 0 if there is
+    // no run that long.
+    uint16_t    Allocate(unsigned count = 1);
+
+    // Mark blocks in use that are placed by hand, e.g. the boot blocks.
+    void        MarkUsed(uint16_t block, unsigned count = 1);
+
+    uint8_t *   Block(uint16_t block);
+
+    unsigned    TotalBlocks()   const   { return _used.size(); }
+    unsigned    FreeBlocks()    const;
+
+    // The number of blocks the volume bitmap takes, and the writing of it to the blocks
+    // starting at the given one, which must already be allocated.
+    unsigned    BitmapBlocks()  const;
+    void        WriteBitmap(uint16_t block);
+
+    // Start a new volume with the volume directory at block 2, sized for the given number of
+    // entries but at least the usual 4 blocks, and the bitmap after it. The boot blocks are
+    // left empty. Returns the key block of the volume directory.
+    uint16_t    Format(const entry_info_t & volume, unsigned entry_count);
+
+    // Add an entry for a new subdirectory, with room for the given number of entries, to a
+    // directory. The directory is given by its key block. Returns the subdirectory's.
+    uint16_t    AddDirectory(uint16_t parent, const entry_info_t & info, unsigned entry_count);
+
+    // Add a file to a directory, with its index blocks followed by its data blocks. Blocks
+    // of zeros after the first are left out, as ProDOS does for sparse files, and the storage
+    // type is the smallest that holds the rest. Throws if the file does not fit.
+    void        AddFile(uint16_t parent, const entry_info_t & info, const uint8_t * data, size_t size);
+
+    // The number of blocks that adding a file of the given size takes at most.
+    static unsigned     FileBlocks(size_t size);
+
+    // The number of blocks a directory with room for the given number of entries takes.
+    static unsigned     DirectoryBlocks(unsigned entry_count);
+
+    // Write the bitmap of a volume that was started by Format.
+    void        Finish();
+
+    // Write the image to a file as a sequence of blocks. Returns false on failure.
+    bool        Save(const std::string & pathname) const;
+
+    // Write a copy of a volume whose directories and files are each in consecutive blocks:
+    // a directory's blocks together, and a file's index blocks followed by the data blocks
+    // they point to, in order, all in the order of the directory entries. Every entry keeps
+    // its place in its directory and its attributes. Throws on a damaged volume.
+    static bool     Optimize(const volume_t & volume, const std::string & pathname);
+
+private:
+    std::vector<uint8_t>    _image;
+    std::vector<bool>       _used;
+    unsigned                _first_free     = 0;    // no block before this is free
+    uint16_t                _bitmap         = 0;
+
+    // The directories added so far, by key block, and how many of their slots are taken
+    // (the header's included).
+    struct directory_t
+    {
+        uint16_t    blocks;
+        unsigned    slots;
+    };
+    std::map<uint16_t, directory_t>     _directories;
+
+    // Allocate a directory's blocks, linked and with its header filled in.
+    uint16_t    _NewDirectory(const entry_info_t & info, uint8_t storage_type, unsigned entry_count);
+
+    // Take the next free slot of a directory and fill in what the entry has in common with
+    // others. Returns the entry, and the block it is in.
+    directory_entry *   _NewEntry(uint16_t directory, const entry_info_t & info, uint8_t storage_type,
+                                  uint16_t * block);
+
+    // Place a copy of a directory's blocks, one after another, and set the number of them.
+    // Returns the first, its new key block.
+    uint16_t    _PlaceDirectory(const volume_t & volume, uint16_t key_pointer, uint16_t parent_block,
+                                unsigned * count);
+
+    // Place what the entries of a directory that has been placed point to, in order, and
+    // point the entries to their new places.
+    void        _CopyEntries(const volume_t & volume, uint16_t first, unsigned count);
+
+    // Place a file's blocks, and set its new key pointer in the given entry.
+    void        _CopyFile(const volume_t & volume, directory_entry * entry);
+};
+
+} // namespace
+
+#endif // PRODOSFS_BUILDER_HXX
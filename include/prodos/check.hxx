@@ -0,0 +1,81 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_CHECK_HXX
+#define PRODOSFS_CHECK_HXX
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace prodos
+{
+
+class volume_t;
+struct directory_entry;
+
+/*
+** Checks the consistency of a volume the way a file system checker would, without trusting
+** anything it reads: the directory chains are linked both ways, every pointer is in range,
+** no block is used twice, the file counts and blocks used in the directories add up, the
+** EOFs fit the files' storage, and the volume bitmap marks exactly the blocks that are used.
+** Each block is read once, and what is used is kept in bitsets, so a volume of any size is
+** checked in one pass.
+*/
+class volume_checker_t
+{
+public:
+    explicit volume_checker_t(const volume_t & volume);
+    volume_checker_t(const volume_checker_t &)      = delete;
+
+    // Check the volume. Returns true if nothing is wrong.
+    bool    Check();
+
+    // What is wrong, one line each, e.g. "/DIR/FILE: blocks used is 12 but 11 are used".
+    // Only the first MAX_PROBLEMS are kept; the rest are only counted.
+    const std::vector<std::string> &    Problems()      const   { return _problems; }
+    size_t                              ProblemCount()  const   { return _problem_count; }
+
+    unsigned    Directories()   const   { return _directories; }
+    unsigned    Files()         const   { return _files; }
+    unsigned    BlocksUsed()    const   { return _blocks_used; }
+
+    static const size_t     MAX_PROBLEMS = 100;
+
+private:
+    const volume_t &            _volume;
+    unsigned                    _total_blocks;
+    std::vector<uint64_t>       _used;          // a bit for each block something uses
+    std::vector<uint32_t>       _owners;        // what uses each block, an index into _names
+    std::vector<std::string>    _names;
+    std::vector<std::string>    _problems;
+    size_t                      _problem_count  = 0;
+    unsigned                    _directories    = 0;
+    unsigned                    _files          = 0;
+    unsigned                    _blocks_used    = 0;
+
+    void    _Problem(const char * format, ...) __attribute__((format(printf, 2, 3)));
+
+    // Mark a block as used by the given owner. Returns false, having said what is wrong, if
+    // the block is out of range or already used.
+    bool    _Claim(uint16_t block, uint32_t owner);
+
+    // Check a directory and, after it, its subdirectories. Returns the number of blocks in
+    // its chain.
+    unsigned    _CheckDirectory(uint16_t key_block, const std::string & pathname, uint16_t parent_block,
+                                unsigned parent_entry);
+
+    // Check a file and the blocks it uses.
+    void    _CheckFile(const directory_entry * entry, const std::string & pathname);
+
+    // Compare the blocks that are used with the volume bitmap.
+    void    _CheckBitmap(uint16_t bitmap_block);
+};
+
+} // namespace
+
+#endif // PRODOSFS_CHECK_HXX
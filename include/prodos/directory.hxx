@@ -7,6 +7,10 @@
 #ifndef PRODOSFS_DIRECTORY_HXX
 #define PRODOSFS_DIRECTORY_HXX
 
+#include <string_view>
+
+#include <stdint.h>
+
 namespace prodos
 {
 
@@ -17,24 +21,56 @@ class volume_t;
 class disk_t;
 class directory_entry_t;
 
+// The slots of a directory block, a bit for each, that hold an entry (or the header), and
+// those of them whose name may be the one scanned for: it has the same length and first letter.
+struct directory_scan_t
+{
+    uint16_t    active;
+    uint16_t    candidates;
+};
+
+// Look at the storage type, name length and first letter of every slot of a block at once.
+directory_scan_t ScanDirectoryBlock(const directory_block * block, std::string_view name);
+
 class directory_handle_t
 {
 public:
+    // A handle is closed until a volume opens a directory in it.
+    directory_handle_t()        = default;
+
     void                        Close();
     const directory_entry_t *   NextEntry();
 
+    // Find the entry with the given name among those NextEntry has yet to return, a whole
+    // block at a time. Only the candidates of ScanDirectoryBlock have their names compared.
+    const directory_entry_t *   FindEntry(std::string_view name);
+
+    // The position of the next entry, as a cookie for Seek: the block it is in, its slot,
+    // how many entries come before it and the generation of the volume (see Generation).
+    // It is never 0, which Seek takes for the start of the directory, nor 1 or 2.
+    uint64_t                    Tell() const;
+
+    // Go back to a position from Tell, or to the start for 0, without reading the blocks in
+    // between. A position from before a refresh changed the directories goes back to the
+    // start, as the directory may have been rewritten since. Returns false for a position
+    // that cannot be in the directory.
+    bool                        Seek(uint64_t position);
+
 private:
-    const volume_t *            _context;
-    const directory_header *    _header;
-    const directory_block *     _block;
-    int                         _block_index;
-    int                         _entry_index;
+    const volume_t *            _context        = nullptr;
+    const directory_header *    _header         = nullptr;
+    const directory_block *     _block          = nullptr;
+    uint16_t                    _key_block      = 0;
+    uint16_t                    _block_number   = 0;
+    int                         _block_index    = 0;
+    int                         _entry_index    = 0;
+    unsigned                    _generation     = 0;
 
     friend class volume_t;
 
-    directory_handle_t(const volume_t * context, const directory_block * key_block);
+    directory_handle_t(const volume_t * context, const directory_block * key_block, uint16_t key_pointer);
 
-    void    _Open(const directory_block * key_block);
+    void    _Open(const directory_block * key_block, uint16_t key_pointer);
     void    _Next();
 };
 
@@ -7,11 +7,47 @@
 #ifndef PRODOSFS_DISK_HXX
 #define PRODOSFS_DISK_HXX
 
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/types.h>
 
 namespace prodos
 {
 
+/*
+** A decoder produces the blocks of an image that is not stored as plain blocks (e.g. a
+** compressed archive). Blocks are decoded on demand, a unit of consecutive blocks at a time.
+*/
+class decoder_t
+{
+public:
+    virtual ~decoder_t() = default;
+
+    virtual unsigned    NumBlocks()         const = 0;
+    virtual unsigned    BlocksPerUnit()     const = 0;
+
+    // Decode a unit into its place in the image, which has room for all blocks. Units that
+    // cannot be decoded independently may require decoding others along the way, so every
+    // unit decoded is marked in the decoded vector.
+    virtual void        Decode(unsigned unit, uint8_t * image, std::vector<bool> & decoded) = 0;
+};
+
+/*
+** A partition is a range of blocks on a disk that holds a volume of its own.
+*/
+struct partition_t
+{
+    unsigned        first_block;
+    unsigned        num_blocks;
+    std::string     name;
+    std::string     type;
+};
+
 /*
 ** The disk class deals only with the physical layout of the disk, sectors and blocks, and 
 ** does not know anything about their contents.
@@ -22,6 +58,10 @@ public:
     const size_t SECTOR_SIZE = 256;
     const size_t BLOCK_SIZE = SECTOR_SIZE * 2;
 
+    // The order in which sectors are stored in the image, if known. Raw images do not say,
+    // so it has to be probed for, but containers like 2IMG declare it in their header.
+    enum order_t { order_unknown, order_dos, order_prodos };
+
     disk_t(const std::string & pathname);
     disk_t(const disk_t &)                  = delete;
 
@@ -30,10 +70,16 @@ public:
     disk_t &    operator=(const disk_t &)   = delete;
 
     // ProDOS works with sequentially numbered blocks, each of which consists of
-    // two not-necessarily sequential sectors.
+    // two not-necessarily sequential sectors. Blocks of encoded images are decoded
+    // the first time they are read.
     const void *    ReadBlock(int index) const;
     void            WriteBlock(int index, const void * block);
 
+    // Say that blocks are about to be read, so that the kernel can start reading them from
+    // the image file. Encoded and converted images, and small ones, are in memory already,
+    // so this does nothing for them.
+    void            WillNeed(unsigned index, unsigned count) const;
+
     // This returns an individual sector, which is half of some block.
     const void *    ReadTrackSector(int track, int sector) const;
 
@@ -42,6 +88,21 @@ public:
         return  _num_blocks;
     }
 
+    order_t         Order(void) const
+    {
+        return _order;
+    }
+
+    // The number of blocks declared by the image container header, or 0 if the image
+    // has no header or the header does not say.
+    unsigned        HeaderBlocks(void) const
+    {
+        return _header_blocks;
+    }
+
+    // Return the entries of the disk's Apple partition map, if it has one.
+    std::vector<partition_t>    Partitions() const;
+
     // Some disk images are in the older DOS 3.3 track-and-sector format. This converts
     // the image in memory to the block-addressable format that ProDOS expects.
     // 
@@ -57,20 +118,74 @@ public:
     // Used for logging and debugging.
     ssize_t ToOffset(const void * addr) const;
 
+    // For encoded images, how many block reads and writes there have been and how many of
+    // them had to decode a unit first, i.e. missed the decoded image. Both are 0 otherwise.
+    void    DecodeCounts(uint64_t * lookups, uint64_t * misses) const;
+
+    // Hash every block as it is now, so that Remap can tell which blocks change. Encoded
+    // images cannot be remapped, so this returns false for them.
+    bool    TrackChanges();
+
+    // Map the image file again at the same address, after another program has changed it,
+    // so that pointers into the disk stay valid and see the new contents. Converted images
+    // are converted again. Sets the blocks whose contents changed since TrackChanges or the
+    // last remap. Returns false, leaving the disk as it was, if the file is gone or its size
+    // has changed. Nothing may read the disk meanwhile, as blocks change in place.
+    bool    Remap(std::vector<bool> & changed);
+
     // Return true if the in-memory image has been modified.
     bool    IsDirty() const
     {
         return _dirty;
     }
 
-private:
-    void *      _base       = nullptr;
-    size_t      _size       = 0;
-    unsigned    _num_blocks = 0;
-    bool        _converted  = false;
-    bool        _dirty      = false;
+    // Return true if the blocks are decoded from an archive or nibbles, whose tracks or
+    // units may add up to more blocks than the volume has (e.g. a 40-track .nib).
+    bool    IsEncoded() const
+    {
+        return _decoder != nullptr;
+    }
+
+    // Return true if the image has been converted from track-and-sector order.
+    bool    IsConverted() const
+    {
+        return _converted;
+    }
 
-    void _ReadRwtsBlock(size_t index, void * block);
+    const std::string &     Pathname() const
+    {
+        return _pathname;
+    }
+
+private:
+    std::string _pathname;
+    void *      _map            = nullptr;  // the whole image file
+    size_t      _map_size       = 0;
+    size_t      _data_offset    = 0;        // offset of the disk data within the file
+    void *      _base           = nullptr;  // the disk data
+    size_t      _size           = 0;
+    unsigned    _num_blocks     = 0;
+    unsigned    _header_blocks  = 0;
+    order_t     _order          = order_unknown;
+    bool        _allocated      = false;    // _base was allocated rather than mapped
+    bool        _converted      = false;
+    std::atomic<bool>   _writable   = false;    // the mapping has been made writable
+    std::atomic<bool>   _dirty  = false;
+
+    // Decoding is the only thing that modifies the image once it is mounted, and it may be
+    // triggered by reads in several threads at once.
+    std::unique_ptr<decoder_t>  _decoder;
+    mutable std::vector<bool>   _decoded;
+    mutable std::mutex          _decode_mutex;
+    mutable uint64_t            _decode_lookups = 0;
+    mutable uint64_t            _decode_misses  = 0;
+
+    std::vector<uint64_t>       _block_hashes;      // for Remap
+
+    void _ParseTwoImg();
+    void _SetDecoder(decoder_t * decoder);
+    void _Decode(int index) const;
+    void _ReadRwtsBlock(const void * source, size_t index, void * block);
 };
 
 } // namespace
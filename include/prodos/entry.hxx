@@ -10,6 +10,7 @@
 #include "prodos/block.hxx"
 
 #include <string>
+#include <string_view>
 
 namespace prodos
 {
@@ -40,7 +41,7 @@ class entry_t
 public:
     uint8_t         StorageType()           const;
     uint8_t         NameLength()            const;
-    std::string     FileName()              const;
+    std::string_view    FileName()          const;      // points into the directory block
     timestamp_t     CreationTimestamp()     const;
     uint8_t         Version()               const;
     uint8_t         MinVersion()            const;
@@ -52,7 +53,7 @@ public:
     bool            IsInactive()                        const;
     bool            IsRoot()                            const;
 
-    bool            NameMatches(const std::string & name)   const;
+    bool            NameMatches(std::string_view name)  const;
 };
 
 class directory_entry_t : public entry_t
@@ -7,6 +7,11 @@
 #ifndef PRODOSFS_FILE_HXX
 #define PRODOSFS_FILE_HXX
 
+#include "prodos/index.hxx"
+
+#include <atomic>
+#include <vector>
+
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -16,6 +21,16 @@ namespace prodos
 class volume_t;
 class directory_entry_t;
 
+// Where a file is on the disk: its key block, its index blocks (the key block first, or none
+// for a seedling file, whose key block is its data), and its data blocks as runs in file
+// order, sparse runs having disk block 0.
+struct file_layout_t
+{
+    uint16_t                    key_block = 0;
+    std::vector<uint16_t>       index_blocks;
+    std::vector<index_extent>   extents;
+};
+
 class index_block_t
 {
 public:
@@ -23,26 +38,68 @@ public:
     uint16_t    operator[](int index)   const   { return At(index); }
 };
 
+// Where the last read of a file ended and how far ahead of it the blocks have been asked for,
+// to tell sequential reads. Threads sharing a handle update it without locking, as it is only
+// a hint. A copy starts afresh.
+struct readahead_t
+{
+    std::atomic<off_t>      next_offset = 0;
+    std::atomic<size_t>     advised     = 0;        // blocks of the file up to here
+
+    readahead_t()                                   = default;
+    readahead_t(const readahead_t &)                { }
+    readahead_t &   operator=(const readahead_t &)  { next_offset = 0; advised = 0; return *this; }
+};
+
 class file_handle_t
 {
 public:
+    // A handle is closed until a volume opens a file in it.
+    file_handle_t()     = default;
+
     void                Close();
     uint8_t             Type() const;
     bool                Eof() const;
     off_t               Seek(off_t offset, int whence);
     size_t              Read(void *buffer, size_t size);
 
+    // Return the offset of the first data (SEEK_DATA) or hole (SEEK_HOLE) at or after the
+    // given offset, as lseek(2) would, without changing the file position. Holes are the
+    // blocks that are not allocated, and the end of the file. Returns -1 if the offset is
+    // not within the file, or there is no data after it.
+    off_t               FindData(off_t offset, int whence) const;
+
+    // Work out where the file is on the disk.
+    void                Layout(file_layout_t * layout) const;
+
+    // Read from the given offset without using or changing the file position, so that
+    // several threads can read from the same handle at once. Reads stop at the end of
+    // the file. Returns the number of bytes read, or -1 if the offset is out of range.
+    ssize_t             ReadAt(off_t offset, void *buffer, size_t size) const;
+
 private:
     const volume_t *            _context{};
     const directory_entry_t *   _entry{};
-    index_block_t *             _master{};
-    index_block_t *             _index{};
-    uint8_t *                   _data{};
     off_t                       _position{};
+    const index_extent *        _extents{};         // from the volume's index, if it has one
+    size_t                      _extent_count{};
+    unsigned                    _generation{};      // of the index they are from
+    mutable readahead_t         _readahead;
 
     file_handle_t(const volume_t * context, const directory_entry_t * entry);
 
+    // Return the data block for the given block of the file, or 0 if it is sparse.
+    uint16_t            _DataBlock(size_t index) const;
+
+    // If a read carries on from the last one, ask for the blocks after it ahead of time.
+    void                _ReadAhead(off_t offset, size_t size) const;
+
+    // Return whether the given block of the file has data, and set count to the number of
+    // blocks from it on that are known to be the same, e.g. all those of a sparse index block.
+    bool                _HasData(size_t index, size_t * count) const;
+
     friend class volume_t;
+    friend class index_t;
 };
 
 } // namespace
@@ -7,18 +7,19 @@
 #ifndef PRODOSFS_FILETYPE_HXX
 #define PRODOSFS_FILETYPE_HXX
 
-#include <string>
+#include <string_view>
 
 #include <stdint.h>
 
 namespace prodos
 {
 
+// The strings are constants, so the info can be used without copying it.
 struct file_type_info_t
 {
-    const std::string     type;
-    const std::string     name;
-    const std::string     description;
+    std::string_view    type;           // e.g. "$06"
+    std::string_view    name;           // e.g. "BIN", or "06" for a type with no name
+    std::string_view    description;
 };
 
 // Create constants for the most common/important file types.
@@ -41,6 +42,15 @@ enum file_type_t
 
 const file_type_info_t *    GetFileTypeInfo(uint8_t type);
 
+// The info for a file type and aux type, which is more specific for some combinations,
+// e.g. $E0/$8002 is a ShrinkIt archive.
+const file_type_info_t *    GetFileTypeInfo(uint8_t type, uint16_t aux_type);
+
+// The SUBTYPE column of a catalog, e.g. "A=$2000" (the load address of a BIN file) or
+// "R=   80" (the record length of a TXT file), formatted in the given buffer. Empty if the
+// file type has no subtype.
+std::string_view            FileSubtype(uint8_t type, uint16_t aux_type, char (&buffer)[8]);
+
 bool                        IsAppleWorksFile(uint8_t type);
 
 }
@@ -0,0 +1,139 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_INDEX_HXX
+#define PRODOSFS_INDEX_HXX
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace prodos
+{
+
+class volume_t;
+class directory_entry_t;
+struct index_builder_t;
+
+/*
+** The index is a sidecar file next to a disk image ("<image>.pdx") that records what
+** mounting the image works out: its sector order, and the pathname, directory entry
+** location, stat data and extent map of every file and directory. A later mount maps it and
+** looks pathnames up directly instead of walking the directories and index blocks.
+**
+** The index is only used while the image has the size, modification time and leading bytes
+** it was built from. The file is a header followed by the sections it points to.
+*/
+struct index_key
+{
+    uint64_t    size;
+    int64_t     mtime;              // nanoseconds
+    uint64_t    hash;               // of the first 64 KiB
+};
+
+const uint32_t  INDEX_CONVERTED     = 0x0001;   // the image is in track-and-sector order
+
+struct index_header
+{
+    char        magic[8];           // "PDINDEX1"
+    uint32_t    header_size;
+    uint32_t    flags;
+    index_key   key;
+    uint32_t    entry_count;
+    uint32_t    bucket_count;       // a power of two
+    uint32_t    extent_count;
+    uint32_t    names_size;
+    uint64_t    entries_offset;
+    uint64_t    buckets_offset;
+    uint64_t    extents_offset;
+    uint64_t    names_offset;
+};
+
+struct index_entry
+{
+    uint64_t    hash;               // of the upper-cased pathname
+    uint32_t    name_offset;        // the pathname, e.g. "/SUBDIR/FILE", in the names section
+    uint16_t    name_length;
+    uint16_t    block;              // the directory block holding the entry
+    uint8_t     slot;               // and its place in the block
+    uint8_t     storage_type;
+    uint8_t     file_type;
+    uint8_t     reserved;
+    uint16_t    key_pointer;
+    uint16_t    blocks_used;
+    uint32_t    eof;
+    uint32_t    first_extent;
+    uint32_t    extent_count;
+};
+
+// A run of consecutive file blocks stored in consecutive disk blocks, or a sparse run if
+// the disk block is 0. The extents of a file are sorted and cover all of its blocks.
+struct index_extent
+{
+    uint32_t    file_block;
+    uint16_t    disk_block;
+    uint16_t    count;
+};
+
+class index_t
+{
+public:
+    index_t(const index_t &)                = delete;
+    ~index_t();
+
+    // The key of an image file as it is now. Returns false if it cannot be read.
+    static bool     Key(const std::string & image, index_key * key);
+
+    // Open the index of an image, if there is one with the given key.
+    static std::unique_ptr<index_t>     Open(const std::string & image, const index_key & key);
+
+    // Build the index of a mounted volume in memory. Returns nullptr if the directories are
+    // damaged.
+    static std::unique_ptr<index_t>     Build(const volume_t & volume, bool converted);
+
+    // Write the index next to an image, under the key the image had when the index was
+    // built. Returns false on failure.
+    bool    Save(const std::string & image, const index_key & key) const;
+
+    static std::string  Pathname(const std::string & image);
+
+    bool    IsConverted()   const   { return _header->flags & INDEX_CONVERTED; }
+    size_t  EntryCount()    const   { return _header->entry_count; }
+    size_t  ExtentCount()   const   { return _header->extent_count; }
+
+    // Look a pathname up, ignoring case as ProDOS does. Returns nullptr if it is not found.
+    const index_entry *     Find(std::string_view pathname) const;
+
+    // The extents of an entry, or nullptr if it has none.
+    const index_extent *    Extents(const index_entry & entry, size_t * count) const;
+
+    // The entries in depth-first order, each directory followed by its contents.
+    const index_entry *     EntryAt(size_t i) const;
+    std::string             PathnameOf(const index_entry & entry) const;
+
+private:
+    const uint8_t *         _data       = nullptr;
+    size_t                  _size       = 0;
+    bool                    _mapped     = false;    // else _data is the buffer
+    std::vector<uint8_t>    _buffer;
+    const index_header *    _header     = nullptr;
+
+    index_t() = default;
+
+    // Add the entries of a directory and its subdirectories, and the extents of their files,
+    // found by walking the index blocks.
+    static void     _AddDirectory(index_builder_t & builder, uint16_t key_pointer, const std::string & dir);
+    static void     _AddExtents(const volume_t & volume, const directory_entry_t * entry,
+                                std::vector<index_extent> & extents);
+};
+
+} // namespace
+
+#endif // PRODOSFS_INDEX_HXX
@@ -0,0 +1,37 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_LOG_HXX
+#define PRODOSFS_LOG_HXX
+
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace prodos
+{
+
+/*
+** Log messages are written to a stream as "name[level]: message" lines.
+**
+** Once started, the asynchronous log does not format messages in the calling thread.
+** Instead each thread appends a compact record of the format string pointer and the raw
+** argument values to a ring buffer of its own, and a background thread formats and
+** writes them. Strings are copied into the record, but the format string itself is not,
+** so it must outlive the log (in practice, it is a string literal). When a thread's ring
+** is full, its messages are dropped, and counted, rather than wait for the writer.
+*/
+void    LogInit(const char * name, FILE * stream);
+
+// Start or stop the background writer. Stopping writes any messages still in the rings.
+// Until the log is started and after it is stopped, messages are written synchronously.
+void    LogStartAsync();
+void    LogStopAsync();
+
+void    LogWrite(int level, const char * format, va_list ap);
+
+} // namespace
+
+#endif // PRODOSFS_LOG_HXX
@@ -0,0 +1,58 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_NIBBLE_HXX
+#define PRODOSFS_NIBBLE_HXX
+
+#include "prodos/disk.hxx"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace prodos
+{
+
+/*
+** The nibble decoder reads 5.25" disk images that were captured below the sector level,
+** either as the raw bytes ("nibbles") read from each track (.nib) or as the flux transitions
+** of each track (WOZ). Sectors are found by their address and data field prologues and
+** decoded from 6-and-2 GCR, one whole track at a time, into ProDOS block order.
+*/
+class nibble_decoder_t : public decoder_t
+{
+public:
+    nibble_decoder_t(const void * image, size_t size);
+
+    // Return true if the data looks like a .nib or WOZ image.
+    static bool         Recognize(const void * image, size_t size);
+
+    unsigned            NumBlocks()         const override  { return _tracks.size() * BLOCKS_PER_TRACK; }
+    unsigned            BlocksPerUnit()     const override  { return BLOCKS_PER_TRACK; }
+
+    void                Decode(unsigned unit, uint8_t * image, std::vector<bool> & decoded) override;
+
+private:
+    static constexpr unsigned   BLOCKS_PER_TRACK    = 8;
+    static constexpr unsigned   SECTORS_PER_TRACK   = 16;
+
+    // A track is either a sequence of nibbles or a stream of bits, most significant first.
+    struct track_t
+    {
+        const uint8_t *     data;
+        size_t              length;     // in bytes for nibbles, bits for bit streams
+        bool                bits;
+    };
+
+    std::vector<track_t>    _tracks;
+
+    void    _ParseWoz(const uint8_t * image, size_t size);
+    void    _ReadNibbles(const track_t & track, std::vector<uint8_t> & nibbles) const;
+    void    _DecodeTrack(unsigned index, uint8_t * dst) const;
+};
+
+} // namespace
+
+#endif // PRODOSFS_NIBBLE_HXX
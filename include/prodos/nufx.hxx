@@ -0,0 +1,70 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_NUFX_HXX
+#define PRODOSFS_NUFX_HXX
+
+#include "prodos/disk.hxx"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace prodos
+{
+
+/*
+** The NuFX decoder reads the disk image thread of a ShrinkIt archive (.sdk/.shk), which
+** stores the disk as a sequence of 4 KiB chunks (i.e. a 5.25" track), each compressed
+** with RLE and then LZW.
+**
+** LZW/1 chunks are compressed independently but their compressed length is not recorded,
+** and LZW/2 chunks carry the LZW table over from one chunk to the next, so in both cases
+** a chunk can only be found and decoded after the ones before it. Chunks are therefore
+** decoded in order, but only as far as the last one needed so far.
+*/
+class nufx_decoder_t : public decoder_t
+{
+public:
+    nufx_decoder_t(const void * archive, size_t size);
+
+    // Return true if the data looks like a NuFX archive, possibly wrapped in Binary II.
+    static bool         Recognize(const void * archive, size_t size);
+
+    unsigned            NumBlocks()         const override  { return _num_blocks; }
+    unsigned            BlocksPerUnit()     const override  { return CHUNK_SIZE / 512; }
+
+    void                Decode(unsigned unit, uint8_t * image, std::vector<bool> & decoded) override;
+
+private:
+    static constexpr size_t     CHUNK_SIZE  = 4096;
+    static constexpr unsigned   TABLE_SIZE  = 4096;
+
+    const uint8_t *     _thread         = nullptr;  // the compressed disk image thread
+    size_t              _thread_size    = 0;
+    unsigned            _format         = 0;
+    unsigned            _num_blocks     = 0;
+    uint8_t             _escape         = 0;        // RLE escape character
+    size_t              _position       = 0;        // offset of the next chunk in the thread
+    unsigned            _next_chunk     = 0;
+
+    // LZW state, which for LZW/2 persists from one chunk to the next.
+    uint16_t            _prefix[TABLE_SIZE] = {};
+    uint8_t             _suffix[TABLE_SIZE] = {};
+    unsigned            _entry          = 0;
+    unsigned            _old_code       = 0;
+    uint8_t             _final_char     = 0;
+    bool                _first_code     = true;
+
+    void        _FindDiskThread(const uint8_t * archive, size_t size);
+    void        _DecodeChunk(uint8_t * chunk);
+    void        _ResetTable();
+    size_t      _ExpandLzw(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len);
+    void        _ExpandRle(const uint8_t * src, size_t src_len, uint8_t * dst) const;
+};
+
+} // namespace
+
+#endif // PRODOSFS_NUFX_HXX
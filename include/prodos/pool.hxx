@@ -0,0 +1,154 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_POOL_HXX
+#define PRODOSFS_POOL_HXX
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace prodos
+{
+
+/*
+** A pool of objects that are referred to by 64-bit IDs instead of pointers, e.g. open file
+** handles kept in FUSE's file info. Objects live in slots that are allocated in chunks and
+** reused, so opening and closing does not allocate once the pool has grown. An ID is the
+** slot number (plus one, so no ID is 0) and the slot's generation, which is odd while the
+** slot is in use and changes every time it is allocated or released, so using an ID after
+** it has been released is detected rather than undefined.
+**
+** Allocating and releasing take a lock; looking an ID up does not.
+*/
+template <typename T, size_t CHUNK_SIZE = 256, size_t MAX_CHUNKS = 4096>
+class handle_pool_t
+{
+public:
+    handle_pool_t()                                 = default;
+    handle_pool_t(const handle_pool_t &)            = delete;
+    handle_pool_t &     operator=(const handle_pool_t &) = delete;
+
+    ~handle_pool_t()
+    {
+        for (auto & chunk : _chunks) {
+            auto slots = chunk.load();
+            if (slots == nullptr) {
+                break;
+            }
+            for (size_t i = 0; i < CHUNK_SIZE; i++) {
+                if (slots[i].generation % 2 == 1) {
+                    slots[i].Object()->~T();
+                }
+            }
+            delete [] slots;
+        }
+    }
+
+    // Default-construct an object in a free slot. Returns its ID, or 0 if the pool is full.
+    uint64_t    Allocate(T ** object)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        uint32_t index;
+        if (_free != NONE) {
+            index = _free;
+            _free = _Slot(index).next_free;
+        }
+        else if (_unused < CHUNK_SIZE * MAX_CHUNKS) {
+            index = _unused++;
+            auto & chunk = _chunks[index / CHUNK_SIZE];
+            if (chunk.load(std::memory_order_relaxed) == nullptr) {
+                chunk.store(new slot_t[CHUNK_SIZE], std::memory_order_release);
+            }
+        }
+        else {
+            return 0;
+        }
+
+        auto & slot = _Slot(index);
+        auto generation = slot.generation.load(std::memory_order_relaxed) + 1;
+        *object = new (slot.storage) T();
+        slot.generation.store(generation, std::memory_order_release);
+
+        return (uint64_t)generation << 32 | (index + 1);
+    }
+
+    // Return the object with the given ID, or nullptr if it has been released.
+    T *         Get(uint64_t id) const
+    {
+        auto slot = _Find(id);
+        return slot ? slot->Object() : nullptr;
+    }
+
+    // Destroy the object with the given ID. Returns false if it has already been released.
+    bool        Release(uint64_t id)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        auto slot = _Find(id);
+        if (slot == nullptr) {
+            return false;
+        }
+
+        slot->generation.fetch_add(1, std::memory_order_release);
+        slot->Object()->~T();
+        slot->next_free = _free;
+        _free = (uint32_t)((id & UINT32_MAX) - 1);
+
+        return true;
+    }
+
+private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    struct slot_t
+    {
+        std::atomic<uint32_t>           generation  = 0;
+        uint32_t                        next_free   = NONE;
+        alignas(T) unsigned char        storage[sizeof(T)];
+
+        T *     Object()    { return std::launder(reinterpret_cast<T *>(storage)); }
+    };
+
+    std::atomic<slot_t *>   _chunks[MAX_CHUNKS] = {};
+    std::mutex              _mutex;
+    uint32_t                _free       = NONE;     // the first free slot, linked by next_free
+    uint32_t                _unused     = 0;        // slots from here on have never been used
+
+    slot_t &    _Slot(uint32_t index)
+    {
+        return _chunks[index / CHUNK_SIZE].load(std::memory_order_relaxed)[index % CHUNK_SIZE];
+    }
+
+    slot_t *    _Find(uint64_t id) const
+    {
+        uint64_t    index       = (id & UINT32_MAX) - 1;
+        uint32_t    generation  = id >> 32;
+        if ((id & UINT32_MAX) == 0 || index >= CHUNK_SIZE * MAX_CHUNKS || generation % 2 == 0) {
+            return nullptr;
+        }
+
+        auto slots = _chunks[index / CHUNK_SIZE].load(std::memory_order_acquire);
+        if (slots == nullptr) {
+            return nullptr;
+        }
+
+        auto & slot = slots[index % CHUNK_SIZE];
+        if (slot.generation.load(std::memory_order_acquire) != generation) {
+            return nullptr;
+        }
+
+        return &slot;
+    }
+};
+
+} // namespace
+
+#endif // PRODOSFS_POOL_HXX
@@ -0,0 +1,40 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_PROBE_HXX
+#define PRODOSFS_PROBE_HXX
+
+/*
+** Static tracepoints (USDT) for perf, bpftrace and SystemTap, in the "prodosfs" provider.
+** A probe costs a nop plus setting up its arguments, which are evaluated whether or not a
+** tracer is attached, so they are always on but should only be given values that are
+** already at hand. For example:
+**
+**     bpftrace -e 'usdt:./prodosfs:prodosfs:read_block { @[arg0] = count(); }'
+**
+** Without <sys/sdt.h> (systemtap-sdt-devel), or with PRODOSFS_NO_PROBES defined, the
+** probes compile to nothing.
+*/
+#if defined(__has_include) && !defined(PRODOSFS_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PRODOSFS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef PRODOSFS_HAVE_PROBES
+#define PRODOS_PROBE0(name)                 DTRACE_PROBE(prodosfs, name)
+#define PRODOS_PROBE1(name, a)              DTRACE_PROBE1(prodosfs, name, a)
+#define PRODOS_PROBE2(name, a, b)           DTRACE_PROBE2(prodosfs, name, a, b)
+#define PRODOS_PROBE3(name, a, b, c)        DTRACE_PROBE3(prodosfs, name, a, b, c)
+#else
+#define PRODOS_PROBE0(name)                 do { } while (0)
+#define PRODOS_PROBE1(name, a)              do { } while (0)
+#define PRODOS_PROBE2(name, a, b)           do { } while (0)
+#define PRODOS_PROBE3(name, a, b, c)        do { } while (0)
+#endif
+
+#endif // PRODOSFS_PROBE_HXX
@@ -0,0 +1,134 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_SALVAGE_HXX
+#define PRODOSFS_SALVAGE_HXX
+
+#include "prodos/block.hxx"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace prodos
+{
+
+class disk_t;
+
+// What a block looks like to the salvage scan.
+enum salvage_block_t : uint8_t
+{
+    salvage_block_unknown,          // data, or nothing recognizable
+    salvage_block_zero,
+    salvage_block_volume_key,       // the key block of a volume directory
+    salvage_block_directory_key,    // the key block of a subdirectory
+    salvage_block_directory,        // a directory block after the key block
+    salvage_block_index,
+    salvage_block_bitmap,
+};
+
+const int SALVAGE_BLOCK_KINDS = salvage_block_bitmap + 1;
+
+// A file or directory found by the salvage scan.
+struct salvaged_file_t
+{
+    std::string             pathname;       // e.g. "/DIR/FILE", see salvage_t
+    directory_entry         entry;          // as found, with a deleted entry's storage type worked out
+    bool                    deleted     = false;
+    bool                    damaged     = false;    // it points to blocks it cannot use, left sparse
+    std::vector<uint16_t>   blocks;         // of a file's data, in order, 0 for sparse blocks
+
+    bool    IsDirectory() const     { return entry.storage_type_and_name_length >> 4 == 0xD; }
+};
+
+/*
+** Salvages what it can of an image whose volume cannot be mounted, or recovers deleted files
+** from one that can. A single pass over the image classifies every block by its signature
+** (directory key and continuation blocks, index blocks), without following any pointers.
+** The directories are then put together from the blocks that look like theirs, and linked
+** into trees: the volume directory's, which is "/", and those of subdirectories nothing
+** points to any more, which are put under "/ORPHANED/<NAME>.<key block>".
+**
+** Entries that have been deleted (storage type 0) are recovered too, if the blocks they
+** would use are free in the volume bitmap and not used by anything that has not been
+** deleted. Their storage type is worked out from their EOF, and an index block is read with
+** its halves in either order, as ProDOS may swap them when it destroys a file.
+*/
+class salvage_t
+{
+public:
+    explicit salvage_t(const std::string & pathname);
+    salvage_t(const salvage_t &)            = delete;
+    ~salvage_t();
+
+    void    Scan();
+
+    unsigned            NumBlocks()                 const;
+    salvage_block_t     BlockKind(unsigned block)   const   { return (salvage_block_t)_kinds[block]; }
+
+    // The files and directories found, sorted by pathname, so that each directory comes
+    // before what is in it.
+    const std::vector<salvaged_file_t> &    Files()         const   { return _files; }
+
+    // The deleted entries whose blocks are no longer free.
+    unsigned            Unrecoverable()             const   { return _unrecoverable; }
+
+    // Whether a volume bitmap was found to tell which blocks are free.
+    bool                HasBitmap()                 const   { return !_free.empty(); }
+
+    // Read a file's data, up to its EOF.
+    std::vector<uint8_t>    Read(const salvaged_file_t & file) const;
+
+private:
+    // A directory put together from its blocks.
+    struct directory_t
+    {
+        std::vector<uint16_t>   blocks;
+        std::string             name;
+        bool                    placed      = false;
+    };
+
+    std::shared_ptr<disk_t>             _disk;
+    std::vector<uint8_t>                _kinds;
+    std::map<uint16_t, directory_t>     _directories;   // by key block
+    std::vector<uint64_t>               _claimed;       // a bit for each block in use
+    std::vector<uint64_t>               _free;          // from the bitmap, if it was found
+    std::vector<salvaged_file_t>        _files;
+    unsigned                            _unrecoverable  = 0;
+
+    const uint8_t *     _Block(uint16_t block) const;
+
+    // Classify every block, and put the directories together.
+    void    _Classify();
+    void    _FindDirectories();
+    void    _ReadBitmap(uint16_t key_block);
+
+    // Add a directory's entries, and those of its subdirectories, to the files. The deleted
+    // entries are only gathered, to be recovered once all blocks in use are known.
+    void    _AddDirectory(uint16_t key_block, const std::string & pathname,
+                          std::vector<std::pair<std::string, directory_entry>> & deleted);
+
+    // Work out the data blocks of a file and claim the blocks it uses. Those of a deleted
+    // file have to be usable, or this returns false; a file in use is marked as damaged if
+    // it points past the end of the image or to blocks that are already claimed.
+    bool    _Layout(salvaged_file_t & file, bool recover);
+
+    // Recover a deleted entry found in the given directory. Returns false if its blocks are
+    // no longer free.
+    bool    _Recover(const std::string & directory, const directory_entry & entry,
+                     std::vector<std::pair<std::string, directory_entry>> & deleted);
+
+    bool    _IsClaimed(uint16_t block) const;
+    bool    _IsUsable(uint16_t block) const;   // free and not claimed
+    void    _Claim(uint16_t block);
+};
+
+} // namespace
+
+#endif // PRODOSFS_SALVAGE_HXX
@@ -0,0 +1,75 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_STATS_HXX
+#define PRODOSFS_STATS_HXX
+
+#include <string>
+
+#include <stdint.h>
+#include <time.h>
+
+namespace prodos
+{
+
+/*
+** The operations that are timed. FUSE operations cover the whole call, library operations
+** only the library's share of it.
+*/
+enum stat_id_t
+{
+    stat_fuse_getattr,
+    stat_fuse_open,
+    stat_fuse_read,
+    stat_fuse_release,
+    stat_fuse_getxattr,
+    stat_fuse_listxattr,
+    stat_fuse_opendir,
+    stat_fuse_readdir,
+    stat_fuse_releasedir,
+    stat_fuse_init,
+    stat_fuse_destroy,
+    stat_fuse_lseek,
+    stat_get_entry,
+    stat_read,
+    stat_next_entry,
+    stat_catalog,
+    STAT_COUNT
+};
+
+// Record one call of an operation that took the given time. Each thread counts into its own
+// counters, so recording never waits on other threads.
+void RecordStat(stat_id_t id, uint64_t nanoseconds);
+
+// Return a text report of the call counts and latency histograms of all threads so far.
+std::string StatsReport();
+
+inline uint64_t StatClock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+** Times the scope it is declared in.
+*/
+class stat_timer_t
+{
+public:
+    explicit stat_timer_t(stat_id_t id) : _id(id), _start(StatClock()) { }
+    ~stat_timer_t() { RecordStat(_id, StatClock() - _start); }
+    stat_timer_t(const stat_timer_t &)                  = delete;
+    stat_timer_t &  operator=(const stat_timer_t &)     = delete;
+
+private:
+    stat_id_t   _id;
+    uint64_t    _start;
+};
+
+} // namespace
+
+#endif // PRODOSFS_STATS_HXX
@@ -0,0 +1,72 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#ifndef PRODOSFS_TRACE_HXX
+#define PRODOSFS_TRACE_HXX
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace prodos
+{
+
+/*
+** The block trace records every block a volume reads, so that real access patterns can be
+** replayed later (see util/replay.cxx). The trace file is a header followed by fixed-size
+** records in the order the reads happened.
+*/
+enum trace_category_t : uint8_t
+{
+    trace_other,
+    trace_directory,
+    trace_index,
+    trace_data,
+    trace_bitmap,
+    TRACE_CATEGORY_COUNT
+};
+
+struct trace_header
+{
+    char        magic[8];           // "PDTRACE1"
+    uint32_t    record_size;
+    uint32_t    reserved;
+};
+
+struct trace_record
+{
+    uint64_t    nanoseconds;        // since the trace started
+    uint32_t    block;              // disk block, not volume block
+    uint8_t     category;
+    uint8_t     reserved[3];
+};
+
+extern std::atomic<bool>    tracing;
+
+// Start recording block reads to a new trace file, or stop and flush it. Returns false if
+// the file cannot be created.
+bool    TraceStart(const std::string & pathname);
+void    TraceStop();
+
+void    TraceBlockSlow(unsigned block, trace_category_t category);
+
+inline void TraceBlock(unsigned block, trace_category_t category)
+{
+    if (tracing.load(std::memory_order_relaxed)) {
+        TraceBlockSlow(block, category);
+    }
+}
+
+// Read a whole trace file. Returns false if it is not a trace file.
+bool    ReadTrace(const std::string & pathname, std::vector<trace_record> & records);
+
+const char *    TraceCategoryName(unsigned category);
+
+} // namespace
+
+#endif // PRODOSFS_TRACE_HXX
@@ -7,7 +7,10 @@
 #ifndef PRODOSFS_UTIL_HXX
 #define PRODOSFS_UTIL_HXX
 
+#include <array>
+#include <atomic>
 #include <string>
+#include <string_view>
 
 #include <stdint.h>
 
@@ -45,12 +48,33 @@ enum log_level_t
 
 typedef void (*Logger)(int level, const char *format, ...);
 
-extern Logger LOG;
+// The logger may be replaced while other threads are logging.
+extern std::atomic<Logger> LOG;
 
 void SetLogger(Logger func);
 
 std::string AppleWorksFileName(const std::string & filename, uint16_t aux_type);
 
+// ProDOS ignores the case of names, and only ASCII letters have case. Folding through a table
+// is cheaper than toupper() and does not depend on the locale.
+inline constexpr std::array<uint8_t, 256> FOLD_CASE = [] {
+    std::array<uint8_t, 256> table = {};
+    for (int c = 0; c < 256; c++) {
+        table[c] = c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+    }
+    return table;
+}();
+
+inline bool NamesEqual(const char *a, const char *b, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        if (FOLD_CASE[(uint8_t)a[i]] != FOLD_CASE[(uint8_t)b[i]]) {
+            return false;
+        }
+    }
+    return true;
+}
+
 inline uint16_t LE_Read16(const uint8_t *p)
 {
     return *(p + 1) << 8 | *(p + 0);
@@ -61,6 +85,34 @@ inline uint32_t LE_Read24(const uint8_t *p)
     return *(p + 2) << 16 | *(p + 1) << 8 | *(p + 0);
 }
 
+inline uint32_t LE_Read32(const uint8_t *p)
+{
+    return (uint32_t)*(p + 3) << 24 | *(p + 2) << 16 | *(p + 1) << 8 | *(p + 0);
+}
+
+inline void LE_Write16(uint8_t *p, uint16_t value)
+{
+    *(p + 0) = value & 0xFF;
+    *(p + 1) = value >> 8;
+}
+
+inline void LE_Write24(uint8_t *p, uint32_t value)
+{
+    *(p + 0) = value & 0xFF;
+    *(p + 1) = (value >> 8) & 0xFF;
+    *(p + 2) = (value >> 16) & 0xFF;
+}
+
+inline uint16_t BE_Read16(const uint8_t *p)
+{
+    return *(p + 0) << 8 | *(p + 1);
+}
+
+inline uint32_t BE_Read32(const uint8_t *p)
+{
+    return (uint32_t)*(p + 0) << 24 | *(p + 1) << 16 | *(p + 2) << 8 | *(p + 3);
+}
+
 [[maybe_unused]] void DumpBlock(const void *ptr);
 
 } // namespace
@@ -11,6 +11,16 @@
 #include "prodos/disk.hxx"
 #include "prodos/entry.hxx"
 #include "prodos/file.hxx"
+#include "prodos/index.hxx"
+#include "prodos/trace.hxx"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace prodos
 {
@@ -49,6 +59,36 @@ enum storage_type_t
     storage_type_volume_block   = 0xF,
 };
 
+// What a visitor has volume_t::Walk do after an entry.
+enum walk_action_t
+{
+    walk_continue,      // go on, into the entry if it is a directory
+    walk_prune,         // go on, but not into the entry
+    walk_stop,
+};
+
+// Called by volume_t::Walk for each entry, with its pathname (e.g. "/DIR/FILE"), which is
+// only valid during the call, and its depth, 0 for the entries of the directory walked.
+using walk_visitor_t = std::function<walk_action_t(const directory_entry_t * entry, std::string_view pathname,
+                                                   int depth)>;
+
+// A file or directory whose contents, attributes or listing changed in a refresh.
+struct volume_change_t
+{
+    std::string     pathname;               // "/" for the volume directory
+    int             old_file_type   = -1;   // the type it had if it was a file, else -1
+
+    bool    operator<(const volume_change_t & other) const
+    {
+        return pathname != other.pathname ? pathname < other.pathname : old_file_type < other.old_file_type;
+    }
+
+    bool    operator==(const volume_change_t & other) const
+    {
+        return pathname == other.pathname && old_file_type == other.old_file_type;
+    }
+};
+
 /*
 ** The volume encapsulates an "on-line" (mounted) ProDOS volume.
 */
@@ -56,9 +96,16 @@ class volume_t
 {
 public:
     explicit volume_t(const std::string & pathname);
+    explicit volume_t(std::shared_ptr<disk_t> disk);
+    volume_t(std::shared_ptr<disk_t> disk, const partition_t & partition);
     volume_t(const volume_t &)                = delete;
     ~volume_t()                               = default;
 
+    // Returns the ProDOS partitions of a partitioned disk, either from its Apple partition
+    // map or, for CFFA-style images, by splitting it into consecutive 32 MiB volumes. A disk
+    // that holds a single volume has no partitions.
+    static std::vector<partition_t>     FindPartitions(const disk_t & disk);
+
     std::string     Name()          const;
     int             FileCount()     const;
     int             TotalBlocks()   const;
@@ -66,11 +113,25 @@ public:
     // Returns the directory entry for the given pathname, if found,
     // EXCEPT when the pathname is "/", in which case the root
     // directory header is returned.
-    const entry_t *         GetEntry(const std::string & pathname) const;
+    const entry_t *         GetEntry(std::string_view pathname) const;
+
+    directory_handle_t *    OpenDirectory(std::string_view pathname) const;
 
-    directory_handle_t *    OpenDirectory(const std::string & pathname) const;
+    file_handle_t *         OpenFile(std::string_view pathname) const;
 
-    file_handle_t *         OpenFile(const std::string & pathname) const;
+    // Open a directory or file in a handle the caller provides (e.g. from a handle_pool_t),
+    // so that nothing is allocated. Returns false on error.
+    bool    OpenDirectory(std::string_view pathname, directory_handle_t & handle) const;
+    bool    OpenFile(std::string_view pathname, file_handle_t & handle) const;
+
+    // Visit the entries of a directory and its subdirectories depth first, in the order of
+    // the directories, following key pointers rather than looking up pathnames. A directory
+    // is walked right after its entry is visited, unless the visitor prunes it, e.g. to have
+    // another thread walk it with the second form. Returns false if the directory is not
+    // found or is damaged, which may be after some entries have been visited.
+    bool    Walk(std::string_view pathname, const walk_visitor_t & visitor) const;
+    bool    Walk(const directory_entry_t * directory, std::string_view pathname,
+                 const walk_visitor_t & visitor) const;
 
     // Gets the block specified in the index, EXCEPT when the index is 0,
     // in which case it returns a block containing only zeros. This is used
@@ -78,12 +139,25 @@ public:
     //
     // Block 0 is supposed to contains the ProDOS bootloader, not user data,
     // so it should not be necessary to read the real block.
-    const void *    GetBlock(int index) const;
+    //
+    // The category says what the block is used for, if it is traced.
+    const void *    GetBlock(int index, trace_category_t category = trace_data) const;
+
+    // Say that blocks are about to be read (see disk_t::WillNeed).
+    void    WillNeed(unsigned index, unsigned count) const;
+
+    // Ask for the bitmap and directory blocks ahead of time, so that the first lookups do not
+    // wait for them to be read from the image file. With an index, the directory blocks are
+    // all asked for at once; without, they are read in a walk of the directories.
+    void    Prefault() const;
 
     // These are not stored as data fields, so they really have to be counted.
     int     CountBlocksUsed()           const;
     int     CountRootDirectoryBlocks()  const;
 
+    // Return true if the volume bitmap marks the block as free.
+    bool    IsBlockFree(unsigned block) const;
+
     // Return or clear the last ProDOS error that occurred in the calling thread.
     static err_t            Error();
     static void             ClearError();
@@ -94,23 +168,88 @@ public:
     // Return true if the underlying disk has been modified.
     bool    IsDirty()  const
     {
-        return _disk.IsDirty();
+        return _disk->IsDirty();
     }
 
     // Change the volume name.
     bool    Rename(const std::string & name);
 
     // Write the underlying disk to a file. Returns false on failure.
-    bool    Save(const std::string & pathname) const
+    bool    Save(const std::string & pathname) const;
+
+    // Return true if the volume was mounted with an up-to-date index (see index.hxx).
+    bool    IsIndexed() const
+    {
+        return _index != nullptr;
+    }
+
+    // Build the index of the volume and write it next to the image. Partitions and protected
+    // disks are not indexed. Returns false if the index is not written.
+    bool    WriteIndex() const;
+
+    // Start keeping track of the volume's contents, so that Refresh can tell what another
+    // program (e.g. an emulator) changes in the image file. Partitions, encoded images and
+    // protected disks cannot be tracked, so this returns false for them.
+    bool    TrackChanges();
+
+    // Pick up the changes made to the image file since TrackChanges or the last refresh,
+    // without remounting. Adds the files and directories whose contents, attributes or
+    // listings changed, with the file types files had, which names may depend on (e.g. those
+    // with the type as an extension). Returns false
+    // if the changes cannot be picked up, e.g. because the image file's size has changed.
+    //
+    // The blocks of the volume change in place, so nothing may use it meanwhile (e.g. take
+    // a lock that every reader of the volume takes shared).
+    bool    Refresh(std::vector<volume_change_t> & changed);
+
+    // How many times a refresh has found the directories changed, so that positions in
+    // them from before can be told apart.
+    unsigned    Generation() const
     {
-        return _disk.Save(pathname);
+        return _generation;
     }
 
 private:
-    disk_t              _disk;
-    directory_block *   _root;
+    std::shared_ptr<disk_t>     _disk;
+    unsigned                    _first_block    = 0;
+    unsigned                    _num_blocks     = 0;
+    bool                        _partition      = false;
+    bool                        _obfuscated     = false;
+    directory_block *           _root           = nullptr;
+
+    // The index in use, if any. A refresh replaces it, but the last few indexes it replaced
+    // are kept, as other threads may still be looking names up in them. The generation
+    // counts the replacements, so that file handles know when their extents are out of date.
+    static const size_t                     MAX_INDEXES     = 4;
+    std::atomic<const index_t *>            _index          = nullptr;
+    std::vector<std::unique_ptr<index_t>>   _indexes;
+    std::atomic<unsigned>                   _generation     = 0;
+    index_key                               _index_key      = {};
+    bool                                    _tracking       = false;
 
+    // For disks that are obfuscated throughout, the blocks that have been deobfuscated.
+    // Everything else about a volume is fixed once it is mounted.
+    mutable std::vector<bool>   _deobfuscated;
+    mutable std::mutex          _deobfuscate_mutex;
+
+    void                _Mount();
     directory_block *   _GetVolumeDirectoryBlock();
+    void                _StartDeobfuscation(const void * key_block);
+
+    void                _SetIndex(std::unique_ptr<index_t> index);
+
+    // Return the directory entry an index entry points to, or nullptr if it is not there.
+    const directory_entry_t *   _IndexedEntry(const index_entry & indexed) const;
+
+    // Walk the directory with the given key block, whose pathname is "" for the root.
+    bool    _Walk(uint16_t key_pointer, std::string_view pathname, const walk_visitor_t & visitor) const;
+
+    // Read or write a block of the volume, which may be a partition of the disk.
+    const void *        _ReadBlock(int index, trace_category_t category = trace_other) const;
+    void                _WriteBlock(int index, const void * block);
+
+    friend class file_handle_t;
+    friend class volume_builder_t;
 };
 
 } // namespace
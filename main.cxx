@@ -7,17 +7,28 @@
 #define FUSE_USE_VERSION 30
 
 #include "prodos.hxx"
+#include "prodos/pool.hxx"
+#include "prodos/probe.hxx"
 
 #include <fuse.h>
 
+#include <algorithm>
+#include <atomic>
+#include <charconv>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 
 using namespace prodos;
@@ -28,9 +39,36 @@ static bool         foreground = false;
 static bool         use_name = false;
 static int          log_level = LOG_INFO;
 static int          log_fd = 0;
+static const char * trace_file = nullptr;
+static bool         watch = false;
+static bool         prefault = false;
+static bool         write_index = false;
 static bool         debug = false;
 static volume_t *   volume = nullptr;
 
+// With -w, a thread watches the image file and refreshes the volume when it changes.
+static struct fuse *        fuse_instance = nullptr;
+static std::thread          watcher;
+static std::atomic<bool>    watcher_stop = false;
+
+// A refresh changes the image's blocks in place (remapping it, and converting it again if
+// it is in DOS order), so it waits for the operations that are reading them, and they wait
+// for it.
+static std::shared_mutex    refresh_mutex;
+
+// A partitioned disk has no volume of its own. Instead each partition is a subdirectory of
+// the mount, named by its number, and its volume is opened the first time it is accessed.
+static std::shared_ptr<disk_t>                  disk;
+static std::vector<partition_t>                 partitions;
+static std::vector<std::unique_ptr<volume_t>>   partition_volumes;
+static std::mutex                               partition_mutex;
+
+// Open files and directories, and the contents of open virtual files, are kept in pools, and
+// FUSE's file info holds their IDs. The root directory of a partitioned disk is ID 0.
+static handle_pool_t<file_handle_t>         file_handles;
+static handle_pool_t<directory_handle_t>    directory_handles;
+static handle_pool_t<std::string>           virtual_file_contents;
+
 typedef std::unordered_map<std::string, std::string>    attributes_t;
 
 enum text_mode_t
@@ -61,12 +99,14 @@ static virtual_file_mode_t virtual_file_mode = virtual_file_mode_hidden;
 enum virtual_file_id_t
 {
     virtual_file_id_none,
-    virtual_file_id_catalog
+    virtual_file_id_catalog,
+    virtual_file_id_stats
 };
 
 static std::unordered_map<std::string, virtual_file_id_t> virtual_files
 {
     { ".CATALOG", virtual_file_id_catalog },
+    { ".STATS", virtual_file_id_stats },
 };
 
 //================================================================================================
@@ -77,11 +117,9 @@ static void S_LogMessage(int level, const char *format, ...)
 {
     if (level <= log_level) {
         va_list ap;
-        fprintf(stderr, "%s[%02d]: ", "prodosfs", level);
         va_start(ap, format);
-        vfprintf(stderr, format, ap);
+        LogWrite(level, format, ap);
         va_end(ap);
-        fprintf(stderr, "\n");
     }
 }
 
@@ -145,34 +183,100 @@ static std::string S_AuxTypeToString(uint16_t aux_type)
     return { buffer };
 }
 
-static std::string S_ExportedFilename(const directory_entry_t * entry)
+// The name of a file, with its type as an extension if asked for, or of a directory, whose
+// file type is given as -1.
+static std::string S_ExportedFilename(std::string_view prodos_name, int file_type)
 {
-    std::string name = entry->FileName();
-    if (extension_mode == extension_mode_on && entry->IsFile()) {
-        auto file_type = GetFileTypeInfo(entry->FileType());
+    std::string name(prodos_name);
+    if (extension_mode == extension_mode_on && file_type >= 0) {
         name += ":";
-        name += file_type->name;
+        name += GetFileTypeInfo(file_type)->name;
     }
     return name;
 }
 
-static std::string S_ProdosFilename(const std::string & pathname)
+static std::string S_ExportedFilename(const directory_entry_t * entry)
+{
+    return S_ExportedFilename(entry->FileName(), entry->IsFile() ? entry->FileType() : -1);
+}
+
+static std::string_view S_ProdosFilename(std::string_view pathname)
 {
-    std::string name = pathname;
     size_t pos = -1;
-    if (extension_mode == extension_mode_on && (pos = name.rfind(':')) != std::string::npos) {
-        name.erase(pos, name.length());
+    if (extension_mode == extension_mode_on && (pos = pathname.rfind(':')) != std::string_view::npos) {
+        pathname.remove_suffix(pathname.length() - pos);
     }
-    return name;
+    return pathname;
 }
 
 
+// The blocks of a file, e.g. "key=520 index=520-523 data=524-539,hole:3,600-601", the data
+// runs being in file order.
+static std::string S_LayoutToString(const file_layout_t & layout)
+{
+    auto run = [](uint16_t first, size_t count) {
+        return count == 1 ? std::to_string(first)
+                          : std::to_string(first) + "-" + std::to_string(first + count - 1);
+    };
+
+    std::string str = "key=" + std::to_string(layout.key_block);
+
+    for (size_t i = 0; i < layout.index_blocks.size(); ) {
+        size_t count = 1;
+        while (i + count < layout.index_blocks.size() &&
+               layout.index_blocks[i + count] == layout.index_blocks[i] + count) {
+            count++;
+        }
+        str += (i == 0 ? " index=" : ",") + run(layout.index_blocks[i], count);
+        i += count;
+    }
+
+    for (size_t i = 0; i < layout.extents.size(); i++) {
+        const auto & extent = layout.extents[i];
+        str += i == 0 ? " data=" : ",";
+        str += extent.disk_block == 0 ? "hole:" + std::to_string(extent.count)
+                                      : run(extent.disk_block, extent.count);
+    }
+
+    return str;
+}
+
+// Working out the layout of a file takes reading its index blocks, so it is only done once,
+// until the image changes.
+static std::mutex                                           layout_mutex;
+static std::unordered_map<const entry_t *, std::string>     layout_cache;
+
+static std::string S_GetLayout(const volume_t * volume, std::string_view pathname, const entry_t * entry)
+{
+    {
+        std::lock_guard<std::mutex> lock(layout_mutex);
+        auto itr = layout_cache.find(entry);
+        if (itr != layout_cache.end()) {
+            return itr->second;
+        }
+    }
+
+    file_handle_t fh;
+    if (volume->OpenFile(pathname, fh) == false) {
+        return {};
+    }
+
+    file_layout_t layout;
+    fh.Layout(&layout);
+    auto str = S_LayoutToString(layout);
+
+    std::lock_guard<std::mutex> lock(layout_mutex);
+    layout_cache[entry] = str;
+
+    return str;
+}
+
 inline std::string XATTR(const char *name)
 {
     return std::string("prodos.") + name;
 }
 
-static attributes_t S_GetAttributes(const entry_t * entry)
+static attributes_t S_GetAttributes(const volume_t * volume, std::string_view pathname, const entry_t * entry)
 {
     attributes_t    attributes;
 
@@ -189,14 +293,21 @@ static attributes_t S_GetAttributes(const entry_t * entry)
         auto info = GetFileTypeInfo(dirent->FileType());
         attributes[XATTR("file_type")] = info->type;
         attributes[XATTR("file_type_name")] = info->name;
-        attributes[XATTR("file_type_description")] = info->description;
+
+        // The description also covers what the aux type says, e.g. a ShrinkIt archive.
+        auto subtype_info = GetFileTypeInfo(dirent->FileType(), dirent->AuxType());
+        attributes[XATTR("file_type_description")] = subtype_info->description;
 
         attributes[XATTR("aux_type")] = S_AuxTypeToString(dirent->AuxType());
 
         if (IsAppleWorksFile(dirent->FileType())) {
-            auto name = AppleWorksFileName(dirent->FileName(), dirent->AuxType());
+            auto name = AppleWorksFileName(std::string(dirent->FileName()), dirent->AuxType());
             attributes[XATTR("appleworks_filename")] = name;
         }
+
+        if (entry->IsFile()) {
+            attributes[XATTR("extents")] = S_GetLayout(volume, pathname, entry);
+        }
     }
     else if (entry->IsRoot()) {
         attributes[XATTR("volume_name")] = volume->Name();
@@ -220,9 +331,177 @@ static virtual_file_id_t S_VirtualFileId(const std::string & pathanme)
         return virtual_file_id_none;
     }
 
+    // Statistics are for the whole mount, so they are only in its root. The root of a
+    // partitioned disk is not a ProDOS directory, so it has no catalog.
+    bool in_root = std::filesystem::path(pathanme).parent_path() == "/";
+    if (virtual_file->second == virtual_file_id_stats && !in_root) {
+        return virtual_file_id_none;
+    }
+    else if (virtual_file->second == virtual_file_id_catalog && in_root && !partitions.empty()) {
+        return virtual_file_id_none;
+    }
+
     return virtual_file->second;
 }
 
+static volume_t * S_OpenPartition(size_t index)
+{
+    std::lock_guard<std::mutex> lock(partition_mutex);
+
+    if (!partition_volumes[index]) {
+        auto & partition = partitions[index];
+        try {
+            partition_volumes[index] = std::make_unique<volume_t>(disk, partition);
+            if (prefault) {
+                partition_volumes[index]->Prefault();
+            }
+            S_LogMessage(LOG_INFO, "opened partition %zu at block %u: %s", index + 1,
+                                   partition.first_block, partition_volumes[index]->Name().c_str());
+        }
+        catch (std::exception & e) {
+            S_LogMessage(LOG_ERROR, "unable to open partition %zu at block %u: %s", index + 1,
+                                    partition.first_block, e.what());
+            return nullptr;
+        }
+    }
+
+    return partition_volumes[index].get();
+}
+
+// Find the volume a path is in and the path within that volume. The volume is set to nullptr
+// for the root of a partitioned disk, which is not in any volume. Returns 0 or -errno.
+// The pathname within the volume is a view of the path, so resolving it allocates nothing.
+static int S_ResolvePath(std::string_view path, volume_t ** vol, std::string_view * pathname)
+{
+    if (partitions.empty()) {
+        *vol = volume;
+        *pathname = path;
+        return 0;
+    }
+
+    if (path == "/") {
+        *vol = nullptr;
+        *pathname = path;
+        return 0;
+    }
+
+    auto end = path.find('/', 1);
+    auto name = path.substr(1, end == std::string_view::npos ? std::string_view::npos : end - 1);
+    size_t index = 0;
+    auto result = std::from_chars(name.data(), name.data() + name.length(), index);
+    if (result.ec != std::errc() || result.ptr != name.data() + name.length() || name[0] == '0' ||
+        index < 1 || index > partitions.size()) {
+        return -ENOENT;
+    }
+
+    *vol = S_OpenPartition(index - 1);
+    if (*vol == nullptr) {
+        return -EIO;
+    }
+    *pathname = end == std::string_view::npos ? "/" : path.substr(end);
+
+    return 0;
+}
+
+// Pick up the changes to the image and drop what the kernel has cached for the files and
+// directories that changed.
+static void S_RefreshImage()
+{
+    std::vector<volume_change_t> changed;
+    std::unique_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+    bool refreshed = volume->Refresh(changed);
+    refresh_lock.unlock();
+
+    if (refreshed == false) {
+        S_LogMessage(LOG_ERROR, "unable to pick up changes to %s, remount it", disk_image);
+        return;
+    }
+    else if (changed.empty()) {
+        return;
+    }
+
+    S_LogMessage(LOG_INFO, "%s changed, invalidating %zu paths", disk_image, changed.size());
+
+    {
+        std::lock_guard<std::mutex> lock(layout_mutex);
+        layout_cache.clear();
+    }
+
+    for (const auto & change : changed) {
+        const auto & pathname = change.pathname;
+        auto path = pathname;
+        auto dir = std::filesystem::path(pathname).parent_path().string();
+        auto entry = volume->GetEntry(pathname);
+        if (entry && entry->IsFile()) {
+            path = (dir == "/" ? "" : dir) + "/" + S_ExportedFilename((const directory_entry_t *)entry);
+        }
+
+        // Paths the kernel does not know about (-ENOENT) have nothing cached.
+        S_LogMessage(LOG_DEBUG1, "invalidating %s", path.c_str());
+        fuse_invalidate_path(fuse_instance, path.c_str());
+        if (entry == nullptr || !entry->IsFile()) {
+            fuse_invalidate_path(fuse_instance, (path == "/" ? "" : path).append("/.CATALOG").c_str());
+        }
+
+        // A file that has gone or changed type was known by the name its old type gave it.
+        if (change.old_file_type >= 0) {
+            auto name = std::filesystem::path(pathname).filename().string();
+            auto old_path = (dir == "/" ? "" : dir) + "/" + S_ExportedFilename(name, change.old_file_type);
+            if (old_path != path) {
+                S_LogMessage(LOG_DEBUG1, "invalidating %s", old_path.c_str());
+                fuse_invalidate_path(fuse_instance, old_path.c_str());
+            }
+        }
+    }
+}
+
+static void S_WatchImage()
+{
+    const int QUIET_MS = 100;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        S_LogMessage(LOG_ERROR, "unable to watch %s: %s", disk_image, strerror(errno));
+        return;
+    }
+
+    liberator_t<int, int (*)(int)> closer(fd, close);
+
+    // The directory is watched rather than the file, so that an image replaced by renaming
+    // a new file over it is noticed as well.
+    auto image = std::filesystem::path(disk_image);
+    auto mask = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE;
+    if (inotify_add_watch(fd, image.parent_path().c_str(), mask) < 0) {
+        S_LogMessage(LOG_ERROR, "unable to watch %s: %s", disk_image, strerror(errno));
+        return;
+    }
+
+    S_LogMessage(LOG_INFO, "watching %s for changes", disk_image);
+
+    bool pending = false;
+    while (!watcher_stop) {
+        pollfd pfd = { fd, POLLIN, 0 };
+        int n = poll(&pfd, 1, QUIET_MS);
+        if (n > 0) {
+            alignas(inotify_event) char buffer[4096];
+            ssize_t length;
+            while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+                for (auto p = buffer; p < buffer + length; ) {
+                    auto event = (const inotify_event *)p;
+                    pending |= event->len > 0 && image.filename() == event->name;
+                    p += sizeof(inotify_event) + event->len;
+                }
+            }
+        }
+        else if (n == 0 && pending) {
+            // An image is usually written in several steps, so wait until it has been left
+            // alone for a while.
+            pending = false;
+            S_RefreshImage();
+        }
+    }
+}
+
 static void S_Cleanup()
 {
     // mount_dir must still be valid after main() exits
@@ -236,8 +515,10 @@ static void S_Cleanup()
 
 static int prodosfs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi)
 {
+    stat_timer_t timer(stat_fuse_getattr);
+    PRODOS_PROBE1(fuse_getattr, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_getattr(\"%s\", %p, %p)", path, st, fi);
-    std::string filename = S_ProdosFilename(path);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
 
     if (virtual_file_mode != virtual_file_mode_none) {
         auto id = S_VirtualFileId(path);
@@ -250,6 +531,18 @@ static int prodosfs_getattr(const char *path, struct stat *st, struct fuse_file_
         }
     }
 
+    volume_t *  volume = nullptr;
+    std::string_view filename;
+    int rv = S_ResolvePath(S_ProdosFilename(path), &volume, &filename);
+    if (rv != 0) {
+        return rv;
+    }
+    else if (volume == nullptr) {
+        st->st_nlink = 2;
+        st->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IXUSR | S_IXGRP;
+        return 0;
+    }
+
     auto entry = volume->GetEntry(filename);
     if (entry == nullptr) {
         return -S_ToError(volume_t::Error());
@@ -287,51 +580,88 @@ static int prodosfs_getattr(const char *path, struct stat *st, struct fuse_file_
 
 static int prodosfs_open(const char *path, struct fuse_file_info * fi)
 {
+    stat_timer_t timer(stat_fuse_open);
+    PRODOS_PROBE1(fuse_open, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_open(\"%s\", %p)", path, fi);
-    std::string filename = S_ProdosFilename(path);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+
+    auto id = virtual_file_mode != virtual_file_mode_none ? S_VirtualFileId(path) : virtual_file_id_none;
+    std::string * contents = nullptr;
+    if (id == virtual_file_id_stats) {
+        fi->fh = virtual_file_contents.Allocate(&contents);
+        if (fi->fh == 0) {
+            return -EMFILE;
+        }
+        *contents = StatsReport();
+        return 0;
+    }
 
-    if (virtual_file_mode != virtual_file_mode_none) {
-        auto id = S_VirtualFileId(filename);
-        if (id == virtual_file_id_catalog) {
-            auto catalog = volume->Catalog(filename);
-            fi->fh = reinterpret_cast<uintptr_t>(catalog);
-            return 0;
+    volume_t *  volume = nullptr;
+    std::string_view filename;
+    int rv = S_ResolvePath(S_ProdosFilename(path), &volume, &filename);
+    if (rv != 0) {
+        return rv;
+    }
+    else if (volume == nullptr) {
+        return -EISDIR;
+    }
+
+    if (id == virtual_file_id_catalog) {
+        std::unique_ptr<std::string> catalog(volume->Catalog(std::string(filename)));
+        if (catalog == nullptr) {
+            return -S_ToError(volume_t::Error());
         }
-        else if (id != virtual_file_id_none) {
-            throw std::logic_error("unexpected virtual file id");
+        fi->fh = virtual_file_contents.Allocate(&contents);
+        if (fi->fh == 0) {
+            return -EMFILE;
         }
+        contents->swap(*catalog);
+        return 0;
+    }
+    else if (id != virtual_file_id_none) {
+        throw std::logic_error("unexpected virtual file id");
     }
 
-    auto fh = volume->OpenFile(filename);
-    if (fh == nullptr) {
+    file_handle_t * fh = nullptr;
+    auto handle_id = file_handles.Allocate(&fh);
+    if (handle_id == 0) {
+        return -EMFILE;
+    }
+    else if (volume->OpenFile(filename, *fh) == false) {
+        file_handles.Release(handle_id);
         return -S_ToError(volume_t::Error());
     }
 
-    fi->fh = reinterpret_cast<uintptr_t>(fh);
+    fi->fh = handle_id;
 
     return 0;
 }
 
 static int prodosfs_read(const char *path, char *buf, size_t bufsiz, off_t off, struct fuse_file_info * fi)
 {
+    stat_timer_t timer(stat_fuse_read);
+    PRODOS_PROBE3(fuse_read, path, off, bufsiz);
     S_LogMessage(LOG_DEBUG1, "prodosfs_read(\"%s\", %zd, %p)", path, off, fi);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
 
     if (virtual_file_mode != virtual_file_mode_none) {
         auto id = S_VirtualFileId(path);
         if (id != virtual_file_id_none) {
-            auto data = reinterpret_cast<std::string *>(fi->fh);
-            return (int)data->copy(buf, bufsiz, off);
+            auto data = virtual_file_contents.Get(fi->fh);
+            if (data == nullptr) {
+                return -EBADF;
+            }
+            return off < (off_t)data->size() ? (int)data->copy(buf, bufsiz, off) : 0;
         }
     }
 
-    auto fh = reinterpret_cast<file_handle_t *>(fi->fh);
-    auto pos = fh->Seek(off, SEEK_SET);
-    if (pos < 0) {
-        return -S_ToError(volume_t::Error());
+    // Several threads may read the same open file at once, so the file position is not used.
+    auto fh = file_handles.Get(fi->fh);
+    if (fh == nullptr) {
+        return -EBADF;
     }
-
-    size_t n = fh->Read(buf, bufsiz);
-    if (n == 0 && fh->Eof() == false) {
+    auto n = fh->ReadAt(off, buf, bufsiz);
+    if (n < 0) {
         return -S_ToError(volume_t::Error());
     }
 
@@ -348,36 +678,87 @@ static int prodosfs_read(const char *path, char *buf, size_t bufsiz, off_t off,
     return (int)n;
 }
 
+// Answer SEEK_DATA and SEEK_HOLE from the index blocks, so that sparse files can be copied
+// without reading their holes. The kernel handles the other kinds of seek itself.
+static off_t prodosfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi)
+{
+    stat_timer_t timer(stat_fuse_lseek);
+    PRODOS_PROBE3(fuse_lseek, path, off, whence);
+    S_LogMessage(LOG_DEBUG1, "prodosfs_lseek(\"%s\", %zd, %d, %p)", path, off, whence, fi);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    if (virtual_file_mode != virtual_file_mode_none) {
+        auto id = S_VirtualFileId(path);
+        if (id != virtual_file_id_none) {
+            auto data = virtual_file_contents.Get(fi->fh);
+            if (data == nullptr) {
+                return -EBADF;
+            }
+            else if (off < 0 || off >= (off_t)data->size()) {
+                return -ENXIO;
+            }
+            return whence == SEEK_DATA ? off : (off_t)data->size();
+        }
+    }
+
+    auto fh = file_handles.Get(fi->fh);
+    if (fh == nullptr) {
+        return -EBADF;
+    }
+
+    // Past the end of the file, or no data after the offset.
+    auto offset = fh->FindData(off, whence);
+    return offset < 0 ? -ENXIO : offset;
+}
+
 static int prodosfs_close(const char *path, struct fuse_file_info *fi)
 {
+    stat_timer_t timer(stat_fuse_release);
+    PRODOS_PROBE1(fuse_release, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_close(\"%s\", %p)", path, fi);
 
     if (virtual_file_mode != virtual_file_mode_none) {
         auto id = S_VirtualFileId(path);
         if (id != virtual_file_id_none) {
-            auto data = reinterpret_cast<std::string *>(fi->fh);
-            delete data;
-            return 0;
+            return virtual_file_contents.Release(fi->fh) ? 0 : -EBADF;
         }
     }
 
-    auto fh = reinterpret_cast<file_handle_t *>(fi->fh);
-    fh->Close();
-    delete fh;
+    if (file_handles.Release(fi->fh) == false) {
+        S_LogMessage(LOG_WARNING, "release of stale file handle %llx", (unsigned long long)fi->fh);
+        return -EBADF;
+    }
 
     return 0;
 }
 
 static int prodosfs_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+    stat_timer_t timer(stat_fuse_getxattr);
+    PRODOS_PROBE2(fuse_getxattr, path, name);
     S_LogMessage(LOG_DEBUG1, "prodosfs_getxattr(\"%s\", \"%s\", %p, %zd)", path, name, value, size);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+
+    volume_t *  volume = nullptr;
+    std::string_view pathname;
+    int rv = S_ResolvePath(S_ProdosFilename(path), &volume, &pathname);
+    if (rv != 0) {
+        return rv;
+    }
+    else if (volume == nullptr) {
+        return -ENODATA;
+    }
 
-    auto entry = volume->GetEntry(path);
+    auto entry = volume->GetEntry(pathname);
     if (entry == nullptr) {
         return -S_ToError(volume_t::Error());
     }
 
-    auto attributes = S_GetAttributes(entry);
+    auto attributes = S_GetAttributes(volume, pathname, entry);
     auto itr = attributes.find(name);
 
     if (itr == attributes.end()) {
@@ -397,8 +778,20 @@ static int prodosfs_getxattr(const char *path, const char *name, char *value, si
 
 static int prodosfs_listxattr(const char *path, char *buffer, size_t size)
 {
+    stat_timer_t timer(stat_fuse_listxattr);
+    PRODOS_PROBE1(fuse_listxattr, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_listxattr(\"%s\", %p, %zd)", path, buffer, size);
-    std::string pathname = S_ProdosFilename(path);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+
+    volume_t *  volume = nullptr;
+    std::string_view pathname;
+    int rv = S_ResolvePath(S_ProdosFilename(path), &volume, &pathname);
+    if (rv != 0) {
+        return rv;
+    }
+    else if (volume == nullptr) {
+        return 0;
+    }
 
     auto entry = volume->GetEntry(pathname);
     if (entry == nullptr) {
@@ -409,7 +802,7 @@ static int prodosfs_listxattr(const char *path, char *buffer, size_t size)
     size_t  remaining = size;
 
     size_t length = 0;
-    auto attributes = S_GetAttributes(entry);
+    auto attributes = S_GetAttributes(volume, pathname, entry);
     for (const auto & attr : attributes) {
         auto name_size = attr.first.length() + 1;
         if (size > 0) {
@@ -430,6 +823,8 @@ static int prodosfs_listxattr(const char *path, char *buffer, size_t size)
 
 static void *prodosfs_mount(struct fuse_conn_info *conn, struct fuse_config *cfg)
 {
+    stat_timer_t timer(stat_fuse_init);
+    PRODOS_PROBE0(fuse_init);
     if (log_fd > 0) {
         auto pid = fork();
         if (pid < 0) {
@@ -447,6 +842,16 @@ static void *prodosfs_mount(struct fuse_conn_info *conn, struct fuse_config *cfg
 
     S_LogMessage(LOG_DEBUG1, "prodosfs_mount()");
 
+    // Messages are formatted and written in the background from here on, so that debug
+    // logging does not slow down the FUSE threads. The writer and the watcher are started
+    // here, after any fork, as threads do not survive one.
+    LogStartAsync();
+
+    if (watch) {
+        fuse_instance = fuse_get_context()->fuse;
+        watcher = std::thread(S_WatchImage);
+    }
+
     if (use_name) {
         S_LogMessage(LOG_INFO, "created %s", mount_dir);
         atexit(S_Cleanup);
@@ -455,39 +860,70 @@ static void *prodosfs_mount(struct fuse_conn_info *conn, struct fuse_config *cfg
     if (mount_dir) {
         S_LogMessage(LOG_INFO, "mounted %s in %s", disk_image, mount_dir);
     }
-    else {
+    else if (volume != nullptr) {
         S_LogMessage(LOG_INFO, "mounted volume: %s", volume->Name().c_str());
     }
+    else {
+        S_LogMessage(LOG_INFO, "mounted %zu partitions of %s", partitions.size(), disk_image);
+    }
 
     return volume;
 }
 
 static void prodosfs_umount(void *private_data)
 {
+    stat_timer_t timer(stat_fuse_destroy);
+    PRODOS_PROBE0(fuse_destroy);
     S_LogMessage(LOG_DEBUG1, "prodosfs_umount(%p)", private_data);
 
+    if (watcher.joinable()) {
+        watcher_stop = true;
+        watcher.join();
+    }
+
     auto ctx = (volume_t *)private_data;
-    auto volume_name = ctx->Name();
+    auto volume_name = ctx ? ctx->Name() : std::string(disk_image);
     delete ctx;
+    partition_volumes.clear();
 
     if (mount_dir) {
         S_LogMessage(LOG_INFO, "unmounted %s in %s", disk_image, mount_dir);
     }
     else {
-        S_LogMessage(LOG_INFO, "unmounted volume: %s", volume->Name().c_str());
+        S_LogMessage(LOG_INFO, "unmounted volume: %s", volume_name.c_str());
     }
 }
 
 static int prodosfs_opendir(const char *path, struct fuse_file_info *fi)
 {
+    stat_timer_t timer(stat_fuse_opendir);
+    PRODOS_PROBE1(fuse_opendir, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_opendir(\"%s\", %p)", path, fi);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
 
-    auto dh = volume->OpenDirectory(path);
-    if (dh == nullptr) {
+    volume_t *  volume = nullptr;
+    std::string_view pathname;
+    int rv = S_ResolvePath(path, &volume, &pathname);
+    if (rv != 0) {
+        return rv;
+    }
+    else if (volume == nullptr) {
+        // The root of a partitioned disk has no directory handle.
+        fi->fh = 0;
+        return 0;
+    }
+
+    directory_handle_t * dh = nullptr;
+    auto handle_id = directory_handles.Allocate(&dh);
+    if (handle_id == 0) {
+        return -EMFILE;
+    }
+    else if (volume->OpenDirectory(pathname, *dh) == false) {
+        directory_handles.Release(handle_id);
         return -S_ToError(volume_t::Error());
     }
 
-    fi->fh = reinterpret_cast<uintptr_t>(dh);
+    fi->fh = handle_id;
 
     return 0;
 }
@@ -495,21 +931,58 @@ static int prodosfs_opendir(const char *path, struct fuse_file_info *fi)
 static int prodosfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
                             fuse_file_info *fi, fuse_readdir_flags fl)
 {
-    S_LogMessage(LOG_DEBUG1, "prodos_readdir(\"%s\", %p, %d)", path, buf, offset);
+    stat_timer_t timer(stat_fuse_readdir);
+    PRODOS_PROBE2(fuse_readdir, path, offset);
+    S_LogMessage(LOG_DEBUG1, "prodos_readdir(\"%s\", %p, %lld)", path, buf, (long long)offset);
+    std::shared_lock<std::shared_mutex> refresh_lock(refresh_mutex);
+
+    // Every entry is filled in with the offset of the one after it, so that a directory that
+    // does not fit in the buffer is continued where it left off. "." and ".." are at 1 and 2,
+    // partitions follow them, and the entries of a directory are at the positions of their
+    // handle, which are never that small.
+    if (offset < 1 && filler(buf, ".", nullptr, 1, FUSE_FILL_DIR_PLUS)) {
+        return 0;
+    }
+    if (offset < 2 && filler(buf, "..", nullptr, 2, FUSE_FILL_DIR_PLUS)) {
+        return 0;
+    }
 
-    filler(buf, ".", nullptr, 0, FUSE_FILL_DIR_PLUS);
-    filler(buf, "..", nullptr, 0, FUSE_FILL_DIR_PLUS);
+    if (fi->fh == 0) {
+        for (size_t i = std::max<off_t>(offset, 2) - 1; i <= partitions.size(); i++) {
+            if (filler(buf, std::to_string(i).c_str(), nullptr, i + 2, FUSE_FILL_DIR_PLUS)) {
+                break;
+            }
+        }
+        return 0;
+    }
 
-    auto dh = reinterpret_cast<directory_handle_t *>(fi->fh);
-    const entry_t * entry = nullptr;
-    while ((entry = dh->NextEntry()) != nullptr) {
-        std::string name = S_ExportedFilename((directory_entry_t *)entry);
-        S_LogMessage(LOG_DEBUG2, "found entry: %s", name.c_str());
-        if (filler(buf, name.c_str(), nullptr, 0, FUSE_FILL_DIR_PLUS)) {
-            S_LogMessage(LOG_WARNING, "readdir buffer full");
-            break;
+    auto dh = directory_handles.Get(fi->fh);
+    if (dh == nullptr) {
+        return -EBADF;
+    }
+
+    // A directory that a refresh has rewritten may not be one any more, or its chain of
+    // blocks may end early.
+    try {
+        if (dh->Seek(offset > 2 ? offset : 0) == false) {
+            return -EINVAL;
+        }
+
+        const entry_t * entry = nullptr;
+        while ((entry = dh->NextEntry()) != nullptr) {
+            std::string name = S_ExportedFilename((directory_entry_t *)entry);
+            S_LogMessage(LOG_DEBUG2, "found entry: %s", name.c_str());
+            if (filler(buf, name.c_str(), nullptr, dh->Tell(), FUSE_FILL_DIR_PLUS)) {
+                // The entry is returned again by the next call, which starts after the last
+                // one that fit.
+                return 0;
+            }
         }
     }
+    catch (std::exception & e) {
+        S_LogMessage(LOG_ERROR, "unable to read directory %s: %s", path, e.what());
+        return -EIO;
+    }
 
     if (volume_t::Error() != err_end_of_file) {
         return -S_ToError(volume_t::Error());
@@ -520,11 +993,17 @@ static int prodosfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 static int prodosfs_closedir(const char *path, struct fuse_file_info *fi)
 {
+    stat_timer_t timer(stat_fuse_releasedir);
+    PRODOS_PROBE1(fuse_releasedir, path);
     S_LogMessage(LOG_DEBUG1, "prodosfs_closedir(\"%s\", %p)", path, fi);
 
-    auto dh = reinterpret_cast<directory_handle_t *>(fi->fh);
-    dh->Close();
-    delete dh;
+    if (fi->fh == 0) {
+        return 0;
+    }
+    else if (directory_handles.Release(fi->fh) == false) {
+        S_LogMessage(LOG_WARNING, "release of stale directory handle %llx", (unsigned long long)fi->fh);
+        return -EBADF;
+    }
 
     return 0;
 }
@@ -542,6 +1021,7 @@ static struct fuse_operations operations =
     .releasedir = prodosfs_closedir,
     .init       = prodosfs_mount,
     .destroy    = prodosfs_umount,
+    .lseek      = prodosfs_lseek,
 };
 
 //================================================================================================
@@ -566,8 +1046,9 @@ bool S_UpdateMountDirectory()
 {
     size_t path_len = strlen(mount_dir);
 
-    std::string vol_name = volume->Name();
-    if (IsValidName(vol_name) == false) {
+    // A partitioned disk has no single volume name, so use the image name instead.
+    std::string vol_name = volume ? volume->Name() : std::filesystem::path(disk_image).stem().string();
+    if (volume && IsValidName(vol_name) == false) {
         fprintf(stderr, "prodosfs: invalid ProDOS volume name -- \"%s\"\n", vol_name.c_str());
         return false;
     }
@@ -602,7 +1083,7 @@ static void S_HandleOptions(int argc, char *argv[])
 {
     opterr = 0;
     int c = 0;
-    while ((c = getopt(argc, argv, "defhl:n")) != -1) {
+    while ((c = getopt(argc, argv, "defhil:npt:w")) != -1) {
         switch (c) {
         case 'd':
             debug = true;
@@ -614,8 +1095,11 @@ static void S_HandleOptions(int argc, char *argv[])
             foreground = true;
             break;
         case 'h':
-            fprintf(stdout, "usage: prodosfs [-l N] [-d] [-e] [-f] [-n] <mount dir> <image file>\n");
+            fprintf(stdout, "usage: prodosfs [-l N] [-d] [-e] [-f] [-i] [-n] [-p] [-t trace file] [-w] <mount dir> <image file>\n");
             exit(EXIT_SUCCESS);
+        case 'i':
+            write_index = true;
+            break;
         case 'l':
             log_level = atoi(optarg);
             if (log_level < LOG_CRITICAL || log_level > LOG_MAX) {
@@ -626,6 +1110,15 @@ static void S_HandleOptions(int argc, char *argv[])
         case 'n':
             use_name = true;
             break;
+        case 'p':
+            prefault = true;
+            break;
+        case 't':
+            trace_file = optarg;
+            break;
+        case 'w':
+            watch = true;
+            break;
         case '?':
         default:
             fprintf(stderr, "prodosfs: invalid option -- %c\n", (char)optopt);
@@ -648,10 +1141,41 @@ int main(int argc, char *argv[])
     mount_dir = realpath(argv[optind], nullptr);
     disk_image = realpath(argv[optind + 1], nullptr);
 
+    LogInit("prodosfs", stderr);
     SetLogger(S_LogMessage);
 
+    if (trace_file && TraceStart(trace_file) == false) {
+        fprintf(stderr, "prodosfs: unable to create trace file -- %s\n", trace_file);
+        return EXIT_FAILURE;
+    }
+
     try {
-        volume = new volume_t(disk_image);
+        disk = std::make_shared<disk_t>(disk_image);
+        partitions = volume_t::FindPartitions(*disk);
+        if (partitions.empty()) {
+            volume = new volume_t(disk);
+
+            // Later mounts of the image start from the index instead of the directories.
+            if (write_index && !volume->IsIndexed() && !volume->WriteIndex()) {
+                fprintf(stderr, "prodosfs: unable to write index -- %s\n", disk_image);
+            }
+
+            if (prefault) {
+                volume->Prefault();
+            }
+
+            if (watch && volume->TrackChanges() == false) {
+                fprintf(stderr, "prodosfs: changes to this image cannot be picked up -- %s\n", disk_image);
+                watch = false;
+            }
+        }
+        else if (watch) {
+            fprintf(stderr, "prodosfs: changes to partitioned images cannot be picked up -- %s\n", disk_image);
+            watch = false;
+        }
+        else {
+            partition_volumes.resize(partitions.size());
+        }
     }
     catch (std::exception & e) {
         fprintf(stderr, "prodosfs: %s -- %s\n", e.what(), disk_image);
@@ -685,6 +1209,7 @@ int main(int argc, char *argv[])
     fuse_args args = FUSE_ARGS_INIT(0, nullptr);
     fuse_opt_add_arg(&args, "prodosfs");
     fuse_opt_add_arg(&args, "-oauto_unmount");
+    fuse_opt_add_arg(&args, "-oclone_fd");
     fuse_opt_add_arg(&args, opt_uid.c_str());
     fuse_opt_add_arg(&args, opt_gid.c_str());
     fuse_opt_add_arg(&args, "-f");
@@ -696,6 +1221,8 @@ int main(int argc, char *argv[])
 
     // Enter FUSE main loop.
     int rv = fuse_main(args.argc, args.argv, &operations, nullptr);
+    LogStopAsync();
+    TraceStop();
 
     fuse_opt_free_args(&args);
     free(disk_image);
@@ -0,0 +1,595 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/builder.hxx"
+
+#include "prodos/block.hxx"
+#include "prodos/filetype.hxx"
+#include "prodos/volume.hxx"
+#include "prodos/util.hxx"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace prodos
+{
+
+const unsigned  BLOCKS_PER_BITMAP_BLOCK = BLOCK_SIZE * 8;
+const unsigned  POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+
+static uint16_t
+S_IndexPointer(const index_block * block, unsigned i)
+{
+    return block->hi[i] << 8 | block->lo[i];
+}
+
+static void
+S_SetIndexPointer(index_block * block, unsigned i, uint16_t pointer)
+{
+    block->lo[i] = pointer & 0xFF;
+    block->hi[i] = pointer >> 8;
+}
+
+static void
+S_EncodeTimestamp(const timestamp_t & timestamp, uint8_t * ptr)
+{
+    if (timestamp.month < 1 || timestamp.month > 12) {
+        memset(ptr, 0, 4);
+        return;
+    }
+
+    LE_Write16(ptr, (timestamp.year % 100) << 9 | timestamp.month << 5 | timestamp.day);
+    ptr[2] = timestamp.minute;
+    ptr[3] = timestamp.hour;
+}
+
+// Set the name and storage type of an entry or header, in upper case.
+static void
+S_SetName(uint8_t * storage_type_and_name_length, const std::string & name, uint8_t storage_type)
+{
+    if (!IsValidName(name)) {
+        throw std::runtime_error("invalid name: " + name);
+    }
+
+    *storage_type_and_name_length = storage_type << 4 | name.length();
+    for (size_t i = 0; i < name.length(); i++) {
+        storage_type_and_name_length[1 + i] = toupper(name[i]);
+    }
+}
+
+static bool
+S_IsZero(const uint8_t * data, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static unsigned
+S_CountPointers(const index_block * block)
+{
+    unsigned count = 0;
+    for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+        count += S_IndexPointer(block, i) != 0;
+    }
+
+    return count;
+}
+
+volume_builder_t::volume_builder_t(unsigned total_blocks)
+    : _image(total_blocks * BLOCK_SIZE), _used(total_blocks)
+{
+    if (total_blocks < 7 || total_blocks > UINT16_MAX) {
+        throw std::runtime_error("unexpected total blocks");
+    }
+
+    // Blocks 0 and 1 hold the boot loader.
+    MarkUsed(0, 2);
+}
+
+uint16_t
+volume_builder_t::Allocate(unsigned count)
+{
+    for (unsigned start = _first_free; start + count <= _used.size(); ) {
+        unsigned free = 0;
+        while (free < count && !_used[start + free]) {
+            free++;
+        }
+        if (free == count) {
+            MarkUsed(start, count);
+            return start;
+        }
+        start += free + 1;
+    }
+
+    return 0;
+}
+
+void
+volume_builder_t::MarkUsed(uint16_t block, unsigned count)
+{
+    if (block + count > _used.size()) {
+        throw std::logic_error("invalid block number");
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        _used[block + i] = true;
+    }
+
+    while (_first_free < _used.size() && _used[_first_free]) {
+        _first_free++;
+    }
+}
+
+uint8_t *
+volume_builder_t::Block(uint16_t block)
+{
+    if (block >= _used.size()) {
+        throw std::logic_error("invalid block number");
+    }
+
+    return _image.data() + block * BLOCK_SIZE;
+}
+
+unsigned
+volume_builder_t::FreeBlocks() const
+{
+    unsigned free = 0;
+    for (unsigned i = _first_free; i < _used.size(); i++) {
+        free += !_used[i];
+    }
+
+    return free;
+}
+
+unsigned
+volume_builder_t::BitmapBlocks() const
+{
+    return (_used.size() + BLOCKS_PER_BITMAP_BLOCK - 1) / BLOCKS_PER_BITMAP_BLOCK;
+}
+
+void
+volume_builder_t::WriteBitmap(uint16_t block)
+{
+    // A set bit is a free block. The bits past the end of the volume are left clear.
+    for (unsigned i = 0; i < BitmapBlocks(); i++) {
+        memset(Block(block + i), 0, BLOCK_SIZE);
+    }
+
+    for (unsigned i = 0; i < _used.size(); i++) {
+        if (!_used[i]) {
+            auto bitmap = Block(block + i / BLOCKS_PER_BITMAP_BLOCK);
+            auto bit = i % BLOCKS_PER_BITMAP_BLOCK;
+            bitmap[bit / 8] |= 0x80 >> bit % 8;
+        }
+    }
+}
+
+bool
+volume_builder_t::Save(const std::string & pathname) const
+{
+    std::string tempname = pathname + ".tmp";
+
+    int fd = open(tempname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t n = write(fd, _image.data(), _image.size());
+    if (close(fd) != 0 || n != _image.size() || rename(tempname.c_str(), pathname.c_str()) != 0) {
+        unlink(tempname.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+uint16_t
+volume_builder_t::Format(const entry_info_t & volume, unsigned entry_count)
+{
+    // The volume directory has to start at block 2, right after the boot blocks.
+    const unsigned VOLUME_DIRECTORY_ENTRIES = 4 * ENTRIES_PER_BLOCK - 1;
+
+    auto key_block = _NewDirectory(volume, storage_type_volume_block,
+                                   std::max(entry_count, VOLUME_DIRECTORY_ENTRIES));
+    if (key_block != 2) {
+        throw std::logic_error("volume already formatted");
+    }
+
+    _bitmap = Allocate(BitmapBlocks());
+    if (_bitmap == 0) {
+        throw std::runtime_error("volume is full");
+    }
+
+    auto header = &((directory_block *)Block(key_block))->key.header;
+    LE_Write16(header->bit_map_pointer, _bitmap);
+    LE_Write16(header->total_blocks, TotalBlocks());
+
+    return key_block;
+}
+
+uint16_t
+volume_builder_t::AddDirectory(uint16_t parent, const entry_info_t & info, unsigned entry_count)
+{
+    auto key_block = _NewDirectory(info, storage_type_subdir_block, entry_count);
+
+    uint16_t block;
+    auto entry = _NewEntry(parent, info, storage_type_subdirectory, &block);
+    entry->file_type = file_type_directory;
+    LE_Write16(entry->key_pointer, key_block);
+    LE_Write16(entry->blocks_used, _directories[key_block].blocks);
+    LE_Write24(entry->eof, _directories[key_block].blocks * BLOCK_SIZE);
+
+    // The subdirectory's header points back to its entry.
+    auto header = &((directory_block *)Block(key_block))->key.header;
+    LE_Write16(header->parent_pointer, block);
+    header->parent_entry_number = (((uint8_t *)entry - Block(block)) - 4) / sizeof(directory_entry) + 1;
+    header->parent_entry_length = sizeof(directory_entry);
+
+    return key_block;
+}
+
+void
+volume_builder_t::AddFile(uint16_t parent, const entry_info_t & info, const uint8_t * data, size_t size)
+{
+    if (size > FILE_SIZE_MAX) {
+        throw std::runtime_error("file too large: " + info.name);
+    }
+
+    // The first data block is always allocated, even for an empty file.
+    size_t num_blocks = std::max<size_t>(1, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    std::vector<bool> present(num_blocks);
+    for (size_t i = 0; i < num_blocks; i++) {
+        present[i] = i == 0 || !S_IsZero(data + i * BLOCK_SIZE, std::min<size_t>(BLOCK_SIZE, size - i * BLOCK_SIZE));
+    }
+
+    // Count the index blocks of the groups of data blocks that are not all sparse.
+    uint8_t storage_type = num_blocks == 1 ? storage_type_seedling_file :
+                           num_blocks <= POINTERS_PER_INDEX_BLOCK ? storage_type_sapling_file :
+                                                                    storage_type_tree_file;
+    unsigned count = storage_type == storage_type_seedling_file ? 0 : 1;
+    for (size_t i = 0; i < num_blocks; i++) {
+        count += present[i];
+        if (storage_type == storage_type_tree_file && i % POINTERS_PER_INDEX_BLOCK == 0) {
+            auto last = std::min(num_blocks, i + POINTERS_PER_INDEX_BLOCK);
+            count += std::find(present.begin() + i, present.begin() + last, true) != present.begin() + last;
+        }
+    }
+
+    uint16_t block;
+    auto entry = _NewEntry(parent, info, storage_type, &block);
+
+    auto first = Allocate(count);
+    if (first == 0) {
+        throw std::runtime_error("volume is full");
+    }
+
+    LE_Write16(entry->key_pointer, first);
+    LE_Write16(entry->blocks_used, count);
+    LE_Write24(entry->eof, size);
+
+    auto copy = [&](size_t i, uint16_t to) {
+        memcpy(Block(to), data + i * BLOCK_SIZE, std::min<size_t>(BLOCK_SIZE, size - i * BLOCK_SIZE));
+    };
+
+    uint16_t next = first;
+    if (storage_type == storage_type_seedling_file) {
+        if (size > 0) {
+            copy(0, next);
+        }
+        return;
+    }
+
+    index_block * master = storage_type == storage_type_tree_file ? (index_block *)Block(next++) : nullptr;
+    index_block * index = nullptr;
+    for (size_t i = 0; i < num_blocks; i++) {
+        if (i % POINTERS_PER_INDEX_BLOCK == 0) {
+            if (master != nullptr) {
+                auto last = std::min(num_blocks, i + POINTERS_PER_INDEX_BLOCK);
+                if (std::find(present.begin() + i, present.begin() + last, true) == present.begin() + last) {
+                    i = last - 1;
+                    continue;
+                }
+                S_SetIndexPointer(master, i / POINTERS_PER_INDEX_BLOCK, next);
+            }
+            index = (index_block *)Block(next++);
+        }
+        if (present[i]) {
+            S_SetIndexPointer(index, i % POINTERS_PER_INDEX_BLOCK, next);
+            copy(i, next++);
+        }
+    }
+}
+
+unsigned
+volume_builder_t::FileBlocks(size_t size)
+{
+    size_t num_blocks = std::max<size_t>(1, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    if (num_blocks == 1) {
+        return 1;
+    }
+    else if (num_blocks <= POINTERS_PER_INDEX_BLOCK) {
+        return 1 + num_blocks;
+    }
+
+    return 1 + (num_blocks + POINTERS_PER_INDEX_BLOCK - 1) / POINTERS_PER_INDEX_BLOCK + num_blocks;
+}
+
+unsigned
+volume_builder_t::DirectoryBlocks(unsigned entry_count)
+{
+    // The header takes a slot too.
+    return entry_count / ENTRIES_PER_BLOCK + 1;
+}
+
+void
+volume_builder_t::Finish()
+{
+    if (_bitmap == 0) {
+        throw std::logic_error("volume not formatted");
+    }
+
+    WriteBitmap(_bitmap);
+}
+
+bool
+volume_builder_t::Optimize(const volume_t & volume, const std::string & pathname)
+{
+    volume_builder_t builder(volume.TotalBlocks());
+
+    memcpy(builder.Block(0), volume._ReadBlock(0), BLOCK_SIZE);
+    memcpy(builder.Block(1), volume._ReadBlock(1), BLOCK_SIZE);
+
+    // The volume directory has to start at block 2. The bitmap goes right after it, as
+    // ProDOS itself puts it, before anything in the directory is placed.
+    unsigned count = 0;
+    auto root = builder._PlaceDirectory(volume, 2, 0, &count);
+    if (root != 2) {
+        throw std::runtime_error("volume directory does not fit at block 2");
+    }
+
+    auto bitmap = builder.Allocate(builder.BitmapBlocks());
+    if (bitmap == 0) {
+        throw std::runtime_error("volume is full");
+    }
+    auto header = &((directory_block *)builder.Block(root))->key.header;
+    LE_Write16(header->bit_map_pointer, bitmap);
+
+    builder._CopyEntries(volume, root, count);
+    builder.WriteBitmap(bitmap);
+
+    return builder.Save(pathname);
+}
+
+uint16_t
+volume_builder_t::_PlaceDirectory(const volume_t & volume, uint16_t key_pointer, uint16_t parent_block,
+                                  unsigned * count)
+{
+    std::vector<uint16_t> blocks;
+    for (uint16_t pointer = key_pointer; pointer != 0; ) {
+        // A damaged directory could otherwise link blocks in a loop.
+        if (blocks.size() >= _used.size()) {
+            throw std::runtime_error("directory structure damaged");
+        }
+        blocks.push_back(pointer);
+        pointer = LE_Read16(((const directory_block *)volume.GetBlock(pointer, trace_directory))->next);
+    }
+
+    auto first = Allocate(blocks.size());
+    if (first == 0) {
+        throw std::runtime_error("volume is full");
+    }
+
+    for (unsigned i = 0; i < blocks.size(); i++) {
+        auto block = (directory_block *)Block(first + i);
+        memcpy(block, volume.GetBlock(blocks[i], trace_directory), BLOCK_SIZE);
+        LE_Write16(block->prev, i > 0 ? first + i - 1 : 0);
+        LE_Write16(block->next, i + 1 < blocks.size() ? first + i + 1 : 0);
+    }
+
+    // A subdirectory's header points back to the block holding its entry in the parent.
+    if (parent_block != 0) {
+        auto header = &((directory_block *)Block(first))->key.header;
+        LE_Write16(header->parent_pointer, parent_block);
+    }
+
+    *count = blocks.size();
+
+    return first;
+}
+
+void
+volume_builder_t::_CopyEntries(const volume_t & volume, uint16_t first, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        auto block = (directory_block *)Block(first + i);
+
+        // The header takes the first slot of the key block.
+        for (int slot = i == 0 ? 1 : 0; slot < ENTRIES_PER_BLOCK; slot++) {
+            auto entry = &block->any.entry[slot];
+            switch (entry->storage_type_and_name_length >> 4) {
+            case storage_type_none:
+                continue;
+            case storage_type_seedling_file:
+            case storage_type_sapling_file:
+            case storage_type_tree_file:
+                _CopyFile(volume, entry);
+                break;
+            case storage_type_subdirectory: {
+                unsigned subdir_count = 0;
+                auto subdir = _PlaceDirectory(volume, LE_Read16(entry->key_pointer), first + i, &subdir_count);
+                LE_Write16(entry->key_pointer, subdir);
+                _CopyEntries(volume, subdir, subdir_count);
+                break;
+            }
+            default:
+                throw std::runtime_error("unsupported storage type");
+            }
+
+            LE_Write16(entry->header_pointer, first);
+        }
+    }
+}
+
+uint16_t
+volume_builder_t::_NewDirectory(const entry_info_t & info, uint8_t storage_type, unsigned entry_count)
+{
+    unsigned blocks = DirectoryBlocks(entry_count);
+    auto first = Allocate(blocks);
+    if (first == 0) {
+        throw std::runtime_error("volume is full");
+    }
+
+    for (unsigned i = 0; i < blocks; i++) {
+        auto block = (directory_block *)Block(first + i);
+        LE_Write16(block->prev, i > 0 ? first + i - 1 : 0);
+        LE_Write16(block->next, i + 1 < blocks ? first + i + 1 : 0);
+    }
+
+    auto header = &((directory_block *)Block(first))->key.header;
+    S_SetName(&header->storage_type_and_name_length, info.name, storage_type);
+    if (storage_type == storage_type_subdir_block) {
+        // What ProDOS puts in the first reserved byte of a subdirectory header.
+        header->reserved[0] = 0x75;
+    }
+    S_EncodeTimestamp(info.created, header->creation_date_time);
+    header->version = info.version;
+    header->min_version = info.min_version;
+    header->access = info.access;
+    header->entry_length = sizeof(directory_entry);
+    header->entries_per_block = ENTRIES_PER_BLOCK;
+
+    _directories[first] = { (uint16_t)blocks, 1 };
+
+    return first;
+}
+
+directory_entry *
+volume_builder_t::_NewEntry(uint16_t directory, const entry_info_t & info, uint8_t storage_type,
+                            uint16_t * block)
+{
+    auto itr = _directories.find(directory);
+    if (itr == _directories.end()) {
+        throw std::logic_error("not a directory");
+    }
+
+    auto & state = itr->second;
+    if (state.slots >= state.blocks * ENTRIES_PER_BLOCK) {
+        throw std::runtime_error("directory is full");
+    }
+
+    *block = directory + state.slots / ENTRIES_PER_BLOCK;
+    auto entry = &((directory_block *)Block(*block))->any.entry[state.slots % ENTRIES_PER_BLOCK];
+    state.slots++;
+
+    S_SetName(&entry->storage_type_and_name_length, info.name, storage_type);
+    entry->file_type = info.file_type;
+    S_EncodeTimestamp(info.created, entry->creation_date_time);
+    entry->version = info.version;
+    entry->min_version = info.min_version;
+    entry->access = info.access;
+    LE_Write16(entry->aux_type, info.aux_type);
+    S_EncodeTimestamp(info.modified, entry->last_mod);
+    LE_Write16(entry->header_pointer, directory);
+
+    auto header = &((directory_block *)Block(directory))->key.header;
+    LE_Write16(header->file_count, LE_Read16(header->file_count) + 1);
+
+    return entry;
+}
+
+void
+volume_builder_t::_CopyFile(const volume_t & volume, directory_entry * entry)
+{
+    auto key_pointer = LE_Read16(entry->key_pointer);
+
+    switch (entry->storage_type_and_name_length >> 4) {
+    case storage_type_seedling_file: {
+        auto block = Allocate();
+        if (block == 0) {
+            throw std::runtime_error("volume is full");
+        }
+        memcpy(Block(block), volume.GetBlock(key_pointer), BLOCK_SIZE);
+        LE_Write16(entry->key_pointer, block);
+        break;
+    }
+    case storage_type_sapling_file: {
+        auto old_index = (const index_block *)volume.GetBlock(key_pointer, trace_index);
+        auto first = Allocate(1 + S_CountPointers(old_index));
+        if (first == 0) {
+            throw std::runtime_error("volume is full");
+        }
+
+        auto new_index = (index_block *)Block(first);
+        uint16_t next = first + 1;
+        for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+            auto pointer = S_IndexPointer(old_index, i);
+            if (pointer != 0) {
+                memcpy(Block(next), volume.GetBlock(pointer), BLOCK_SIZE);
+                pointer = next++;
+            }
+            S_SetIndexPointer(new_index, i, pointer);
+        }
+        LE_Write16(entry->key_pointer, first);
+        break;
+    }
+    case storage_type_tree_file: {
+        // Each index block is followed by the data blocks it points to.
+        auto old_master = (const index_block *)volume.GetBlock(key_pointer, trace_index);
+        unsigned count = 1;
+        for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+            if (auto pointer = S_IndexPointer(old_master, i)) {
+                count += 1 + S_CountPointers((const index_block *)volume.GetBlock(pointer, trace_index));
+            }
+        }
+
+        auto first = Allocate(count);
+        if (first == 0) {
+            throw std::runtime_error("volume is full");
+        }
+
+        auto new_master = (index_block *)Block(first);
+        uint16_t next = first + 1;
+        for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+            auto index_pointer = S_IndexPointer(old_master, i);
+            if (index_pointer == 0) {
+                S_SetIndexPointer(new_master, i, 0);
+                continue;
+            }
+
+            auto old_index = (const index_block *)volume.GetBlock(index_pointer, trace_index);
+            auto new_index = (index_block *)Block(next);
+            S_SetIndexPointer(new_master, i, next++);
+            for (unsigned j = 0; j < POINTERS_PER_INDEX_BLOCK; j++) {
+                auto pointer = S_IndexPointer(old_index, j);
+                if (pointer != 0) {
+                    memcpy(Block(next), volume.GetBlock(pointer), BLOCK_SIZE);
+                    pointer = next++;
+                }
+                S_SetIndexPointer(new_index, j, pointer);
+            }
+        }
+        LE_Write16(entry->key_pointer, first);
+        break;
+    }
+    default:
+        throw std::logic_error("unexpected storage type");
+    }
+}
+
+} // namespace
+
+// eof
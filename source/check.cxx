@@ -0,0 +1,417 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/check.hxx"
+
+#include "prodos/block.hxx"
+#include "prodos/entry.hxx"
+#include "prodos/volume.hxx"
+#include "prodos/util.hxx"
+
+#include <algorithm>
+
+#include <stdarg.h>
+#include <stdio.h>
+
+namespace prodos
+{
+
+const unsigned  BLOCKS_PER_BITMAP_BLOCK = BLOCK_SIZE * 8;
+const unsigned  POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+
+// A tree file's EOF is 24 bits, so only the first half of its master index block is used.
+const unsigned  MAX_INDEX_BLOCKS = (FILE_SIZE_MAX + 1) / (POINTERS_PER_INDEX_BLOCK * BLOCK_SIZE);
+
+enum : uint32_t
+{
+    owner_none,
+    owner_boot,
+    owner_bitmap,
+};
+
+static uint16_t
+S_IndexPointer(const index_block * block, unsigned i)
+{
+    return block->hi[i] << 8 | block->lo[i];
+}
+
+static uint8_t
+S_ReverseBits(uint8_t byte)
+{
+    byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+    byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+    byte = (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+
+    return byte;
+}
+
+static std::string
+S_EntryName(const directory_entry * entry)
+{
+    return std::string((const char *)entry->file_name,
+                       std::min<int>(entry->storage_type_and_name_length & 0x0F, FILENAME_LENGTH));
+}
+
+// Describe a run of blocks, e.g. "block 12" or "blocks 12-15".
+static std::string
+S_BlockRun(unsigned first, unsigned count)
+{
+    char buffer[32];
+    if (count == 1) {
+        snprintf(buffer, sizeof(buffer), "block %u", first);
+    }
+    else {
+        snprintf(buffer, sizeof(buffer), "blocks %u-%u", first, first + count - 1);
+    }
+
+    return buffer;
+}
+
+volume_checker_t::volume_checker_t(const volume_t & volume)
+    : _volume(volume), _total_blocks(volume.TotalBlocks())
+{
+}
+
+bool
+volume_checker_t::Check()
+{
+    _used.assign((_total_blocks + 63) / 64, 0);
+    _owners.assign(_total_blocks, owner_none);
+    _names = { "", "the boot blocks", "the volume bitmap" };
+    _problems.clear();
+    _problem_count = 0;
+    _directories = 0;
+    _files = 0;
+
+    _Claim(0, owner_boot);
+    _Claim(1, owner_boot);
+
+    // The bitmap is claimed first, so that anything else that uses its blocks is reported.
+    auto root = (const directory_block *)_volume.GetBlock(2, trace_directory);
+    auto bitmap_block = LE_Read16(root->key.header.bit_map_pointer);
+    unsigned bitmap_blocks = (_total_blocks + BLOCKS_PER_BITMAP_BLOCK - 1) / BLOCKS_PER_BITMAP_BLOCK;
+    bool bitmap_ok = bitmap_block + bitmap_blocks <= _total_blocks;
+    if (!bitmap_ok) {
+        _Problem("volume bitmap at block %u does not fit in the volume", bitmap_block);
+    }
+    for (unsigned i = 0; bitmap_ok && i < bitmap_blocks; i++) {
+        _Claim(bitmap_block + i, owner_bitmap);
+    }
+
+    _CheckDirectory(2, "/", 0, 0);
+
+    _blocks_used = 0;
+    for (auto word : _used) {
+        _blocks_used += __builtin_popcountll(word);
+    }
+
+    if (bitmap_ok) {
+        _CheckBitmap(bitmap_block);
+    }
+
+    return _problem_count == 0;
+}
+
+void
+volume_checker_t::_Problem(const char * format, ...)
+{
+    if (_problem_count++ >= MAX_PROBLEMS) {
+        return;
+    }
+
+    char buffer[256];
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+
+    _problems.emplace_back(buffer);
+}
+
+bool
+volume_checker_t::_Claim(uint16_t block, uint32_t owner)
+{
+    if (block == 0 && owner != owner_boot) {
+        _Problem("%s: points to block 0", _names[owner].c_str());
+        return false;
+    }
+    else if (block >= _total_blocks) {
+        _Problem("%s: block %u is past the end of the volume", _names[owner].c_str(), block);
+        return false;
+    }
+
+    auto & word = _used[block / 64];
+    uint64_t bit = 1ull << block % 64;
+    if (word & bit) {
+        _Problem("%s: block %u is also used by %s", _names[owner].c_str(), block,
+                 _names[_owners[block]].c_str());
+        return false;
+    }
+
+    word |= bit;
+    _owners[block] = owner;
+
+    return true;
+}
+
+unsigned
+volume_checker_t::_CheckDirectory(uint16_t key_block, const std::string & pathname, uint16_t parent_block,
+                                  unsigned parent_entry)
+{
+    uint32_t owner = _names.size();
+    _names.push_back(pathname);
+    _directories++;
+
+    // The subdirectories are checked after the whole chain, each with its entry's block.
+    struct subdirectory_t
+    {
+        const directory_entry *     entry;
+        uint16_t                    block;
+        unsigned                    number;
+    };
+    std::vector<subdirectory_t> subdirectories;
+
+    unsigned    num_blocks  = 0;
+    unsigned    file_count  = 0;
+    uint16_t    prev        = 0;
+    const directory_header * header = nullptr;
+
+    for (uint16_t pointer = key_block; pointer != 0; ) {
+        if (!_Claim(pointer, owner)) {
+            // The rest of the chain would be checked again, or is out of reach.
+            break;
+        }
+
+        auto block = (const directory_block *)_volume.GetBlock(pointer, trace_directory);
+        if (LE_Read16(block->prev) != prev) {
+            _Problem("%s: directory block %u points back to block %u instead of %u", pathname.c_str(),
+                     pointer, LE_Read16(block->prev), prev);
+        }
+
+        int first_slot = 0;
+        if (num_blocks == 0) {
+            header = &block->key.header;
+            first_slot = 1;
+        }
+
+        for (int slot = first_slot; slot < ENTRIES_PER_BLOCK; slot++) {
+            auto entry = &block->any.entry[slot];
+            auto storage_type = entry->storage_type_and_name_length >> 4;
+            if (storage_type == storage_type_none) {
+                continue;
+            }
+
+            file_count++;
+
+            auto name = S_EntryName(entry);
+            auto entry_pathname = (pathname == "/" ? "" : pathname) + "/" + name;
+            if (!IsValidName(name)) {
+                _Problem("%s: invalid name in directory block %u, entry %d", entry_pathname.c_str(), pointer,
+                         slot + 1);
+            }
+            if (LE_Read16(entry->header_pointer) != key_block) {
+                _Problem("%s: header pointer is %u instead of %u", entry_pathname.c_str(),
+                         LE_Read16(entry->header_pointer), key_block);
+            }
+
+            switch (storage_type) {
+            case storage_type_seedling_file:
+            case storage_type_sapling_file:
+            case storage_type_tree_file:
+                _CheckFile(entry, entry_pathname);
+                break;
+            case storage_type_subdirectory:
+                subdirectories.push_back({ entry, pointer, (unsigned)slot + 1 });
+                break;
+            case storage_type_pascal_area: {
+                // A Pascal area is a run of blocks that ProDOS leaves alone.
+                uint32_t area = _names.size();
+                _names.push_back(entry_pathname);
+                _files++;
+                auto first = LE_Read16(entry->key_pointer);
+                for (unsigned i = 0; i < LE_Read16(entry->blocks_used); i++) {
+                    if (!_Claim(first + i, area)) {
+                        break;
+                    }
+                }
+                break;
+            }
+            default:
+                _Problem("%s: unknown storage type $%X", entry_pathname.c_str(), storage_type);
+                break;
+            }
+        }
+
+        num_blocks++;
+        prev = pointer;
+        pointer = LE_Read16(block->next);
+    }
+
+    if (header == nullptr) {
+        return num_blocks;
+    }
+
+    auto expected_type = parent_block == 0 ? storage_type_volume_block : storage_type_subdir_block;
+    if (header->storage_type_and_name_length >> 4 != expected_type) {
+        _Problem("%s: directory header has storage type $%X instead of $%X", pathname.c_str(),
+                 header->storage_type_and_name_length >> 4, expected_type);
+    }
+    if (header->entry_length != sizeof(directory_entry) || header->entries_per_block != ENTRIES_PER_BLOCK) {
+        _Problem("%s: directory header has entries of %u bytes, %u per block", pathname.c_str(),
+                 header->entry_length, header->entries_per_block);
+    }
+    if (LE_Read16(header->file_count) != file_count) {
+        _Problem("%s: file count is %u but there are %u entries", pathname.c_str(),
+                 LE_Read16(header->file_count), file_count);
+    }
+    if (parent_block != 0 && (LE_Read16(header->parent_pointer) != parent_block ||
+                              header->parent_entry_number != parent_entry)) {
+        _Problem("%s: directory header points to entry %u of block %u instead of entry %u of block %u",
+                 pathname.c_str(), header->parent_entry_number, LE_Read16(header->parent_pointer),
+                 parent_entry, parent_block);
+    }
+
+    for (const auto & subdirectory : subdirectories) {
+        auto entry = subdirectory.entry;
+        auto subdir_pathname = (pathname == "/" ? "" : pathname) + "/" + S_EntryName(entry);
+
+        auto subdir_blocks = _CheckDirectory(LE_Read16(entry->key_pointer), subdir_pathname,
+                                             subdirectory.block, subdirectory.number);
+        if (LE_Read16(entry->blocks_used) != subdir_blocks) {
+            _Problem("%s: blocks used is %u but the directory has %u", subdir_pathname.c_str(),
+                     LE_Read16(entry->blocks_used), subdir_blocks);
+        }
+        if (LE_Read24(entry->eof) != subdir_blocks * BLOCK_SIZE) {
+            _Problem("%s: EOF is %u but the directory has %u blocks", subdir_pathname.c_str(),
+                     LE_Read24(entry->eof), subdir_blocks);
+        }
+    }
+
+    return num_blocks;
+}
+
+void
+volume_checker_t::_CheckFile(const directory_entry * entry, const std::string & pathname)
+{
+    uint32_t owner = _names.size();
+    _names.push_back(pathname);
+    _files++;
+
+    auto        storage_type    = entry->storage_type_and_name_length >> 4;
+    auto        key_pointer     = LE_Read16(entry->key_pointer);
+    uint32_t    eof             = LE_Read24(entry->eof);
+    unsigned    eof_blocks      = (eof + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    unsigned    blocks          = 0;        // that the file uses
+    bool        past_eof        = false;    // a data block is allocated past the EOF
+
+    // Claim the data blocks an index block points to, the first of which is data block first.
+    auto claim_data = [&](const index_block * index, unsigned first) {
+        for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+            auto pointer = S_IndexPointer(index, i);
+            if (pointer != 0) {
+                blocks += _Claim(pointer, owner);
+                past_eof |= first + i >= std::max(eof_blocks, 1u);
+            }
+        }
+    };
+
+    unsigned capacity = 0;
+    switch (storage_type) {
+    case storage_type_seedling_file:
+        capacity = 1;
+        blocks += _Claim(key_pointer, owner);
+        break;
+    case storage_type_sapling_file:
+        capacity = POINTERS_PER_INDEX_BLOCK;
+        if (_Claim(key_pointer, owner)) {
+            blocks++;
+            claim_data((const index_block *)_volume.GetBlock(key_pointer, trace_index), 0);
+        }
+        break;
+    case storage_type_tree_file:
+        capacity = MAX_INDEX_BLOCKS * POINTERS_PER_INDEX_BLOCK;
+        if (_Claim(key_pointer, owner)) {
+            blocks++;
+            auto master = (const index_block *)_volume.GetBlock(key_pointer, trace_index);
+            for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+                auto pointer = S_IndexPointer(master, i);
+                if (pointer == 0) {
+                    continue;
+                }
+                if (i >= MAX_INDEX_BLOCKS) {
+                    _Problem("%s: master index block points past the largest file", pathname.c_str());
+                    break;
+                }
+                if (_Claim(pointer, owner)) {
+                    blocks++;
+                    claim_data((const index_block *)_volume.GetBlock(pointer, trace_index),
+                               i * POINTERS_PER_INDEX_BLOCK);
+                }
+            }
+        }
+        break;
+    }
+
+    if (eof_blocks > capacity) {
+        _Problem("%s: EOF is %u but a file of its storage type holds %u bytes at most", pathname.c_str(),
+                 eof, capacity * BLOCK_SIZE);
+    }
+    if (past_eof) {
+        _Problem("%s: blocks are allocated past the EOF of %u", pathname.c_str(), eof);
+    }
+    if (LE_Read16(entry->blocks_used) != blocks) {
+        _Problem("%s: blocks used is %u but %u are used", pathname.c_str(), LE_Read16(entry->blocks_used),
+                 blocks);
+    }
+}
+
+void
+volume_checker_t::_CheckBitmap(uint16_t bitmap_block)
+{
+    // Turn the bitmap, in which a set bit is a free block and the first block is the high
+    // bit of the first byte, into words like the ones of the used blocks.
+    std::vector<uint64_t> free(_used.size(), 0);
+    for (unsigned i = 0; i < (_total_blocks + BLOCKS_PER_BITMAP_BLOCK - 1) / BLOCKS_PER_BITMAP_BLOCK; i++) {
+        auto bitmap = (const uint8_t *)_volume.GetBlock(bitmap_block + i, trace_bitmap);
+        for (unsigned j = 0; j < BLOCK_SIZE && (i * BLOCK_SIZE + j) / 8 < free.size(); j++) {
+            uint64_t byte = S_ReverseBits(bitmap[j]);
+            free[(i * BLOCK_SIZE + j) / 8] |= byte << (j % 8 * 8);
+        }
+    }
+
+    // Look for runs of blocks that are used but free, or the other way round.
+    auto report = [&](bool used_but_free) {
+        unsigned run = 0;
+        for (unsigned block = 0; block <= _total_blocks; block++) {
+            bool bad = false;
+            if (block < _total_blocks) {
+                uint64_t word = used_but_free ? _used[block / 64] & free[block / 64]
+                                              : ~_used[block / 64] & ~free[block / 64];
+                if (word == 0 && block % 64 == 0 && run == 0) {
+                    block += 63;
+                    continue;
+                }
+                bad = word >> block % 64 & 1;
+            }
+            if (bad) {
+                run++;
+            }
+            else if (run > 0) {
+                _Problem(used_but_free ? "%s: used but marked free in the volume bitmap"
+                                       : "%s: marked used in the volume bitmap but not used",
+                         S_BlockRun(block - run, run).c_str());
+                run = 0;
+            }
+        }
+    };
+
+    report(true);
+    report(false);
+}
+
+} // namespace
+
+// eof
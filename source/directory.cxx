@@ -6,25 +6,86 @@
 
 #include "prodos/directory.hxx"
 
+#include "prodos/probe.hxx"
+#include "prodos/stats.hxx"
 #include "prodos/volume.hxx"
 #include "prodos/util.hxx"
 
+#include <algorithm>
 #include <stdexcept>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 namespace prodos
 {
 
 extern thread_local err_t error;
 
-directory_handle_t::directory_handle_t(const volume_t * context, const directory_block * key_block)
+// The bits of the generation a position keeps, above the entry index, so that it stays a
+// positive off_t.
+static const unsigned GENERATION_MASK = 0x7FFF;
+
+directory_scan_t
+ScanDirectoryBlock(const directory_block * block, std::string_view name)
+{
+    // The bytes that matter are 39 apart, so they are gathered first, with the letters folded
+    // to upper case, and then compared all at once.
+    alignas(16) uint8_t types[16] = {};
+    alignas(16) uint8_t letters[16] = {};
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i++) {
+        auto entry = &block->any.entry[i];
+        types[i] = entry->storage_type_and_name_length;
+        letters[i] = FOLD_CASE[entry->file_name[0]];
+    }
+
+    uint8_t length = name.length() <= 15 ? name.length() : 0;
+    uint8_t letter = name.empty() ? 0 : FOLD_CASE[(uint8_t)name[0]];
+    const uint16_t slots = (1 << ENTRIES_PER_BLOCK) - 1;
+
+#if defined(__SSE2__)
+    auto type_bytes = _mm_load_si128((const __m128i *)types);
+    auto letter_bytes = _mm_load_si128((const __m128i *)letters);
+    auto empty = _mm_cmpeq_epi8(_mm_and_si128(type_bytes, _mm_set1_epi8((char)0xF0)), _mm_setzero_si128());
+    auto lengths = _mm_cmpeq_epi8(_mm_and_si128(type_bytes, _mm_set1_epi8(0x0F)), _mm_set1_epi8(length));
+    auto letters_match = _mm_cmpeq_epi8(letter_bytes, _mm_set1_epi8(letter));
+
+    uint16_t active = ~_mm_movemask_epi8(empty) & slots;
+    uint16_t candidates = _mm_movemask_epi8(_mm_and_si128(lengths, letters_match)) & active;
+#else
+    uint16_t active = 0;
+    uint16_t candidates = 0;
+    for (int i = 0; i < ENTRIES_PER_BLOCK; i++) {
+        if (types[i] >> 4 != storage_type_none) {
+            active |= 1 << i;
+            if ((types[i] & 0x0F) == length && letters[i] == letter) {
+                candidates |= 1 << i;
+            }
+        }
+    }
+#endif
+
+    if (length == 0) {
+        candidates = 0;
+    }
+
+    return { active, candidates };
+}
+
+directory_handle_t::directory_handle_t(const volume_t * context, const directory_block * key_block,
+                                       uint16_t key_pointer)
     : _context(context), _header(nullptr), _block(nullptr), _block_index(1), _entry_index(0)
 {
-    _Open(key_block);
+    _Open(key_block, key_pointer);
 }
 
 const directory_entry_t *
 directory_handle_t::NextEntry()
 {
+    stat_timer_t timer(stat_next_entry);
+    PRODOS_PROBE3(next_entry, this, _block_index, _entry_index);
+
     auto file_count = LE_Read16(_header->file_count);
     if (_entry_index == file_count) {
         error = err_end_of_file;
@@ -42,17 +103,103 @@ directory_handle_t::NextEntry()
     return entry;
 }
 
+const directory_entry_t *
+directory_handle_t::FindEntry(std::string_view name)
+{
+    auto file_count = LE_Read16(_header->file_count);
+    auto entries_per_block = std::min<int>(_header->entries_per_block, ENTRIES_PER_BLOCK);
+
+    while (_entry_index < file_count) {
+        // The slots from the current one to the last, which leaves out the header of a key
+        // block, since a handle starts after it.
+        uint16_t slots = ((1 << entries_per_block) - 1) & ~((1 << _block_index) - 1);
+        auto scan = ScanDirectoryBlock(_block, name);
+        auto active = scan.active & slots;
+        auto candidates = scan.candidates & slots;
+
+        while (candidates != 0) {
+            int slot = __builtin_ctz(candidates);
+            candidates &= candidates - 1;
+
+            // Entries past the file count are not looked at, as NextEntry would not return them.
+            auto before = __builtin_popcount(active & ((1 << slot) - 1));
+            if (_entry_index + before >= file_count) {
+                break;
+            }
+
+            auto entry = (const directory_entry_t *)&_block->any.entry[slot];
+            if (entry->NameMatches(name)) {
+                _entry_index += before + 1;
+                _block_index = slot;
+                if (_entry_index < file_count) {
+                    _Next();
+                }
+                return entry;
+            }
+        }
+
+        _entry_index += __builtin_popcount(active);
+        if (_entry_index < file_count) {
+            _block_index = _header->entries_per_block;
+            _Next();
+        }
+    }
+
+    error = err_file_not_found;
+    return nullptr;
+}
+
+uint64_t
+directory_handle_t::Tell() const
+{
+    return (uint64_t)(_generation & GENERATION_MASK) << 40 | (uint64_t)_entry_index << 24 |
+           (uint64_t)_block_number << 8 | _block_index;
+}
+
+bool
+directory_handle_t::Seek(uint64_t position)
+{
+    unsigned    generation      = (position >> 40) & GENERATION_MASK;
+    int         block_index     = position & 0xFF;
+    uint16_t    block_number    = (position >> 8) & 0xFFFF;
+    uint64_t    entry_index     = (position >> 24) & 0xFFFF;
+
+    if (position == 0 || generation != (_context->Generation() & GENERATION_MASK) ||
+        _generation != _context->Generation()) {
+        _Open((const directory_block *)_context->GetBlock(_key_block, trace_directory), _key_block);
+        return true;
+    }
+
+    // The key block starts after the header, and a block number of 0 or 1 would be a boot
+    // block. Whether the block is really in the chain is not checked, as that would mean
+    // walking it, but what is in it is only ever read as directory entries.
+    if (block_number < 2 || block_number >= _context->TotalBlocks() ||
+        block_index > _header->entries_per_block || (block_number == _key_block && block_index == 0) ||
+        entry_index > LE_Read16(_header->file_count)) {
+        return false;
+    }
+
+    _block = (const directory_block *)_context->GetBlock(block_number, trace_directory);
+    _block_number = block_number;
+    _block_index = block_index;
+    _entry_index = entry_index;
+
+    return true;
+}
+
 void
 directory_handle_t::Close()
 {
     _header = nullptr;
     _block = nullptr;
+    _key_block = 0;
+    _block_number = 0;
     _block_index = 0;
     _entry_index = 0;
 }
 
 void
-directory_handle_t::_Open(const directory_block * key_block)
+directory_handle_t::_Open(const directory_block * key_block, uint16_t key_pointer)
 {
     int type = key_block->key.header.storage_type_and_name_length >> 4;
     if (type != storage_type_volume_block && type != storage_type_subdir_block) {
@@ -61,8 +208,11 @@ directory_handle_t::_Open(const directory_block * key_block)
 
     _header = &key_block->key.header;
     _block = key_block;
+    _key_block = key_pointer;
+    _block_number = key_pointer;
     _block_index = 1;
     _entry_index = 0;
+    _generation = _context->Generation();
 }
 
 void
@@ -77,7 +227,8 @@ directory_handle_t::_Next()
             throw std::runtime_error("no more directory blocks");
         }
 
-        _block = (const directory_block *)_context->GetBlock(next_block);
+        _block = (const directory_block *)_context->GetBlock(next_block, trace_directory);
+        _block_number = next_block;
         _block_index = 0;
     }
 }
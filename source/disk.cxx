@@ -6,6 +6,7 @@
 
 #include "prodos/disk.hxx"
 
+#include <algorithm>
 #include <stdexcept>
 
 #include <fcntl.h>
@@ -15,6 +16,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include "prodos/nibble.hxx"
+#include "prodos/nufx.hxx"
+#include "prodos/probe.hxx"
 #include "prodos/util.hxx"
 
 namespace prodos
@@ -24,10 +28,44 @@ const int   TRACKS_PER_DISK     = 35;
 const int   SECTORS_PER_TRACK   = 16;
 const int   BLOCKS_PER_TRACK    = SECTORS_PER_TRACK / 2;
 
+// Images up to this size (i.e. floppies) are read in whole when they are mapped, rather than
+// a page at a time as they are first read.
+const size_t    POPULATE_SIZE   = 1024 * 1024;
+
 #define BLOCK_ADDR(i)   ((char *)_base + (i) * BLOCK_SIZE)
 #define SECTOR_ADDR(i)  ((char *)_base + (i) * SECTOR_SIZE)
 
+/*
+** The 2IMG container header. The disk data follows at data_offset, and may be followed by
+** optional comment and creator chunks. Multi-byte fields are little-endian.
+*/
+struct two_img_header
+{
+    uint8_t magic[4];
+    uint8_t creator[4];
+    uint8_t header_length[2];
+    uint8_t version[2];
+    uint8_t image_format[4];
+    uint8_t flags[4];
+    uint8_t blocks[4];
+    uint8_t data_offset[4];
+    uint8_t data_length[4];
+    uint8_t comment_offset[4];
+    uint8_t comment_length[4];
+    uint8_t creator_offset[4];
+    uint8_t creator_length[4];
+    uint8_t reserved[16];
+};
+
+enum two_img_format_t
+{
+    two_img_format_dos      = 0,
+    two_img_format_prodos   = 1,
+    two_img_format_nibble   = 2,
+};
+
 disk_t::disk_t(const std::string & pathname)
+    : _pathname(pathname)
 {
     int fd = open(pathname.c_str(), O_RDONLY);
     if (fd < 0) {
@@ -42,39 +80,173 @@ disk_t::disk_t(const std::string & pathname)
         throw std::runtime_error("image is not a regular file");
     }
 
-    if (st.st_size % BLOCK_SIZE != 0) {
-        throw std::runtime_error("image size is not a multiple of block size");
+    // The mapping is read-only until a block is written in place (see WriteBlock), so that
+    // populating it maps the file's pages rather than copying them.
+    int flags = MAP_PRIVATE | ((size_t)st.st_size <= POPULATE_SIZE ? MAP_POPULATE : 0);
+    _map = mmap(nullptr, st.st_size, PROT_READ, flags, fd, 0);
+    if (_map == MAP_FAILED) {
+        _map = nullptr;
+        throw std::runtime_error("unable to memory map image file");
     }
 
-    _base = mmap(nullptr, st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (_base == nullptr) {
-        throw std::runtime_error("unable to memory map image file");
+    _map_size = st.st_size;
+    _base = _map;
+    _size = _map_size;
+
+    // Images that are not simply a sequence of blocks are recognized by their contents.
+    try {
+        if (_map_size >= sizeof(two_img_header) && memcmp(_map, "2IMG", 4) == 0) {
+            _ParseTwoImg();
+        }
+        else if (nufx_decoder_t::Recognize(_map, _map_size)) {
+            _SetDecoder(new nufx_decoder_t(_map, _map_size));
+        }
+        else if (nibble_decoder_t::Recognize(_map, _map_size)) {
+            _SetDecoder(new nibble_decoder_t(_map, _map_size));
+        }
+    }
+    catch (...) {
+        munmap(_map, _map_size);
+        throw;
+    }
+
+    if (_decoder) {
+        return;
+    }
+
+    if (_size % BLOCK_SIZE != 0) {
+        munmap(_map, _map_size);
+        throw std::runtime_error("image size is not a multiple of block size");
     }
 
-    _size = st.st_size;
     _num_blocks = _size / BLOCK_SIZE;
 }
 
 disk_t::~disk_t()
 {
-    if (_converted) {
+    if (_allocated) {
         operator delete (_base);
     }
-    else {
-        munmap(_base, _size);
+
+    munmap(_map, _map_size);
+}
+
+void
+disk_t::_ParseTwoImg()
+{
+    auto header = (const two_img_header *)_map;
+    auto header_length = LE_Read16(header->header_length);
+    auto format = LE_Read32(header->image_format);
+    auto blocks = LE_Read32(header->blocks);
+    auto data_offset = LE_Read32(header->data_offset);
+    auto data_length = LE_Read32(header->data_length);
+
+    // ProDOS-order images sometimes leave the data length empty and rely on the block count.
+    if (data_length == 0 && format == two_img_format_prodos) {
+        data_length = blocks * BLOCK_SIZE;
+    }
+
+    if (header_length < sizeof(two_img_header) || data_offset < header_length || data_length == 0
+        || (size_t)data_offset + data_length > _map_size) {
+        throw std::runtime_error("invalid 2IMG header");
+    }
+
+    LOG(LOG_VERBOSE, "2IMG image: format %u, %u blocks, %u bytes of data at offset %u",
+                     format, blocks, data_length, data_offset);
+
+    switch (format) {
+    case two_img_format_dos:
+        _order = order_dos;
+        break;
+    case two_img_format_prodos:
+        _order = order_prodos;
+        _header_blocks = blocks;
+        break;
+    case two_img_format_nibble:
+        _SetDecoder(new nibble_decoder_t((uint8_t *)_map + data_offset, data_length));
+        return;
+    default:
+        throw std::runtime_error("unsupported 2IMG image format");
     }
+
+    // The data is used where it lies in the mapping; there is no need to copy it.
+    _data_offset = data_offset;
+    _base = (uint8_t *)_map + data_offset;
+    _size = data_length;
+}
+
+void
+disk_t::_SetDecoder(decoder_t * decoder)
+{
+    _decoder.reset(decoder);
+    _num_blocks = decoder->NumBlocks();
+    _size = (size_t)_num_blocks * BLOCK_SIZE;
+
+    // The decoded image is filled in as blocks are read. Pages that are never touched
+    // are never actually allocated.
+    _base = operator new (_size);
+    _allocated = true;
+    _order = order_prodos;
+
+    auto per_unit = decoder->BlocksPerUnit();
+    _decoded.assign((_num_blocks + per_unit - 1) / per_unit, false);
+
+    // The in-memory image is not what is in the file.
+    _dirty = true;
+}
+
+void
+disk_t::_Decode(int index) const
+{
+    auto unit = index / _decoder->BlocksPerUnit();
+    std::lock_guard<std::mutex> lock(_decode_mutex);
+    _decode_lookups++;
+    if (!_decoded[unit]) {
+        _decode_misses++;
+        _decoder->Decode(unit, (uint8_t *)_base, _decoded);
+    }
+}
+
+void
+disk_t::DecodeCounts(uint64_t * lookups, uint64_t * misses) const
+{
+    std::lock_guard<std::mutex> lock(_decode_mutex);
+    *lookups = _decode_lookups;
+    *misses = _decode_misses;
 }
 
 const void *
 disk_t::ReadBlock(int index) const
 {
+    PRODOS_PROBE1(read_block, index);
+
     if (index < 0 || index >= _num_blocks) {
         throw std::runtime_error("invalid block number");
     }
 
+    if (_decoder) {
+        _Decode(index);
+    }
+
     return BLOCK_ADDR(index);
 }
 
+void
+disk_t::WillNeed(unsigned index, unsigned count) const
+{
+    if (_decoder || _allocated || index >= _num_blocks || count == 0 || _map_size <= POPULATE_SIZE) {
+        return;
+    }
+
+    static const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+
+    count = std::min(count, _num_blocks - index);
+    auto start = (uintptr_t)BLOCK_ADDR(index) & ~(page_size - 1);
+    auto end = (uintptr_t)BLOCK_ADDR(index + count);
+
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
 void
 disk_t::WriteBlock(int index, const void * block)
 {
@@ -82,6 +254,17 @@ disk_t::WriteBlock(int index, const void * block)
         throw std::runtime_error("invalid block number");
     }
 
+    if (_decoder) {
+        _Decode(index);
+    }
+    else if (!_allocated && !_writable) {
+        // Only the blocks written get private copies.
+        if (mprotect(_map, _map_size, PROT_READ|PROT_WRITE) < 0) {
+            throw std::runtime_error(std::string("unable to write to image mapping: ") + strerror(errno));
+        }
+        _writable = true;
+    }
+
     memcpy(BLOCK_ADDR(index), block, BLOCK_SIZE);
 
     _dirty = true;
@@ -98,12 +281,19 @@ disk_t::ReadTrackSector(int track, int sector) const
     }
 
     auto index = track * SECTORS_PER_TRACK + sector;
+    if (index * SECTOR_SIZE >= _size) {
+        throw std::runtime_error("invalid track number");
+    }
+
+    if (_decoder) {
+        _Decode(index * SECTOR_SIZE / BLOCK_SIZE);
+    }
 
     return SECTOR_ADDR(index);
 }
 
 void
-disk_t::_ReadRwtsBlock(size_t index, void * block)
+disk_t::_ReadRwtsBlock(const void * source, size_t index, void * block)
 {
     static int map1[] = {  0, 13, 11, 9 ,7, 5, 3,  1 };
     static int map2[] = { 14, 12, 10, 8, 6, 4, 2, 15 };
@@ -117,8 +307,74 @@ disk_t::_ReadRwtsBlock(size_t index, void * block)
     LOG(LOG_DEBUG3, "assembling block %03lu [%06lx] from track %02lu, sectors %02d [%06zx] and %02d [%06zx]",
                     index, blk_offset, track, sector1, src1_offset, sector2, src2_offset);
 
-    memcpy(block, _base + src1_offset, SECTOR_SIZE);
-    memcpy(block + SECTOR_SIZE, _base + src2_offset, SECTOR_SIZE);
+    memcpy(block, source + src1_offset, SECTOR_SIZE);
+    memcpy(block + SECTOR_SIZE, source + src2_offset, SECTOR_SIZE);
+}
+
+/*
+** The Apple partition map structures. Multi-byte fields are big-endian.
+*/
+struct apm_driver_descriptor
+{
+    uint8_t sb_sig[2];
+    uint8_t sb_blk_size[2];
+    uint8_t sb_blk_count[4];
+};
+
+struct apm_partition_entry
+{
+    uint8_t pm_sig[2];
+    uint8_t pm_sig_pad[2];
+    uint8_t pm_map_blk_cnt[4];
+    uint8_t pm_py_part_start[4];
+    uint8_t pm_part_blk_cnt[4];
+    uint8_t pm_part_name[32];
+    uint8_t pm_par_type[32];
+};
+
+std::vector<partition_t>
+disk_t::Partitions() const
+{
+    std::vector<partition_t> partitions;
+
+    if (_num_blocks < 2) {
+        return partitions;
+    }
+
+    auto ddr = (const apm_driver_descriptor *)ReadBlock(0);
+    if (memcmp(ddr->sb_sig, "ER", 2) != 0) {
+        return partitions;
+    }
+
+    // Partition locations are in device blocks, which are usually, but not always, 512 bytes.
+    unsigned scale = std::max(BE_Read16(ddr->sb_blk_size) / (unsigned)BLOCK_SIZE, 1u);
+
+    auto first = (const apm_partition_entry *)ReadBlock(1);
+    unsigned map_blocks = BE_Read32(first->pm_map_blk_cnt);
+    for (unsigned i = 1; i <= map_blocks && i < _num_blocks; i++) {
+        auto entry = (const apm_partition_entry *)ReadBlock(i);
+        if (memcmp(entry->pm_sig, "PM", 2) != 0) {
+            break;
+        }
+
+        partition_t partition;
+        partition.first_block = BE_Read32(entry->pm_py_part_start) * scale;
+        partition.num_blocks = BE_Read32(entry->pm_part_blk_cnt) * scale;
+        partition.name.assign((const char *)entry->pm_part_name,
+                              strnlen((const char *)entry->pm_part_name, sizeof(entry->pm_part_name)));
+        partition.type.assign((const char *)entry->pm_par_type,
+                              strnlen((const char *)entry->pm_par_type, sizeof(entry->pm_par_type)));
+
+        if (partition.first_block >= _num_blocks) {
+            LOG(LOG_WARNING, "partition %u starts past the end of the disk", i);
+            continue;
+        }
+        partition.num_blocks = std::min(partition.num_blocks, _num_blocks - partition.first_block);
+
+        partitions.push_back(partition);
+    }
+
+    return partitions;
 }
 
 void
@@ -130,12 +386,96 @@ disk_t::Convert(convert_t direction)
 
     auto base = operator new (_size);
     for (int i = 0; i < _num_blocks; i++) {
-        _ReadRwtsBlock(i, (uint8_t *)base + i * BLOCK_SIZE);
+        _ReadRwtsBlock(_base, i, (uint8_t *)base + i * BLOCK_SIZE);
+    }
+
+    if (_allocated) {
+        operator delete (_base);
     }
 
-    munmap(_base, _size);
+    // The mapping is kept, since saving a container image needs its header.
     _base = base;
+    _allocated = true;
+    _order = order_prodos;
     _converted = true;
+    _dirty = true;
+}
+
+static uint64_t
+S_HashBlock(const void * block, size_t size)
+{
+    const uint64_t FNV_OFFSET = 0xCBF29CE484222325;
+    const uint64_t FNV_PRIME = 0x100000001B3;
+
+    auto words = (const uint8_t *)block;
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, words + i, sizeof(word));
+        hash = (hash ^ word) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+bool
+disk_t::TrackChanges()
+{
+    if (_decoder) {
+        return false;
+    }
+
+    _block_hashes.resize(_num_blocks);
+    for (unsigned i = 0; i < _num_blocks; i++) {
+        _block_hashes[i] = S_HashBlock(BLOCK_ADDR(i), BLOCK_SIZE);
+    }
+
+    return true;
+}
+
+bool
+disk_t::Remap(std::vector<bool> & changed)
+{
+    if (_decoder || _block_hashes.size() != _num_blocks) {
+        return false;
+    }
+
+    int fd = open(_pathname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LOG(LOG_ERROR, "unable to open image file: %s", strerror(errno));
+        return false;
+    }
+
+    liberator_t<int, int (*)(int)> liberator(fd, close);
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != _map_size) {
+        LOG(LOG_ERROR, "image file size has changed");
+        return false;
+    }
+
+    // Replacing the mapping in place also drops the private copies of any blocks that were
+    // written, e.g. by deobfuscation.
+    if (mmap(_map, _map_size, PROT_READ, MAP_PRIVATE|MAP_FIXED, fd, 0) == MAP_FAILED) {
+        LOG(LOG_ERROR, "unable to remap image file: %s", strerror(errno));
+        return false;
+    }
+    _writable = false;
+
+    if (_converted) {
+        for (unsigned i = 0; i < _num_blocks; i++) {
+            _ReadRwtsBlock((uint8_t *)_map + _data_offset, i, BLOCK_ADDR(i));
+        }
+    }
+
+    changed.assign(_num_blocks, false);
+    for (unsigned i = 0; i < _num_blocks; i++) {
+        auto hash = S_HashBlock(BLOCK_ADDR(i), BLOCK_SIZE);
+        changed[i] = hash != _block_hashes[i];
+        _block_hashes[i] = hash;
+    }
+
+    return true;
 }
 
 ssize_t
@@ -154,16 +494,48 @@ bool disk_t::Save(const std::string & pathname) const
 {
     std::string tempname = pathname + ".tmp";
 
+    // An encoded image is saved decoded, so all of it has to be decoded first.
+    if (_decoder) {
+        for (int i = 0; i < _num_blocks; i++) {
+            _Decode(i);
+        }
+    }
+
     int fd = open(tempname.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
     if (fd < 0) {
         return false;
     }
 
+    // A container image is written back with its header and trailing chunks, with the
+    // declared order updated if the data has been converted.
+    if (_data_offset > 0) {
+        std::string header((const char *)_map, _data_offset);
+        if (_converted) {
+            auto & format = ((two_img_header *)header.data())->image_format;
+            memset(format, 0, sizeof(format));
+            format[0] = two_img_format_prodos;
+        }
+
+        size_t n = write(fd, header.data(), header.size());
+        if (n != header.size()) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
     size_t n = write(fd, _base, _size);
     if (n != _size) {
         throw std::runtime_error(strerror(errno));
     }
 
+    size_t trailer_offset = _data_offset + _size;
+    if (_data_offset > 0 && trailer_offset < _map_size) {
+        size_t trailer_size = _map_size - trailer_offset;
+        n = write(fd, (const char *)_map + trailer_offset, trailer_size);
+        if (n != trailer_size) {
+            throw std::runtime_error(strerror(errno));
+        }
+    }
+
     close(fd);
     if (rename(tempname.c_str(), pathname.c_str()) != 0) {
         throw std::runtime_error(strerror(errno));
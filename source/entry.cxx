@@ -89,11 +89,11 @@ entry_t::NameLength() const
     return entry->storage_type_and_name_length & 0x0F;
 }
 
-std::string
+std::string_view
 entry_t::FileName() const
 {
     auto entry = (const directory_entry *)this;
-    return { (char *)entry->file_name, NameLength() };
+    return { (const char *)entry->file_name, NameLength() };
 }
 
 timestamp_t
@@ -173,9 +173,10 @@ entry_t::IsRoot() const
 }
 
 bool
-entry_t::NameMatches(const std::string & name) const
+entry_t::NameMatches(std::string_view name) const
 {
-    return strcasecmp(name.c_str(), FileName().c_str()) == 0;
+    auto entry = (const directory_entry *)this;
+    return name.length() == NameLength() && NamesEqual(name.data(), (const char *)entry->file_name, name.length());
 }
 
 //================================================================================================
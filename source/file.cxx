@@ -6,9 +6,13 @@
 
 #include "prodos/file.hxx"
 
+#include "prodos/index.hxx"
+#include "prodos/probe.hxx"
+#include "prodos/stats.hxx"
 #include "prodos/volume.hxx"
 #include "prodos/util.hxx"
 
+#include <algorithm>
 #include <stdexcept>
 
 #include <string.h>
@@ -34,16 +38,8 @@ file_handle_t::file_handle_t(const volume_t *context, const directory_entry_t *e
 {
     switch (entry->StorageType()) {
     case storage_type_seedling_file:
-        _data = (uint8_t *)_context->GetBlock(entry->KeyPointer());
-        break;
     case storage_type_sapling_file:
-        _index = (index_block_t *)_context->GetBlock(entry->KeyPointer());
-        _data = (uint8_t *)_context->GetBlock(_index->At(0));
-        break;
     case storage_type_tree_file:
-        _master = (index_block_t *)_context->GetBlock(entry->KeyPointer());
-        _index = (index_block_t *)_context->GetBlock(_master->At(0));
-        _data = (uint8_t *)_context->GetBlock(_index->At(0));
         break;
     default:
         throw std::logic_error("unexpected storage type");
@@ -55,9 +51,6 @@ file_handle_t::Close()
 {
     _context    = nullptr;
     _entry      = nullptr;
-    _master     = nullptr;
-    _index      = nullptr;
-    _data       = nullptr;
     _position   = 0;
 }
 
@@ -76,8 +69,26 @@ file_handle_t::Eof() const
 off_t
 file_handle_t::Seek(off_t offset, int whence)
 {
-    if (whence != SEEK_SET) {
-        throw std::logic_error("only SEEK_SET currently implemented");
+    PRODOS_PROBE2(file_seek, this, offset);
+
+    switch (whence) {
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += _position;
+        break;
+    case SEEK_END:
+        offset += _entry->Eof();
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        offset = FindData(offset, whence);
+        if (offset < 0) {
+            return -1;
+        }
+        break;
+    default:
+        throw std::logic_error("unexpected whence");
     }
 
     if (offset < 0 || offset > _entry->Eof()) {
@@ -85,43 +96,258 @@ file_handle_t::Seek(off_t offset, int whence)
         return -1;
     }
 
-    const size_t BYTES_PER_BLOCK = BLOCK_SIZE;
-    const size_t BYTES_PER_INDEX_BLOCK = BLOCK_SIZE * 256;
-
     _position = offset;
-    if (_master) {
-        int i = offset / BYTES_PER_INDEX_BLOCK;
-        offset -= i * BYTES_PER_INDEX_BLOCK;
-        _index = (index_block_t *)_context->GetBlock(_master->At(i));
+
+    return _position;
+}
+
+off_t
+file_handle_t::FindData(off_t offset, int whence) const
+{
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        throw std::logic_error("unexpected whence");
     }
-    if (_index) {
-        int i = offset / BYTES_PER_BLOCK;
-        _data = (uint8_t *)_context->GetBlock(_index->At(i));
+
+    off_t eof = _entry->Eof();
+    if (offset < 0 || offset >= eof) {
+        error = err_position_out_of_range;
+        return -1;
     }
 
-    return _position;
+    // Skip the blocks that are not what is looked for, a run at a time.
+    size_t blocks = (eof + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t index = offset / BLOCK_SIZE; index < blocks; ) {
+        size_t count = 1;
+        if (_HasData(index, &count) == (whence == SEEK_DATA)) {
+            return std::max(offset, (off_t)(index * BLOCK_SIZE));
+        }
+        index += count;
+    }
+
+    if (whence == SEEK_HOLE) {
+        return eof;
+    }
+
+    error = err_end_of_file;
+    return -1;
+}
+
+void
+file_handle_t::Layout(file_layout_t * layout) const
+{
+    const size_t POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+
+    size_t num_blocks = std::max<size_t>(1, (_entry->Eof() + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    layout->key_block = _entry->KeyPointer();
+    layout->index_blocks.clear();
+    layout->extents.clear();
+
+    switch (_entry->StorageType()) {
+    case storage_type_seedling_file:
+        break;
+    case storage_type_sapling_file:
+        layout->index_blocks.push_back(layout->key_block);
+        break;
+    case storage_type_tree_file: {
+        layout->index_blocks.push_back(layout->key_block);
+        auto master = (const index_block_t *)_context->GetBlock(layout->key_block, trace_index);
+        auto count = std::min((num_blocks + POINTERS_PER_INDEX_BLOCK - 1) / POINTERS_PER_INDEX_BLOCK,
+                              POINTERS_PER_INDEX_BLOCK);
+        for (size_t i = 0; i < count; i++) {
+            if (auto pointer = master->At(i)) {
+                layout->index_blocks.push_back(pointer);
+            }
+        }
+        break;
+    }
+    default:
+        throw std::logic_error("unexpected storage type");
+    }
+
+    for (size_t i = 0; i < num_blocks; i++) {
+        uint16_t block = _DataBlock(i);
+
+        if (!layout->extents.empty()) {
+            auto & last = layout->extents.back();
+            if (last.count < UINT16_MAX &&
+                (last.disk_block == 0 ? block == 0 : block == last.disk_block + last.count)) {
+                last.count++;
+                continue;
+            }
+        }
+
+        layout->extents.push_back({ (uint32_t)i, block, 1 });
+    }
 }
 
 size_t
 file_handle_t::Read(void *buffer, size_t size)
 {
+    auto bytes_read = ReadAt(_position, buffer, size);
+    if (bytes_read < 0) {
+        return 0;
+    }
+
+    _position += bytes_read;
+
+    return bytes_read;
+}
+
+ssize_t
+file_handle_t::ReadAt(off_t offset, void *buffer, size_t size) const
+{
+    stat_timer_t timer(stat_read);
+    PRODOS_PROBE3(file_read, this, offset, size);
+
+    if (offset < 0 || offset > _entry->Eof()) {
+        error = err_position_out_of_range;
+        return -1;
+    }
+
+    size = std::min(size, (size_t)(_entry->Eof() - offset));
+    _ReadAhead(offset, size);
+
     size_t bytes_read = 0;
 
     while (size > 0) {
-        size_t index = _position % BLOCK_SIZE;
+        size_t index = offset % BLOCK_SIZE;
         size_t to_copy = std::min(size, BLOCK_SIZE - index);
-        memcpy(buffer, _data + index, to_copy);
+        auto data = (const uint8_t *)_context->GetBlock(_DataBlock(offset / BLOCK_SIZE));
+        memcpy(buffer, data + index, to_copy);
 
         bytes_read += to_copy;
         buffer += to_copy;
         size -= to_copy;
-
-        Seek(_position + to_copy, SEEK_SET);
+        offset += to_copy;
     }
 
     return bytes_read;
 }
 
+uint16_t
+file_handle_t::_DataBlock(size_t index) const
+{
+    const size_t POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+
+    // The extents are only used until a refresh of the volume replaces its index.
+    if (_extents != nullptr && _generation == _context->_generation.load(std::memory_order_relaxed)) {
+        auto extent = std::upper_bound(_extents, _extents + _extent_count, index,
+                                       [](size_t i, const index_extent & e) { return i < e.file_block; });
+        if (extent == _extents) {
+            return 0;
+        }
+        extent--;
+        if (index - extent->file_block >= extent->count || extent->disk_block == 0) {
+            return 0;
+        }
+        return extent->disk_block + (index - extent->file_block);
+    }
+
+    switch (_entry->StorageType()) {
+    case storage_type_seedling_file:
+        return index == 0 ? _entry->KeyPointer() : 0;
+    case storage_type_sapling_file: {
+        auto index_block = (const index_block_t *)_context->GetBlock(_entry->KeyPointer(), trace_index);
+        return index_block->At(index);
+    }
+    case storage_type_tree_file: {
+        auto master = (const index_block_t *)_context->GetBlock(_entry->KeyPointer(), trace_index);
+        auto pointer = master->At(index / POINTERS_PER_INDEX_BLOCK);
+        if (pointer == 0) {
+            return 0;
+        }
+        auto index_block = (const index_block_t *)_context->GetBlock(pointer, trace_index);
+        return index_block->At(index % POINTERS_PER_INDEX_BLOCK);
+    }
+    default:
+        throw std::logic_error("unexpected storage type");
+    }
+}
+
+void
+file_handle_t::_ReadAhead(off_t offset, size_t size) const
+{
+    const size_t READAHEAD_BLOCKS = 1024;
+
+    // Reading from the start of a file is taken for the start of a sequential read too.
+    auto previous = _readahead.next_offset.exchange(offset + size, std::memory_order_relaxed);
+    if (offset != 0 && offset != previous) {
+        return;
+    }
+
+    size_t num_blocks = (_entry->Eof() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t next = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t advised = _readahead.advised.load(std::memory_order_relaxed);
+    if (advised < next || advised > next + READAHEAD_BLOCKS) {
+        advised = next;
+    }
+
+    // Ask for more once the reads are halfway through what has been asked for.
+    if (advised >= std::min(next + READAHEAD_BLOCKS / 2, num_blocks)) {
+        return;
+    }
+
+    size_t last = std::min(next + READAHEAD_BLOCKS, num_blocks);
+    _readahead.advised.store(last, std::memory_order_relaxed);
+
+    // Ask for the data blocks a run at a time, skipping sparse ones.
+    for (size_t index = advised; index < last; ) {
+        auto block = _DataBlock(index);
+        size_t count = 1;
+        while (block != 0 && index + count < last && _DataBlock(index + count) == block + count) {
+            count++;
+        }
+        if (block != 0) {
+            _context->WillNeed(block, count);
+        }
+        index += count;
+    }
+}
+
+bool
+file_handle_t::_HasData(size_t index, size_t * count) const
+{
+    const size_t POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+
+    *count = 1;
+
+    if (_extents != nullptr && _generation == _context->_generation.load(std::memory_order_relaxed)) {
+        auto extent = std::upper_bound(_extents, _extents + _extent_count, index,
+                                       [](size_t i, const index_extent & e) { return i < e.file_block; });
+        if (extent == _extents) {
+            return false;
+        }
+        extent--;
+        if (index - extent->file_block >= extent->count) {
+            return false;
+        }
+        *count = extent->count - (index - extent->file_block);
+        return extent->disk_block != 0;
+    }
+
+    switch (_entry->StorageType()) {
+    case storage_type_seedling_file:
+    case storage_type_sapling_file:
+        return index < POINTERS_PER_INDEX_BLOCK && _DataBlock(index) != 0;
+    case storage_type_tree_file: {
+        auto pointer = index / POINTERS_PER_INDEX_BLOCK;
+        if (pointer >= POINTERS_PER_INDEX_BLOCK) {
+            return false;
+        }
+        auto master = (const index_block_t *)_context->GetBlock(_entry->KeyPointer(), trace_index);
+        if (master->At(pointer) == 0) {
+            // None of the blocks its index block would have pointed to are allocated.
+            *count = POINTERS_PER_INDEX_BLOCK - index % POINTERS_PER_INDEX_BLOCK;
+            return false;
+        }
+        return _DataBlock(index) != 0;
+    }
+    default:
+        throw std::logic_error("unexpected storage type");
+    }
+}
+
 } // namespace
 
 // eof
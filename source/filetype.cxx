@@ -6,60 +6,63 @@
 
 #include "prodos/filetype.hxx"
 
-#include <unordered_map>
+#include <array>
+
+#include <stdio.h>
 
 namespace prodos
 {
 
-typedef std::unordered_map<uint8_t, const file_type_info_t>  file_type_table_t;
-
-// Forward declaration for internal table so that it can be
-// referenced before it is defined, since it is long.
-namespace { extern file_type_table_t  file_type_table; }
-
-const file_type_info_t *
-GetFileTypeInfo(uint8_t type)
+namespace
 {
-    return &file_type_table[type];
-}
 
-bool IsAppleWorksFile(uint8_t type)
+// The text of the file types that have no name of their own, e.g. "$02", "02" and
+// "File type $02 file", generated at compile time so that the table can point to it.
+struct generated_text
 {
-    return type == file_type_appleworks_wp
-        || type == file_type_appleworks_ss
-        || type == file_type_appleworks_db;
-}
+    char    type[4];
+    char    name[3];
+    char    description[19];
+};
 
-static file_type_info_t
-S_CreateFileTypeInfo(uint8_t type, const char * name = nullptr, const char * description = nullptr)
+constexpr char S_HexDigit(int n)
 {
-    char type_buffer[8] = {};
-    sprintf(type_buffer, "$%02X", type);
-
-    char name_buffer[8] = {};
-    if (name == nullptr) {
-        sprintf(name_buffer, "%02X", type);
-        name = name_buffer;
-    }
-
-    char description_buffer[32] = {};
-    if (description == nullptr) {
-        sprintf(description_buffer, "File type %s file", type_buffer);
-        description = description_buffer;
-    }
-
-    return file_type_info_t{type_buffer, name, description};
+    return "0123456789ABCDEF"[n & 0x0F];
 }
 
+constexpr std::array<generated_text, 256> generated = [] {
+    std::array<generated_text, 256> texts = {};
+    for (int code = 0; code < 256; code++) {
+        auto & text = texts[code];
+        const char hex[2] = { S_HexDigit(code >> 4), S_HexDigit(code) };
+        const char description[] = "File type $?? file";
+        text.type[0] = '$';
+        text.type[1] = hex[0];
+        text.type[2] = hex[1];
+        text.name[0] = hex[0];
+        text.name[1] = hex[1];
+        for (size_t i = 0; i < sizeof(text.description); i++) {
+            text.description[i] = description[i];
+        }
+        text.description[11] = hex[0];
+        text.description[12] = hex[1];
+    }
+    return texts;
+}();
 
-namespace
+constexpr file_type_info_t
+S_FileTypeInfo(uint8_t code, const char * name, const char * description)
 {
+    return {
+        { generated[code].type, 3 },
+        name ? std::string_view(name) : std::string_view(generated[code].name, 2),
+        description ? std::string_view(description) : std::string_view(generated[code].description, 18),
+    };
+}
 
-// Define the constant file type table last so that it is out of the way of
-// the functions that use it.
-
-#define ADD_FILE_TYPE(code,type,desc)   { code, S_CreateFileTypeInfo(code, type, desc) }
-file_type_table_t  file_type_table =
+// The table is indexed by file type, so the entries must be in order.
+#define ADD_FILE_TYPE(code,type,desc)   S_FileTypeInfo(code, type, desc)
+constexpr file_type_info_t  file_type_table[256] =
 {
     ADD_FILE_TYPE(0x00,  "---",     "Typeless file"),
     ADD_FILE_TYPE(0x01,  "BAD",     "Bad block file"),
@@ -318,9 +321,100 @@ file_type_table_t  file_type_table =
     ADD_FILE_TYPE(0xFE,  "REL",     "Relocatable code file"),
     ADD_FILE_TYPE(0xFF,  "SYS",     "System file"),
 };
+#undef ADD_FILE_TYPE
+
+constexpr bool S_IsInOrder()
+{
+    for (int code = 0; code < 256; code++) {
+        if (file_type_table[code].type != std::string_view(generated[code].type, 3)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static_assert(S_IsInOrder(), "file types out of order");
+
+// File types whose aux type tells more about the contents, sorted by type and aux type.
+struct file_subtype_info_t
+{
+    uint8_t             type;
+    uint16_t            aux_type;
+    file_type_info_t    info;
+};
+
+constexpr file_subtype_info_t   file_subtype_table[] =
+{
+    { 0x08, 0x4000, { "$08", "FOT", "Packed Hi-Res picture file" } },
+    { 0x08, 0x4001, { "$08", "FOT", "Packed Double Hi-Res picture file" } },
+    { 0x50, 0x8010, { "$50", "GWP", "AppleWorks GS word processor file" } },
+    { 0x51, 0x8010, { "$51", "GSS", "AppleWorks GS spreadsheet file" } },
+    { 0x52, 0x8010, { "$52", "GDB", "AppleWorks GS database file" } },
+    { 0xC0, 0x0001, { "$C0", "PNT", "Packed Super Hi-Res picture file" } },
+    { 0xC0, 0x0002, { "$C0", "PNT", "Apple Preferred Format picture file" } },
+    { 0xC1, 0x0000, { "$C1", "PIC", "Super Hi-Res screen image file" } },
+    { 0xE0, 0x8000, { "$E0", "BNY", "Binary II archive file" } },
+    { 0xE0, 0x8002, { "$E0", "SHK", "ShrinkIt archive file" } },
+};
+
+// Which file types have entries in the subtype table, so that the others are not searched.
+constexpr std::array<bool, 256> has_subtypes = [] {
+    std::array<bool, 256> types = {};
+    for (const auto & subtype : file_subtype_table) {
+        types[subtype.type] = true;
+    }
+    return types;
+}();
 
 } // anonymous namespace
 
+const file_type_info_t *
+GetFileTypeInfo(uint8_t type)
+{
+    return &file_type_table[type];
+}
+
+const file_type_info_t *
+GetFileTypeInfo(uint8_t type, uint16_t aux_type)
+{
+    if (has_subtypes[type]) {
+        for (const auto & subtype : file_subtype_table) {
+            if (subtype.type == type && subtype.aux_type == aux_type) {
+                return &subtype.info;
+            }
+        }
+    }
+
+    return &file_type_table[type];
+}
+
+std::string_view
+FileSubtype(uint8_t type, uint16_t aux_type, char (&buffer)[8])
+{
+    int length = 0;
+    switch (type) {
+        case file_type_binary:
+            if (aux_type != 0) {
+                length = snprintf(buffer, sizeof(buffer), "A=$%04X", aux_type);
+            }
+            break;
+        case file_type_text:
+            if (aux_type != 0) {
+                length = snprintf(buffer, sizeof(buffer), "R=%5u", aux_type);
+            }
+            break;
+    }
+
+    return { buffer, (size_t)length };
+}
+
+bool IsAppleWorksFile(uint8_t type)
+{
+    return type == file_type_appleworks_wp
+        || type == file_type_appleworks_ss
+        || type == file_type_appleworks_db;
+}
+
 } // prodos namespace
 
 // eof
@@ -0,0 +1,382 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/index.hxx"
+
+#include "prodos/block.hxx"
+#include "prodos/entry.hxx"
+#include "prodos/file.hxx"
+#include "prodos/volume.hxx"
+#include "prodos/util.hxx"
+
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace prodos
+{
+
+static const char       INDEX_MAGIC[8]  = { 'P', 'D', 'I', 'N', 'D', 'E', 'X', '1' };
+static const size_t     KEY_BYTES       = 64 * 1024;
+static const uint64_t   FNV_OFFSET      = 0xCBF29CE484222325;
+static const uint64_t   FNV_PRIME       = 0x100000001B3;
+
+static uint64_t
+S_HashPathname(const char * pathname, size_t length)
+{
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ FOLD_CASE[(uint8_t)pathname[i]]) * FNV_PRIME;
+    }
+
+    return hash;
+}
+
+bool
+index_t::Key(const std::string & image, index_key * key)
+{
+    int fd = open(image.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    liberator_t<int, int (*)(int)> closer(fd, close);
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    // Hashing a word at a time is plenty to tell images with the same size and time apart.
+    std::vector<uint64_t> words(KEY_BYTES / sizeof(uint64_t));
+    auto n = pread(fd, words.data(), KEY_BYTES, 0);
+    if (n < 0) {
+        return false;
+    }
+
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < (n + sizeof(uint64_t) - 1) / sizeof(uint64_t); i++) {
+        hash = (hash ^ words[i]) * FNV_PRIME;
+    }
+
+    key->size = st.st_size;
+    key->mtime = st.st_mtim.tv_sec * 1'000'000'000LL + st.st_mtim.tv_nsec;
+    key->hash = hash;
+
+    return true;
+}
+
+std::string
+index_t::Pathname(const std::string & image)
+{
+    return image + ".pdx";
+}
+
+index_t::~index_t()
+{
+    if (_mapped) {
+        munmap((void *)_data, _size);
+    }
+}
+
+std::unique_ptr<index_t>
+index_t::Open(const std::string & image, const index_key & key)
+{
+    auto pathname = Pathname(image);
+    int fd = open(pathname.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    liberator_t<int, int (*)(int)> closer(fd, close);
+
+    struct stat st = {};
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(index_header)) {
+        return nullptr;
+    }
+
+    auto map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        return nullptr;
+    }
+
+    std::unique_ptr<index_t> index(new index_t());
+    index->_data = (const uint8_t *)map;
+    index->_size = st.st_size;
+    index->_mapped = true;
+    index->_header = (const index_header *)map;
+
+    // Everything else is checked as it is used, so this is all the parsing there is.
+    auto header = index->_header;
+    auto fits = [&st](uint64_t offset, uint64_t count, size_t size) {
+        return offset % 8 == 0 && offset <= (uint64_t)st.st_size && count <= (st.st_size - offset) / size;
+    };
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->header_size != sizeof(index_header) ||
+        header->bucket_count == 0 || (header->bucket_count & (header->bucket_count - 1)) != 0 ||
+        !fits(header->entries_offset, header->entry_count, sizeof(index_entry)) ||
+        !fits(header->buckets_offset, header->bucket_count, sizeof(uint32_t)) ||
+        !fits(header->extents_offset, header->extent_count, sizeof(index_extent)) ||
+        !fits(header->names_offset, header->names_size, 1)) {
+        LOG(LOG_WARNING, "ignoring invalid index %s", pathname.c_str());
+        return nullptr;
+    }
+
+    if (memcmp(&header->key, &key, sizeof(key)) != 0) {
+        LOG(LOG_INFO, "ignoring out-of-date index %s", pathname.c_str());
+        return nullptr;
+    }
+
+    LOG(LOG_INFO, "using index %s", pathname.c_str());
+
+    return index;
+}
+
+const index_entry *
+index_t::Find(std::string_view pathname) const
+{
+    auto hash       = S_HashPathname(pathname.data(), pathname.length());
+    auto entries    = (const index_entry *)(_data + _header->entries_offset);
+    auto buckets    = (const uint32_t *)(_data + _header->buckets_offset);
+    auto names      = (const char *)_data + _header->names_offset;
+    auto mask       = _header->bucket_count - 1;
+
+    // Buckets hold entry numbers plus one, 0 being empty, and collisions take the next one.
+    for (uint32_t i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+        auto number = buckets[i];
+        if (number == 0 || number > _header->entry_count) {
+            return nullptr;
+        }
+
+        auto & entry = entries[number - 1];
+        if (entry.hash == hash && entry.name_length == pathname.length() &&
+            entry.name_offset <= _header->names_size &&
+            entry.name_length <= _header->names_size - entry.name_offset &&
+            NamesEqual(names + entry.name_offset, pathname.data(), pathname.length())) {
+            return &entry;
+        }
+    }
+
+    return nullptr;
+}
+
+const index_extent *
+index_t::Extents(const index_entry & entry, size_t * count) const
+{
+    if (entry.extent_count == 0 || entry.first_extent > _header->extent_count ||
+        entry.extent_count > _header->extent_count - entry.first_extent) {
+        *count = 0;
+        return nullptr;
+    }
+
+    *count = entry.extent_count;
+
+    return (const index_extent *)(_data + _header->extents_offset) + entry.first_extent;
+}
+
+const index_entry *
+index_t::EntryAt(size_t i) const
+{
+    return i < _header->entry_count ? (const index_entry *)(_data + _header->entries_offset) + i : nullptr;
+}
+
+std::string
+index_t::PathnameOf(const index_entry & entry) const
+{
+    if (entry.name_offset > _header->names_size || entry.name_length > _header->names_size - entry.name_offset) {
+        return {};
+    }
+
+    return { (const char *)_data + _header->names_offset + entry.name_offset, entry.name_length };
+}
+
+//================================================================================================
+// Building
+//------------------------------------------------------------------------------------------------
+
+struct index_builder_t
+{
+    const volume_t &            volume;
+    std::vector<index_entry>    entries;
+    std::vector<index_extent>   extents;
+    std::string                 names;
+    size_t                      blocks_visited  = 0;
+};
+
+void
+index_t::_AddExtents(const volume_t & volume, const directory_entry_t * entry, std::vector<index_extent> & extents)
+{
+    // A handle of its own, without the extents of any index the volume already has, walks
+    // the index blocks just as reading the file would.
+    file_handle_t   fh(&volume, entry);
+    file_layout_t   layout;
+    fh.Layout(&layout);
+
+    extents.insert(extents.end(), layout.extents.begin(), layout.extents.end());
+}
+
+void
+index_t::_AddDirectory(index_builder_t & builder, uint16_t key_pointer, const std::string & dir)
+{
+    const int   last_slot   = ENTRIES_PER_BLOCK - 1;
+    uint16_t    pointer     = key_pointer;
+    int         slot        = 1;    // the header takes the first slot of the key block
+    int         file_count  = -1;
+    int         found       = 0;
+
+    while (pointer != 0 && found != file_count) {
+        // A damaged directory could otherwise link blocks in a loop.
+        if (++builder.blocks_visited > (size_t)builder.volume.TotalBlocks()) {
+            throw std::runtime_error("directory structure damaged");
+        }
+
+        auto block = (const directory_block *)builder.volume.GetBlock(pointer, trace_directory);
+        if (file_count < 0) {
+            file_count = LE_Read16(block->key.header.file_count);
+        }
+
+        for (; slot <= last_slot && found != file_count; slot++) {
+            auto entry = (const directory_entry_t *)&block->any.entry[slot];
+            if (entry->IsInactive()) {
+                continue;
+            }
+            found++;
+
+            auto pathname = dir + "/";
+            pathname += entry->FileName();
+
+            index_entry indexed     = {};
+            indexed.hash            = S_HashPathname(pathname.data(), pathname.length());
+            indexed.name_offset     = builder.names.size();
+            indexed.name_length     = pathname.length();
+            indexed.block           = pointer;
+            indexed.slot            = slot;
+            indexed.storage_type    = entry->StorageType();
+            indexed.file_type       = entry->FileType();
+            indexed.key_pointer     = entry->KeyPointer();
+            indexed.blocks_used     = entry->BlocksUsed();
+            indexed.eof             = entry->Eof();
+            builder.names += pathname;
+
+            if (entry->IsFile()) {
+                indexed.first_extent = builder.extents.size();
+                _AddExtents(builder.volume, entry, builder.extents);
+                indexed.extent_count = builder.extents.size() - indexed.first_extent;
+            }
+            builder.entries.push_back(indexed);
+
+            if (entry->IsDirectory()) {
+                _AddDirectory(builder, entry->KeyPointer(), pathname);
+            }
+        }
+
+        pointer = LE_Read16(block->next);
+        slot = 0;
+    }
+}
+
+static uint64_t
+S_Align(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+std::unique_ptr<index_t>
+index_t::Build(const volume_t & volume, bool converted)
+{
+    index_builder_t builder = { volume, {}, {}, {}, 0 };
+    try {
+        _AddDirectory(builder, 2, "");
+    }
+    catch (const std::exception & ex) {
+        LOG(LOG_WARNING, "unable to index volume: %s", ex.what());
+        return nullptr;
+    }
+
+    // Keep the table at most half full, so that probe sequences stay short.
+    uint32_t bucket_count = 16;
+    while (bucket_count < builder.entries.size() * 2) {
+        bucket_count *= 2;
+    }
+
+    std::vector<uint32_t> buckets(bucket_count);
+    for (uint32_t i = 0; i < builder.entries.size(); i++) {
+        auto b = builder.entries[i].hash & (bucket_count - 1);
+        while (buckets[b] != 0) {
+            b = (b + 1) & (bucket_count - 1);
+        }
+        buckets[b] = i + 1;
+    }
+
+    index_header header = {};
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.header_size      = sizeof(header);
+    header.flags            = converted ? INDEX_CONVERTED : 0;
+    header.entry_count      = builder.entries.size();
+    header.bucket_count     = bucket_count;
+    header.extent_count     = builder.extents.size();
+    header.names_size       = builder.names.size();
+    header.entries_offset   = S_Align(sizeof(header));
+    header.buckets_offset   = S_Align(header.entries_offset + builder.entries.size() * sizeof(index_entry));
+    header.extents_offset   = S_Align(header.buckets_offset + buckets.size() * sizeof(uint32_t));
+    header.names_offset     = S_Align(header.extents_offset + builder.extents.size() * sizeof(index_extent));
+
+    // The index is laid out in memory exactly as in the file.
+    std::unique_ptr<index_t> index(new index_t());
+    auto & buffer = index->_buffer;
+    buffer.resize(header.names_offset + builder.names.size());
+    memcpy(&buffer[0], &header, sizeof(header));
+    memcpy(&buffer[header.entries_offset], builder.entries.data(), builder.entries.size() * sizeof(index_entry));
+    memcpy(&buffer[header.buckets_offset], buckets.data(), buckets.size() * sizeof(uint32_t));
+    memcpy(&buffer[header.extents_offset], builder.extents.data(), builder.extents.size() * sizeof(index_extent));
+    memcpy(&buffer[header.names_offset], builder.names.data(), builder.names.size());
+
+    index->_data = buffer.data();
+    index->_size = buffer.size();
+    index->_header = (const index_header *)index->_data;
+
+    return index;
+}
+
+bool
+index_t::Save(const std::string & image, const index_key & key) const
+{
+    index_header header = *_header;
+    header.key = key;
+
+    // Write a temporary file and rename it, so that a mount never sees a partial index.
+    auto pathname = Pathname(image);
+    auto tempname = pathname + ".tmp";
+    FILE * file = fopen(tempname.c_str(), "wb");
+    if (file == nullptr) {
+        LOG(LOG_INFO, "unable to create index %s", tempname.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(_data + sizeof(header), _size - sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tempname.c_str(), pathname.c_str()) != 0) {
+        LOG(LOG_WARNING, "unable to write index %s", pathname.c_str());
+        unlink(tempname.c_str());
+        return false;
+    }
+
+    LOG(LOG_INFO, "wrote index %s", pathname.c_str());
+
+    return true;
+}
+
+} // namespace
+
+// eof
@@ -0,0 +1,443 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/log.hxx"
+
+#include "prodos/util.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+namespace prodos
+{
+
+static const size_t     RING_SIZE       = 256 * 1024;   // bytes per thread, a power of two
+static const size_t     MAX_STRING      = 256;          // longest %s argument kept
+static const size_t     MAX_ARGS        = 16;
+
+static const char *     log_name        = "prodosfs";
+static FILE *           log_stream      = stderr;
+
+/*
+** A record is a header followed by the arguments, each 8 bytes except for strings, which
+** are stored as a 16-bit length and the characters. Records are padded to 8 bytes and never
+** wrap around the end of the ring; a header with no format marks the skipped tail, unless
+** it is too short to hold one.
+*/
+struct log_record
+{
+    uint32_t        size;
+    int32_t         level;
+    const char *    format;
+};
+
+// A single-producer, single-consumer ring: the owning thread writes and advances the head,
+// the writer thread reads and advances the tail.
+struct log_ring_t
+{
+    alignas(64) std::atomic<size_t>     head        = 0;
+    alignas(64) std::atomic<size_t>     tail        = 0;
+    std::atomic<size_t>                 dropped     = 0;
+    uint8_t                             data[RING_SIZE];
+};
+
+static std::mutex                                   rings_mutex;
+static std::vector<std::shared_ptr<log_ring_t>>     rings;
+static std::atomic<bool>                            async_started   = false;
+static std::atomic<bool>                            async_stop      = false;
+static std::thread                                  async_writer;
+
+// The ring of the calling thread, created on first use. The writer keeps its own reference,
+// so messages of threads that have exited are still written.
+static log_ring_t &
+S_ThreadRing()
+{
+    static thread_local std::shared_ptr<log_ring_t> ring;
+    if (!ring) {
+        ring = std::make_shared<log_ring_t>();
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        rings.push_back(ring);
+    }
+
+    return *ring;
+}
+
+// The kind of argument a conversion takes, from its length modifier and conversion letter.
+enum arg_kind_t { arg_none, arg_int, arg_long, arg_long_long, arg_size, arg_double, arg_pointer, arg_string };
+
+// Parse the conversion specification starting at the '%', up to and including the conversion
+// letter. Returns a pointer past it and sets the kind and whether the width and precision are
+// given as arguments ('*').
+static const char *
+S_ParseConversion(const char * p, arg_kind_t * kind, int * star_args)
+{
+    *star_args = 0;
+    p++;
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+    while (*p == '*' || (*p >= '0' && *p <= '9') || *p == '.') {
+        *star_args += *p == '*';
+        p++;
+    }
+
+    arg_kind_t length = arg_int;
+    if (p[0] == 'l' && p[1] == 'l') {
+        length = arg_long_long;
+        p += 2;
+    }
+    else if (*p == 'l' || *p == 'j' || *p == 't') {
+        length = arg_long;
+        p++;
+    }
+    else if (*p == 'z') {
+        length = arg_size;
+        p++;
+    }
+    else if (*p == 'h') {
+        p += p[1] == 'h' ? 2 : 1;
+    }
+    else if (*p == 'L') {
+        p++;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        *kind = length;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        *kind = arg_double;
+        break;
+    case 'p':
+        *kind = arg_pointer;
+        break;
+    case 's':
+        *kind = arg_string;
+        break;
+    default:
+        // "%%", and anything unsupported, which is written as is.
+        *kind = arg_none;
+        break;
+    }
+
+    return *p ? p + 1 : p;
+}
+
+static void
+S_WriteLine(int level, const char * message)
+{
+    flockfile(log_stream);
+    fprintf(log_stream, "%s[%02d]: %s\n", log_name, level, message);
+    funlockfile(log_stream);
+}
+
+static bool
+S_Append(log_ring_t & ring, int level, const char * format, va_list ap)
+{
+    // Gather the arguments first, so the record size is known before claiming space.
+    uint64_t        values[MAX_ARGS];
+    const char *    strings[MAX_ARGS];
+    size_t          lengths[MAX_ARGS];
+    size_t          count = 0;
+    size_t          size = sizeof(log_record);
+
+    for (auto p = format; *p; ) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+
+        arg_kind_t  kind;
+        int         star_args;
+        p = S_ParseConversion(p, &kind, &star_args);
+        if (kind == arg_none) {
+            continue;
+        }
+        if (count + star_args + 1 > MAX_ARGS) {
+            return false;
+        }
+
+        for (int i = 0; i < star_args; i++) {
+            values[count] = (uint64_t)va_arg(ap, int);
+            strings[count++] = nullptr;
+            size += 8;
+        }
+
+        strings[count] = nullptr;
+        switch (kind) {
+        case arg_int:       values[count] = (uint64_t)va_arg(ap, int); break;
+        case arg_long:      values[count] = (uint64_t)va_arg(ap, long); break;
+        case arg_long_long: values[count] = (uint64_t)va_arg(ap, long long); break;
+        case arg_size:      values[count] = (uint64_t)va_arg(ap, size_t); break;
+        case arg_pointer:   values[count] = (uint64_t)(uintptr_t)va_arg(ap, void *); break;
+        case arg_double: {
+            double d = va_arg(ap, double);
+            memcpy(&values[count], &d, sizeof(d));
+            break;
+        }
+        case arg_string: {
+            auto s = va_arg(ap, const char *);
+            strings[count] = s ? s : "(null)";
+            lengths[count] = strnlen(strings[count], MAX_STRING);
+            size += 2 + lengths[count] - 8;
+            break;
+        }
+        default:
+            break;
+        }
+        count++;
+        size += 8;
+    }
+
+    size = (size + 7) & ~(size_t)7;
+
+    auto head = ring.head.load(std::memory_order_relaxed);
+    auto tail = ring.tail.load(std::memory_order_acquire);
+    auto offset = head % RING_SIZE;
+    auto skip = offset + size > RING_SIZE ? RING_SIZE - offset : 0;
+    if (head + skip + size - tail > RING_SIZE) {
+        return false;
+    }
+
+    if (skip) {
+        if (skip >= sizeof(log_record)) {
+            auto filler = (log_record *)&ring.data[offset];
+            filler->size = skip;
+            filler->format = nullptr;
+        }
+        head += skip;
+        offset = 0;
+    }
+
+    auto record = (log_record *)&ring.data[offset];
+    record->size = size;
+    record->level = level;
+    record->format = format;
+
+    auto pos = &ring.data[offset + sizeof(log_record)];
+    for (size_t i = 0; i < count; i++) {
+        if (strings[i]) {
+            uint16_t length = lengths[i];
+            memcpy(pos, &length, sizeof(length));
+            memcpy(pos + 2, strings[i], length);
+            pos += 2 + length;
+        }
+        else {
+            memcpy(pos, &values[i], sizeof(values[i]));
+            pos += sizeof(values[i]);
+        }
+    }
+
+    ring.head.store(head + size, std::memory_order_release);
+
+    return true;
+}
+
+// Format a record one conversion at a time, taking each argument from the record.
+static void
+S_Format(const log_record * record, std::string & message)
+{
+    auto            args    = (const uint8_t *)(record + 1);
+    char            buffer[MAX_STRING + 64];
+
+    auto next_value = [&args]() {
+        uint64_t value;
+        memcpy(&value, args, sizeof(value));
+        args += sizeof(value);
+        return value;
+    };
+
+    message.clear();
+    for (auto p = record->format; *p; ) {
+        if (*p != '%') {
+            auto end = strchrnul(p, '%');
+            message.append(p, end - p);
+            p = end;
+            continue;
+        }
+
+        arg_kind_t  kind;
+        int         star_args;
+        auto        end = S_ParseConversion(p, &kind, &star_args);
+
+        // Widths and precisions given as arguments are put into the specification, so that
+        // every conversion takes exactly one argument.
+        std::string spec;
+        for (auto q = p; q < end; q++) {
+            if (*q == '*') {
+                spec += std::to_string((int)next_value());
+            }
+            else {
+                spec += *q;
+            }
+        }
+        p = end;
+
+        if (kind == arg_none) {
+            message += spec == "%%" ? "%" : spec;
+            continue;
+        }
+
+        // printf requires the argument types to match the conversion exactly.
+        int n = 0;
+        switch (kind) {
+        case arg_int:
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), (int)next_value());
+            break;
+        case arg_long:
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), (long)next_value());
+            break;
+        case arg_long_long:
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), (long long)next_value());
+            break;
+        case arg_size:
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), (size_t)next_value());
+            break;
+        case arg_pointer:
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), (void *)(uintptr_t)next_value());
+            break;
+        case arg_double: {
+            auto bits = next_value();
+            double d;
+            memcpy(&d, &bits, sizeof(d));
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), d);
+            break;
+        }
+        case arg_string: {
+            uint16_t length;
+            memcpy(&length, args, sizeof(length));
+            std::string str((const char *)args + 2, length);
+            args += 2 + length;
+            n = snprintf(buffer, sizeof(buffer), spec.c_str(), str.c_str());
+            break;
+        }
+        default:
+            break;
+        }
+        message.append(buffer, std::min((size_t)std::max(n, 0), sizeof(buffer) - 1));
+    }
+}
+
+// Write all the records currently in the rings. Returns true if there were any.
+static bool
+S_Drain()
+{
+    std::vector<std::shared_ptr<log_ring_t>> current;
+    {
+        std::lock_guard<std::mutex> lock(rings_mutex);
+        current = rings;
+    }
+
+    bool        wrote = false;
+    std::string message;
+    for (auto & ring : current) {
+        auto tail = ring->tail.load(std::memory_order_relaxed);
+        auto head = ring->head.load(std::memory_order_acquire);
+        while (tail != head) {
+            auto offset = tail % RING_SIZE;
+            if (RING_SIZE - offset < sizeof(log_record)) {
+                tail += RING_SIZE - offset;
+                continue;
+            }
+
+            auto record = (const log_record *)&ring->data[offset];
+            if (record->format) {
+                S_Format(record, message);
+                S_WriteLine(record->level, message.c_str());
+                wrote = true;
+            }
+            tail += record->size;
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        auto dropped = ring->dropped.exchange(0);
+        if (dropped) {
+            message = std::to_string(dropped) + " log messages dropped";
+            S_WriteLine(LOG_WARNING, message.c_str());
+        }
+    }
+    fflush(log_stream);
+    current.clear();
+
+    // Forget the rings of threads that have exited once they are empty.
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (auto itr = rings.begin(); itr != rings.end(); ) {
+        if (itr->use_count() == 1 && (*itr)->head == (*itr)->tail) {
+            itr = rings.erase(itr);
+        }
+        else {
+            itr++;
+        }
+    }
+
+    return wrote;
+}
+
+void
+LogInit(const char * name, FILE * stream)
+{
+    log_name = name;
+    log_stream = stream;
+}
+
+void
+LogStartAsync()
+{
+    if (async_started) {
+        return;
+    }
+
+    async_stop = false;
+    async_writer = std::thread([]() {
+        while (!async_stop) {
+            if (!S_Drain()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        S_Drain();
+    });
+    async_started = true;
+}
+
+void
+LogStopAsync()
+{
+    if (!async_started) {
+        return;
+    }
+
+    async_started = false;
+    async_stop = true;
+    async_writer.join();
+}
+
+void
+LogWrite(int level, const char * format, va_list ap)
+{
+    if (!async_started) {
+        char message[1024];
+        vsnprintf(message, sizeof(message), format, ap);
+        S_WriteLine(level, message);
+        return;
+    }
+
+    auto & ring = S_ThreadRing();
+    if (!S_Append(ring, level, format, ap)) {
+        ring.dropped++;
+    }
+}
+
+} // namespace
+
+// eof
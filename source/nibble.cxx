@@ -0,0 +1,325 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/nibble.hxx"
+
+#include "prodos/util.hxx"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <string.h>
+
+namespace prodos
+{
+
+const size_t    NIB_TRACK_SIZE      = 6656;
+const unsigned  NIB_TRACKS_MIN      = 35;
+const unsigned  NIB_TRACKS_MAX      = 40;
+
+const uint8_t   WOZ1_ID[]           = { 'W', 'O', 'Z', '1', 0xFF, 0x0A, 0x0D, 0x0A };
+const uint8_t   WOZ2_ID[]           = { 'W', 'O', 'Z', '2', 0xFF, 0x0A, 0x0D, 0x0A };
+const size_t    WOZ_HEADER_SIZE     = 12;
+const size_t    WOZ1_TRK_SIZE       = 6656;
+const size_t    WOZ1_BITS_SIZE      = 6646;     // the bitstream that starts a WOZ1 TRK
+const size_t    WOZ1_BIT_COUNT      = 6648;     // offset of the bit count in a WOZ1 TRK
+const size_t    WOZ2_TRK_SIZE       = 8;
+const int       WOZ_DISK_525        = 1;
+const uint8_t   WOZ_NO_TRACK        = 0xFF;
+
+const size_t    SECTOR_SIZE         = 256;
+const size_t    DATA_NIBBLES        = 343;      // 342 6-bit values plus a checksum
+const size_t    AUX_VALUES          = 86;       // the 2-bit values, three per nibble
+const size_t    DATA_FIELD_SEARCH   = 64;       // how far after an address field to look for data
+
+// Sectors must be read past the end of the track in case one straddles the start.
+const size_t    WRAP_NIBBLES        = 512;
+
+// The 64 disk bytes that 6-bit values are written as.
+static constexpr uint8_t S_WriteTable[64] =
+{
+    0x96, 0x97, 0x9A, 0x9B, 0x9D, 0x9E, 0x9F, 0xA6, 0xA7, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF, 0xB2, 0xB3,
+    0xB4, 0xB5, 0xB6, 0xB7, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF, 0xCB, 0xCD, 0xCE, 0xCF, 0xD3,
+    0xD6, 0xD7, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF, 0xE5, 0xE6, 0xE7, 0xE9, 0xEA, 0xEB, 0xEC,
+    0xED, 0xEE, 0xEF, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF,
+};
+
+const uint8_t   INVALID_NIBBLE      = 0xFF;
+
+struct gcr_table_t
+{
+    uint8_t     value[256];
+};
+
+// The inverse of the write table, built at compile time.
+static constexpr gcr_table_t
+S_MakeReadTable()
+{
+    gcr_table_t table = {};
+    for (int i = 0; i < 256; i++) {
+        table.value[i] = INVALID_NIBBLE;
+    }
+    for (int i = 0; i < 64; i++) {
+        table.value[S_WriteTable[i]] = i;
+    }
+    return table;
+}
+
+static constexpr gcr_table_t S_ReadTable = S_MakeReadTable();
+
+// The two low bits of each byte are stored swapped.
+static constexpr uint8_t S_SwapBits[4] = { 0b00, 0b10, 0b01, 0b11 };
+
+// Physical sectors holding the two halves of each block of a track, in ProDOS order.
+static constexpr int S_ProdosToPhysical[16] = { 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15 };
+
+static uint8_t
+S_Decode44(const uint8_t * nibbles)
+{
+    return ((nibbles[0] << 1) | 1) & nibbles[1];
+}
+
+// Decode a data field (without its prologue) into a sector. Returns false if it is invalid.
+static bool
+S_Decode62(const uint8_t * nibbles, uint8_t * sector)
+{
+    uint8_t values[DATA_NIBBLES - 1];
+    uint8_t previous = 0;
+
+    // Each value is stored XORed with the one before it.
+    for (size_t i = 0; i < DATA_NIBBLES - 1; i++) {
+        auto value = S_ReadTable.value[nibbles[i]];
+        if (value == INVALID_NIBBLE) {
+            return false;
+        }
+        previous ^= value;
+        values[i] = previous;
+    }
+
+    if (S_ReadTable.value[nibbles[DATA_NIBBLES - 1]] != previous) {
+        return false;
+    }
+
+    auto aux = values;
+    auto high = values + AUX_VALUES;
+    for (size_t i = 0; i < SECTOR_SIZE; i++) {
+        auto shift = (i / AUX_VALUES) * 2;
+        sector[i] = high[i] << 2 | S_SwapBits[(aux[i % AUX_VALUES] >> shift) & 0b11];
+    }
+
+    return true;
+}
+
+bool
+nibble_decoder_t::Recognize(const void * image, size_t size)
+{
+    if (size >= WOZ_HEADER_SIZE && (memcmp(image, WOZ1_ID, sizeof(WOZ1_ID)) == 0
+                                    || memcmp(image, WOZ2_ID, sizeof(WOZ2_ID)) == 0)) {
+        return true;
+    }
+
+    // .nib images have no header, just a fixed amount of data per track, so a block image
+    // can be the same size. Only one whose first track has an address field is taken.
+    if (size % NIB_TRACK_SIZE != 0
+        || size / NIB_TRACK_SIZE < NIB_TRACKS_MIN || size / NIB_TRACK_SIZE > NIB_TRACKS_MAX) {
+        return false;
+    }
+
+    static const uint8_t ADDRESS_PROLOGUE[] = { 0xD5, 0xAA, 0x96 };
+    auto track = (const uint8_t *)image;
+    return std::search(track, track + NIB_TRACK_SIZE, ADDRESS_PROLOGUE, ADDRESS_PROLOGUE + 3) != track + NIB_TRACK_SIZE;
+}
+
+nibble_decoder_t::nibble_decoder_t(const void * image, size_t size)
+{
+    auto data = (const uint8_t *)image;
+
+    if (size >= WOZ_HEADER_SIZE && (memcmp(data, WOZ1_ID, sizeof(WOZ1_ID)) == 0
+                                    || memcmp(data, WOZ2_ID, sizeof(WOZ2_ID)) == 0)) {
+        _ParseWoz(data, size);
+    }
+    else if (Recognize(image, size)) {
+        for (size_t offset = 0; offset < size; offset += NIB_TRACK_SIZE) {
+            _tracks.push_back({ data + offset, NIB_TRACK_SIZE, false });
+        }
+    }
+    else {
+        throw std::runtime_error("not a nibble image");
+    }
+
+    LOG(LOG_VERBOSE, "nibble image: %zu tracks", _tracks.size());
+}
+
+void
+nibble_decoder_t::_ParseWoz(const uint8_t * image, size_t size)
+{
+    int             version = image[3] - '0';
+    const uint8_t * tmap = nullptr;
+    const uint8_t * trks = nullptr;
+    size_t          trks_size = 0;
+
+    size_t position = WOZ_HEADER_SIZE;
+    while (position + 8 <= size) {
+        auto chunk = image + position;
+        auto chunk_size = LE_Read32(chunk + 4);
+        if (position + 8 + chunk_size > size) {
+            throw std::runtime_error("truncated WOZ chunk");
+        }
+
+        if (memcmp(chunk, "INFO", 4) == 0) {
+            if (chunk_size < 2 || chunk[8 + 1] != WOZ_DISK_525) {
+                throw std::runtime_error("only 5.25\" WOZ images are supported");
+            }
+        }
+        else if (memcmp(chunk, "TMAP", 4) == 0 && chunk_size >= 160) {
+            tmap = chunk + 8;
+        }
+        else if (memcmp(chunk, "TRKS", 4) == 0) {
+            trks = chunk + 8;
+            trks_size = chunk_size;
+        }
+
+        position += 8 + chunk_size;
+    }
+
+    if (tmap == nullptr || trks == nullptr) {
+        throw std::runtime_error("WOZ image has no track map or tracks");
+    }
+
+    // The map is indexed by quarter track, so whole tracks are every fourth entry.
+    unsigned num_tracks = NIB_TRACKS_MIN;
+    for (unsigned track = NIB_TRACKS_MIN; track < NIB_TRACKS_MAX; track++) {
+        if (tmap[track * 4] != WOZ_NO_TRACK) {
+            num_tracks = track + 1;
+        }
+    }
+
+    for (unsigned track = 0; track < num_tracks; track++) {
+        auto index = tmap[track * 4];
+        if (index == WOZ_NO_TRACK) {
+            _tracks.push_back({ nullptr, 0, true });
+            continue;
+        }
+
+        if (version == 1) {
+            if ((index + 1) * WOZ1_TRK_SIZE > trks_size) {
+                throw std::runtime_error("invalid WOZ track");
+            }
+            auto trk = trks + index * WOZ1_TRK_SIZE;
+            size_t bit_count = LE_Read16(trk + WOZ1_BIT_COUNT);
+            if (bit_count > WOZ1_BITS_SIZE * 8) {
+                throw std::runtime_error("invalid WOZ track");
+            }
+            _tracks.push_back({ trk, bit_count, true });
+        }
+        else {
+            if ((index + 1) * WOZ2_TRK_SIZE > trks_size) {
+                throw std::runtime_error("invalid WOZ track");
+            }
+            auto trk = trks + index * WOZ2_TRK_SIZE;
+            size_t start = LE_Read16(trk + 0) * 512;
+            size_t length = LE_Read16(trk + 2) * 512;
+            size_t bit_count = LE_Read32(trk + 4);
+            if (start + length > size || bit_count > length * 8) {
+                throw std::runtime_error("invalid WOZ track");
+            }
+            _tracks.push_back({ image + start, bit_count, true });
+        }
+    }
+}
+
+void
+nibble_decoder_t::Decode(unsigned unit, uint8_t * image, std::vector<bool> & decoded)
+{
+    _DecodeTrack(unit, image + unit * BLOCKS_PER_TRACK * 512);
+    decoded[unit] = true;
+}
+
+void
+nibble_decoder_t::_ReadNibbles(const track_t & track, std::vector<uint8_t> & nibbles) const
+{
+    if (track.length == 0) {
+        return;
+    }
+
+    if (!track.bits) {
+        nibbles.reserve(track.length + WRAP_NIBBLES);
+        for (size_t i = 0; i < track.length + WRAP_NIBBLES; i++) {
+            nibbles.push_back(track.data[i % track.length]);
+        }
+        return;
+    }
+
+    // Like the disk controller, shift bits in until the high bit is set, skipping the extra
+    // zero bits of self-sync bytes.
+    nibbles.reserve(track.length / 8 + WRAP_NIBBLES);
+    uint8_t latch = 0;
+    for (size_t i = 0; i < track.length + WRAP_NIBBLES * 8; i++) {
+        size_t bit = i % track.length;
+        latch = latch << 1 | ((track.data[bit >> 3] >> (7 - (bit & 7))) & 1);
+        if (latch & 0x80) {
+            nibbles.push_back(latch);
+            latch = 0;
+        }
+    }
+}
+
+void
+nibble_decoder_t::_DecodeTrack(unsigned index, uint8_t * dst) const
+{
+    std::vector<uint8_t> nibbles;
+    _ReadNibbles(_tracks[index], nibbles);
+
+    uint8_t     sectors[SECTORS_PER_TRACK][SECTOR_SIZE] = {};
+    bool        found[SECTORS_PER_TRACK] = {};
+    unsigned    num_found = 0;
+
+    auto n = nibbles.size();
+    for (size_t i = 0; i + 11 < n && num_found < SECTORS_PER_TRACK; i++) {
+        if (nibbles[i] != 0xD5 || nibbles[i + 1] != 0xAA || nibbles[i + 2] != 0x96) {
+            continue;
+        }
+
+        // The address field holds the volume, track, sector and their checksum in 4-and-4.
+        auto address = &nibbles[i + 3];
+        auto volume = S_Decode44(address + 0);
+        auto track = S_Decode44(address + 2);
+        auto sector = S_Decode44(address + 4);
+        auto checksum = S_Decode44(address + 6);
+        if ((volume ^ track ^ sector) != checksum || sector >= SECTORS_PER_TRACK || found[sector]) {
+            continue;
+        }
+        if (track != index) {
+            LOG(LOG_WARNING, "track %u has address field for track %u", index, track);
+            continue;
+        }
+
+        for (size_t j = i + 11; j < i + 11 + DATA_FIELD_SEARCH && j + 3 + DATA_NIBBLES <= n; j++) {
+            if (nibbles[j] != 0xD5 || nibbles[j + 1] != 0xAA) {
+                continue;
+            }
+            if (nibbles[j + 2] == 0xAD && S_Decode62(&nibbles[j + 3], sectors[sector])) {
+                found[sector] = true;
+                num_found++;
+            }
+            break;
+        }
+    }
+
+    if (num_found < SECTORS_PER_TRACK) {
+        LOG(LOG_WARNING, "track %u: only %u of %u sectors found", index, num_found, SECTORS_PER_TRACK);
+    }
+
+    for (unsigned i = 0; i < SECTORS_PER_TRACK; i++) {
+        memcpy(dst + i * SECTOR_SIZE, sectors[S_ProdosToPhysical[i]], SECTOR_SIZE);
+    }
+
+    LOG(LOG_DEBUG3, "decoded track %u", index);
+}
+
+} // namespace
+
+// eof
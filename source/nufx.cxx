@@ -0,0 +1,423 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/nufx.hxx"
+
+#include "prodos/util.hxx"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <string.h>
+
+namespace prodos
+{
+
+/*
+** The on-disk NuFX structures, as described in Apple II File Type Note $E0/8002.
+** Multi-byte fields are little-endian.
+*/
+struct nufx_master_header
+{
+    uint8_t nufile_id[6];
+    uint8_t master_crc[2];
+    uint8_t total_records[4];
+    uint8_t archive_create_when[8];
+    uint8_t archive_mod_when[8];
+    uint8_t master_version[2];
+    uint8_t reserved1[8];
+    uint8_t master_eof[4];
+    uint8_t reserved2[6];
+};
+
+// The fixed part of a record header. It is followed by an option list, the length of
+// the old-style file name (in the last two bytes of the attribute section), the file
+// name and the thread headers, and then the thread data.
+struct nufx_record_header
+{
+    uint8_t nufx_id[4];
+    uint8_t header_crc[2];
+    uint8_t attrib_count[2];
+    uint8_t version_number[2];
+    uint8_t total_threads[4];
+    uint8_t file_sys_id[2];
+    uint8_t file_sys_info[2];
+    uint8_t access[4];
+    uint8_t file_type[4];
+    uint8_t extra_type[4];
+    uint8_t storage_type[2];
+    uint8_t create_when[8];
+    uint8_t mod_when[8];
+    uint8_t archive_when[8];
+};
+
+struct nufx_thread_header
+{
+    uint8_t thread_class[2];
+    uint8_t thread_format[2];
+    uint8_t thread_kind[2];
+    uint8_t thread_crc[2];
+    uint8_t thread_eof[4];
+    uint8_t comp_thread_eof[4];
+};
+
+enum nufx_format_t
+{
+    nufx_format_uncompressed    = 0x0000,
+    nufx_format_lzw1            = 0x0002,
+    nufx_format_lzw2            = 0x0003,
+};
+
+const uint8_t   NUFILE_ID[]         = { 0x4E, 0xF5, 0x46, 0xE9, 0x6C, 0xE5 };
+const uint8_t   NUFX_ID[]           = { 0x4E, 0xF5, 0x46, 0xD8 };
+const uint8_t   BINARY_II_ID[]      = { 0x0A, 0x47, 0x4C };
+const size_t    BINARY_II_LENGTH    = 128;
+
+const int       THREAD_CLASS_DATA   = 0x0002;
+const int       THREAD_KIND_DISK    = 0x0001;
+
+const unsigned  LZW_CLEAR_CODE      = 0x0100;
+const unsigned  LZW_FIRST_CODE      = 0x0101;
+
+// Code widths indexed by (entry + 1) >> 8, where entry is the next table entry.
+static const unsigned S_CodeWidth[] = { 8, 9, 10, 10, 11, 11, 11, 11,
+                                        12, 12, 12, 12, 12, 12, 12, 12, 12 };
+
+static size_t
+S_ArchiveOffset(const uint8_t * data, size_t size)
+{
+    if (size >= sizeof(nufx_master_header) && memcmp(data, NUFILE_ID, sizeof(NUFILE_ID)) == 0) {
+        return 0;
+    }
+
+    // Archives downloaded from old BBSes are often wrapped in a Binary II header.
+    if (size >= BINARY_II_LENGTH + sizeof(nufx_master_header)
+        && memcmp(data, BINARY_II_ID, sizeof(BINARY_II_ID)) == 0
+        && memcmp(data + BINARY_II_LENGTH, NUFILE_ID, sizeof(NUFILE_ID)) == 0) {
+        return BINARY_II_LENGTH;
+    }
+
+    return -1;
+}
+
+bool
+nufx_decoder_t::Recognize(const void * archive, size_t size)
+{
+    return S_ArchiveOffset((const uint8_t *)archive, size) != (size_t)-1;
+}
+
+nufx_decoder_t::nufx_decoder_t(const void * archive, size_t size)
+{
+    auto offset = S_ArchiveOffset((const uint8_t *)archive, size);
+    if (offset == (size_t)-1) {
+        throw std::runtime_error("not a NuFX archive");
+    }
+
+    _FindDiskThread((const uint8_t *)archive + offset, size - offset);
+
+    switch (_format) {
+    case nufx_format_uncompressed:
+        break;
+    case nufx_format_lzw1:
+        // The chunks are preceded by a CRC, a volume number and the RLE escape character.
+        if (_thread_size < 4) {
+            throw std::runtime_error("truncated NuFX disk image thread");
+        }
+        _escape = _thread[3];
+        _position = 4;
+        break;
+    case nufx_format_lzw2:
+        // Same as LZW/1, but without the CRC.
+        if (_thread_size < 2) {
+            throw std::runtime_error("truncated NuFX disk image thread");
+        }
+        _escape = _thread[1];
+        _position = 2;
+        _ResetTable();
+        break;
+    default:
+        throw std::runtime_error("unsupported NuFX compression format");
+    }
+
+    LOG(LOG_VERBOSE, "NuFX disk image: %u blocks, format %u, %zu compressed bytes",
+                     _num_blocks, _format, _thread_size);
+}
+
+void
+nufx_decoder_t::_FindDiskThread(const uint8_t * archive, size_t size)
+{
+    auto master = (const nufx_master_header *)archive;
+    auto total_records = LE_Read32(master->total_records);
+
+    size_t position = sizeof(nufx_master_header);
+    for (uint32_t r = 0; r < total_records; r++) {
+        auto record = (const nufx_record_header *)(archive + position);
+        if (position + sizeof(nufx_record_header) > size
+            || memcmp(record->nufx_id, NUFX_ID, sizeof(NUFX_ID)) != 0) {
+            throw std::runtime_error("invalid NuFX record header");
+        }
+
+        auto attrib_count = LE_Read16(record->attrib_count);
+        if (attrib_count < sizeof(nufx_record_header) + 2 || position + attrib_count > size) {
+            throw std::runtime_error("invalid NuFX record header");
+        }
+
+        auto filename_length = LE_Read16(archive + position + attrib_count - 2);
+        auto total_threads = LE_Read32(record->total_threads);
+
+        size_t thread_position = position + attrib_count + filename_length;
+        size_t data_position = thread_position + total_threads * sizeof(nufx_thread_header);
+        if (data_position > size) {
+            throw std::runtime_error("invalid NuFX thread headers");
+        }
+
+        for (uint32_t t = 0; t < total_threads; t++) {
+            auto thread = (const nufx_thread_header *)(archive + thread_position);
+            auto comp_thread_eof = LE_Read32(thread->comp_thread_eof);
+            if (data_position + comp_thread_eof > size) {
+                throw std::runtime_error("truncated NuFX thread");
+            }
+
+            if (LE_Read16(thread->thread_class) == THREAD_CLASS_DATA
+                && LE_Read16(thread->thread_kind) == THREAD_KIND_DISK) {
+                // For disk images the storage type is the block size and the extra type
+                // the number of blocks. The thread EOF is not always set.
+                auto block_size = LE_Read16(record->storage_type);
+                auto blocks = LE_Read32(record->extra_type);
+                _num_blocks = block_size == 512 ? blocks : LE_Read32(thread->thread_eof) / 512;
+                if (_num_blocks == 0) {
+                    throw std::runtime_error("NuFX disk image has no blocks");
+                }
+
+                _thread = archive + data_position;
+                _thread_size = comp_thread_eof;
+                _format = LE_Read16(thread->thread_format);
+                return;
+            }
+
+            thread_position += sizeof(nufx_thread_header);
+            data_position += comp_thread_eof;
+        }
+
+        position = data_position;
+    }
+
+    throw std::runtime_error("NuFX archive contains no disk image");
+}
+
+void
+nufx_decoder_t::Decode(unsigned unit, uint8_t * image, std::vector<bool> & decoded)
+{
+    size_t image_size = (size_t)_num_blocks * 512;
+
+    if (_format == nufx_format_uncompressed) {
+        size_t offset = unit * CHUNK_SIZE;
+        size_t length = std::min(CHUNK_SIZE, image_size - offset);
+        if (offset + length > _thread_size) {
+            throw std::runtime_error("truncated NuFX disk image thread");
+        }
+        memcpy(image + offset, _thread + offset, length);
+        decoded[unit] = true;
+        return;
+    }
+
+    while (_next_chunk <= unit) {
+        uint8_t chunk[CHUNK_SIZE];
+        _DecodeChunk(chunk);
+
+        size_t offset = _next_chunk * CHUNK_SIZE;
+        memcpy(image + offset, chunk, std::min(CHUNK_SIZE, image_size - offset));
+
+        LOG(LOG_DEBUG3, "decoded NuFX chunk %u", _next_chunk);
+        decoded[_next_chunk++] = true;
+    }
+}
+
+void
+nufx_decoder_t::_DecodeChunk(uint8_t * chunk)
+{
+    const uint8_t * src = _thread + _position;
+    size_t          remaining = _thread_size - _position;
+
+    size_t  rle_length = 0;
+    size_t  lzw_length = 0;
+    bool    lzw = false;
+
+    if (_format == nufx_format_lzw1) {
+        if (remaining < 3) {
+            throw std::runtime_error("truncated NuFX chunk header");
+        }
+        rle_length = LE_Read16(src);
+        lzw = src[2] != 0;
+        lzw_length = remaining - 3;
+        src += 3;
+    }
+    else {
+        if (remaining < 2) {
+            throw std::runtime_error("truncated NuFX chunk header");
+        }
+        rle_length = LE_Read16(src) & 0x1FFF;
+        lzw = (LE_Read16(src) & 0x8000) != 0;
+        src += 2;
+        if (lzw) {
+            // The compressed length includes the four bytes of chunk header.
+            if (remaining < 4 || LE_Read16(src) < 4 || LE_Read16(src) > remaining) {
+                throw std::runtime_error("invalid NuFX chunk length");
+            }
+            lzw_length = LE_Read16(src) - 4;
+            src += 2;
+        }
+    }
+
+    if (rle_length > CHUNK_SIZE) {
+        throw std::runtime_error("invalid NuFX chunk length");
+    }
+
+    uint8_t buffer[CHUNK_SIZE];
+    if (lzw) {
+        // LZW/1 starts every chunk with an empty table.
+        if (_format == nufx_format_lzw1) {
+            _ResetTable();
+        }
+        auto used = _ExpandLzw(src, lzw_length, buffer, rle_length);
+        src += _format == nufx_format_lzw1 ? used : lzw_length;
+    }
+    else {
+        if (rle_length > _thread + _thread_size - src) {
+            throw std::runtime_error("truncated NuFX chunk");
+        }
+        memcpy(buffer, src, rle_length);
+        src += rle_length;
+
+        // LZW/2 starts over after a chunk that could not be compressed.
+        _ResetTable();
+    }
+
+    _position = src - _thread;
+
+    if (rle_length == CHUNK_SIZE) {
+        memcpy(chunk, buffer, CHUNK_SIZE);
+    }
+    else {
+        _ExpandRle(buffer, rle_length, chunk);
+    }
+}
+
+void
+nufx_decoder_t::_ResetTable()
+{
+    _entry = LZW_FIRST_CODE;
+    _first_code = true;
+}
+
+size_t
+nufx_decoder_t::_ExpandLzw(const uint8_t * src, size_t src_len, uint8_t * dst, size_t dst_len)
+{
+    uint8_t stack[TABLE_SIZE];
+    size_t  bit = 0;
+    size_t  out = 0;
+
+    while (out < dst_len) {
+        auto width = S_CodeWidth[(_entry + 1) >> 8];
+        if (bit + width > src_len * 8) {
+            throw std::runtime_error("truncated LZW data");
+        }
+
+        // Codes are packed least significant bit first.
+        size_t   byte = bit >> 3;
+        uint32_t value = 0;
+        for (size_t i = 0; i < 3 && byte + i < src_len; i++) {
+            value |= (uint32_t)src[byte + i] << (8 * i);
+        }
+        unsigned code = (value >> (bit & 7)) & ((1 << width) - 1);
+        bit += width;
+
+        if (_first_code) {
+            if (code > 0xFF) {
+                throw std::runtime_error("corrupt LZW data");
+            }
+            dst[out++] = code;
+            _old_code = code;
+            _final_char = code;
+            _first_code = false;
+            continue;
+        }
+
+        if (code == LZW_CLEAR_CODE && _format == nufx_format_lzw2) {
+            _ResetTable();
+            continue;
+        }
+
+        unsigned in_code = code;
+        size_t   depth = 0;
+
+        // The code may be the one about to be added, which always begins and ends
+        // with the first character of the previous string.
+        if (code >= _entry) {
+            if (code > _entry) {
+                throw std::runtime_error("corrupt LZW data");
+            }
+            stack[depth++] = _final_char;
+            code = _old_code;
+        }
+
+        while (code > 0xFF) {
+            if (depth == TABLE_SIZE - 1) {
+                throw std::runtime_error("corrupt LZW data");
+            }
+            stack[depth++] = _suffix[code];
+            code = _prefix[code];
+        }
+        _final_char = code;
+        stack[depth++] = code;
+
+        if (depth > dst_len - out) {
+            throw std::runtime_error("corrupt LZW data");
+        }
+        while (depth > 0) {
+            dst[out++] = stack[--depth];
+        }
+
+        if (_entry < TABLE_SIZE) {
+            _prefix[_entry] = _old_code;
+            _suffix[_entry] = _final_char;
+            _entry++;
+        }
+        _old_code = in_code;
+    }
+
+    // Compressed chunks end on a byte boundary.
+    return (bit + 7) / 8;
+}
+
+void
+nufx_decoder_t::_ExpandRle(const uint8_t * src, size_t src_len, uint8_t * dst) const
+{
+    size_t out = 0;
+    size_t i = 0;
+
+    // A run is stored as the escape character, the repeated character and the count - 1.
+    while (i < src_len && out < CHUNK_SIZE) {
+        if (src[i] == _escape && i + 2 < src_len) {
+            size_t count = std::min((size_t)src[i + 2] + 1, CHUNK_SIZE - out);
+            memset(dst + out, src[i + 1], count);
+            out += count;
+            i += 3;
+        }
+        else {
+            dst[out++] = src[i++];
+        }
+    }
+
+    if (out < CHUNK_SIZE) {
+        LOG(LOG_WARNING, "short NuFX chunk: %zu bytes", out);
+        memset(dst + out, 0, CHUNK_SIZE - out);
+    }
+}
+
+} // namespace
+
+// eof
@@ -0,0 +1,596 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/salvage.hxx"
+
+#include "prodos/disk.hxx"
+#include "prodos/entry.hxx"
+#include "prodos/filetype.hxx"
+#include "prodos/volume.hxx"
+#include "prodos/util.hxx"
+
+#include <algorithm>
+
+#include <ctype.h>
+#include <string.h>
+
+namespace prodos
+{
+
+const unsigned  BLOCKS_PER_BITMAP_BLOCK = BLOCK_SIZE * 8;
+const unsigned  POINTERS_PER_INDEX_BLOCK = BLOCK_SIZE / 2;
+const unsigned  MAX_INDEX_BLOCKS = (FILE_SIZE_MAX + 1) / (POINTERS_PER_INDEX_BLOCK * BLOCK_SIZE);
+
+// The i-th pointer of an index block, which ProDOS may have stored with the halves of the
+// block swapped.
+static uint16_t
+S_IndexPointer(const uint8_t * block, unsigned i, bool swapped)
+{
+    return swapped ? block[i] << 8 | block[POINTERS_PER_INDEX_BLOCK + i]
+                   : block[POINTERS_PER_INDEX_BLOCK + i] << 8 | block[i];
+}
+
+// The name of an entry or header, or "" if it is not a valid ProDOS name, as it may not be
+// in a damaged or crafted image. A deleted entry may have lost its name length, in which case
+// the name runs as far as it is valid.
+static std::string
+S_Name(const uint8_t * storage_type_and_name_length)
+{
+    auto name = (const char *)storage_type_and_name_length + 1;
+    size_t length = *storage_type_and_name_length & 0x0F;
+    if (length == 0) {
+        while (length < FILENAME_LENGTH && (isalnum(name[length]) || name[length] == '.')) {
+            length++;
+        }
+    }
+
+    std::string result(name, length);
+    return IsValidName(result) ? result : std::string();
+}
+
+// The name an entry is salvaged under, which is made up from its key block if its own is
+// not valid, so that it can always be used in a pathname.
+static std::string
+S_EntryName(const directory_entry & entry)
+{
+    auto name = S_Name(&entry.storage_type_and_name_length);
+    return name.empty() ? "ENTRY." + std::to_string(LE_Read16(entry.key_pointer)) : name;
+}
+
+static bool
+S_IsPlausibleEntry(const directory_entry * entry, unsigned num_blocks)
+{
+    switch (entry->storage_type_and_name_length >> 4) {
+    case storage_type_seedling_file:
+    case storage_type_sapling_file:
+    case storage_type_tree_file:
+    case storage_type_pascal_area:
+    case storage_type_subdirectory:
+        break;
+    default:
+        return false;
+    }
+
+    return !S_Name(&entry->storage_type_and_name_length).empty() &&
+           LE_Read16(entry->key_pointer) < num_blocks && LE_Read16(entry->header_pointer) < num_blocks;
+}
+
+// An entry that ProDOS has destroyed keeps its name and pointers.
+static bool
+S_IsDeletedEntry(const directory_entry * entry)
+{
+    return entry->storage_type_and_name_length >> 4 == storage_type_none &&
+           !S_Name(&entry->storage_type_and_name_length).empty() && LE_Read16(entry->key_pointer) != 0;
+}
+
+static salvage_block_t
+S_Classify(const uint8_t * data, unsigned num_blocks)
+{
+    auto block = (const directory_block *)data;
+    auto prev = LE_Read16(block->prev);
+    auto next = LE_Read16(block->next);
+
+    if (std::all_of(data, data + BLOCK_SIZE, [](uint8_t byte) { return byte == 0; })) {
+        return salvage_block_zero;
+    }
+
+    if (prev == 0 && next < num_blocks) {
+        auto header = &block->key.header;
+        auto storage_type = header->storage_type_and_name_length >> 4;
+        if ((storage_type == storage_type_volume_block || storage_type == storage_type_subdir_block) &&
+            header->entry_length == sizeof(directory_entry) && header->entries_per_block == ENTRIES_PER_BLOCK &&
+            !S_Name(&header->storage_type_and_name_length).empty()) {
+            return storage_type == storage_type_volume_block ? salvage_block_volume_key
+                                                             : salvage_block_directory_key;
+        }
+    }
+
+    // Every entry of a directory block is in use and makes sense, or is empty or deleted.
+    if (prev != 0 && prev < num_blocks && next < num_blocks) {
+        bool plausible = true, any = false;
+        for (int slot = 0; slot < ENTRIES_PER_BLOCK && plausible; slot++) {
+            auto entry = &block->any.entry[slot];
+            if (entry->storage_type_and_name_length >> 4 != storage_type_none) {
+                plausible = S_IsPlausibleEntry(entry, num_blocks);
+                any = true;
+            }
+            else {
+                any |= S_IsDeletedEntry(entry);
+            }
+        }
+        if (plausible && any) {
+            return salvage_block_directory;
+        }
+    }
+
+    // Every pointer of an index block is to a block of the image.
+    bool any = false;
+    for (unsigned i = 0; i < POINTERS_PER_INDEX_BLOCK; i++) {
+        auto pointer = S_IndexPointer(data, i, false);
+        if (pointer >= num_blocks) {
+            return salvage_block_unknown;
+        }
+        any |= pointer != 0;
+    }
+
+    return any ? salvage_block_index : salvage_block_unknown;
+}
+
+salvage_t::salvage_t(const std::string & pathname)
+    : _disk(std::make_shared<disk_t>(pathname))
+{
+    // An image that declares its sector order is taken at its word, as volume_t does.
+    if (_disk->Order() == disk_t::order_dos) {
+        _disk->Convert(disk_t::RWTS_TO_BLOCK);
+        return;
+    }
+    else if (_disk->Order() != disk_t::order_unknown || _disk->NumBlocks() != 280) {
+        return;
+    }
+
+    // A 5.25" image that does not say what order its sectors are in is taken to be in the
+    // order in which more blocks look like directory blocks.
+    auto count = [](const disk_t & disk) {
+        unsigned directories = 0;
+        for (unsigned i = 0; i < disk.NumBlocks(); i++) {
+            auto kind = S_Classify((const uint8_t *)disk.ReadBlock(i), disk.NumBlocks());
+            directories += kind >= salvage_block_volume_key && kind <= salvage_block_directory;
+        }
+        return directories;
+    };
+
+    auto converted = std::make_shared<disk_t>(pathname);
+    converted->Convert(disk_t::RWTS_TO_BLOCK);
+    if (count(*converted) > count(*_disk)) {
+        _disk = converted;
+    }
+}
+
+salvage_t::~salvage_t()
+{
+}
+
+unsigned
+salvage_t::NumBlocks() const
+{
+    return _disk->NumBlocks();
+}
+
+void
+salvage_t::Scan()
+{
+    _kinds.assign(NumBlocks(), salvage_block_unknown);
+    _directories.clear();
+    _claimed.assign((NumBlocks() + 63) / 64, 0);
+    _free.clear();
+    _files.clear();
+    _unrecoverable = 0;
+
+    _Classify();
+    _FindDirectories();
+
+    _Claim(0);
+    _Claim(1);
+
+    // The volume directory is the one at block 2, if it is there.
+    uint16_t volume_key = 0;
+    for (const auto & [key_block, directory] : _directories) {
+        if (_kinds[key_block] == salvage_block_volume_key && (volume_key == 0 || key_block == 2)) {
+            volume_key = key_block;
+        }
+    }
+    if (volume_key != 0) {
+        _ReadBitmap(volume_key);
+    }
+
+    // Subdirectories that some entry points to are placed under it, the others are orphans.
+    std::vector<bool> referenced(NumBlocks());
+    for (const auto & [key_block, directory] : _directories) {
+        for (size_t i = 0; i < directory.blocks.size(); i++) {
+            auto block = (const directory_block *)_Block(directory.blocks[i]);
+            for (int slot = i == 0 ? 1 : 0; slot < ENTRIES_PER_BLOCK; slot++) {
+                auto entry = &block->any.entry[slot];
+                auto key_pointer = LE_Read16(entry->key_pointer);
+                if ((entry->storage_type_and_name_length >> 4 == storage_type_subdirectory ||
+                     (S_IsDeletedEntry(entry) && entry->file_type == file_type_directory)) &&
+                    key_pointer < NumBlocks()) {
+                    referenced[key_pointer] = true;
+                }
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, directory_entry>> deleted;
+
+    auto add_orphan = [&](uint16_t key_block) {
+        auto & directory = _directories[key_block];
+        auto header = &((const directory_block *)_Block(key_block))->key.header;
+
+        salvaged_file_t file;
+        file.pathname = "/ORPHANED/" + directory.name + "." + std::to_string(key_block);
+        memset(&file.entry, 0, sizeof(file.entry));
+        memcpy(&file.entry, header, 1 + FILENAME_LENGTH);
+        file.entry.storage_type_and_name_length = storage_type_subdirectory << 4 | directory.name.length();
+        file.entry.file_type = file_type_directory;
+        LE_Write16(file.entry.key_pointer, key_block);
+        LE_Write16(file.entry.blocks_used, directory.blocks.size());
+        LE_Write24(file.entry.eof, directory.blocks.size() * BLOCK_SIZE);
+        memcpy(file.entry.creation_date_time, header->creation_date_time, 4);
+        file.entry.version = header->version;
+        file.entry.min_version = header->min_version;
+        file.entry.access = header->access;
+        _files.push_back(file);
+
+        _AddDirectory(key_block, file.pathname, deleted);
+    };
+
+    auto recover_deleted = [&]() {
+        for (size_t i = 0; i < deleted.size(); i++) {
+            auto [directory, entry] = deleted[i];
+            if (!_Recover(directory, entry, deleted)) {
+                _unrecoverable++;
+            }
+        }
+        deleted.clear();
+    };
+
+    // Everything in use is placed before any deleted entry is recovered. Directories whose
+    // deleted entries cannot be recovered are orphans too.
+    if (volume_key != 0) {
+        _AddDirectory(volume_key, "/", deleted);
+    }
+    for (const auto & [key_block, directory] : _directories) {
+        if (!directory.placed && !referenced[key_block] && _kinds[key_block] == salvage_block_directory_key) {
+            add_orphan(key_block);
+        }
+    }
+    recover_deleted();
+
+    for (const auto & [key_block, directory] : _directories) {
+        if (!directory.placed && _kinds[key_block] == salvage_block_directory_key) {
+            add_orphan(key_block);
+            recover_deleted();
+        }
+    }
+
+    std::sort(_files.begin(), _files.end(),
+              [](const salvaged_file_t & a, const salvaged_file_t & b) { return a.pathname < b.pathname; });
+}
+
+std::vector<uint8_t>
+salvage_t::Read(const salvaged_file_t & file) const
+{
+    std::vector<uint8_t> data(file.IsDirectory() ? 0 : LE_Read24(file.entry.eof));
+
+    for (size_t i = 0; i < file.blocks.size() && i * BLOCK_SIZE < data.size(); i++) {
+        if (file.blocks[i] != 0) {
+            auto count = std::min<size_t>(BLOCK_SIZE, data.size() - i * BLOCK_SIZE);
+            memcpy(data.data() + i * BLOCK_SIZE, _Block(file.blocks[i]), count);
+        }
+    }
+
+    return data;
+}
+
+const uint8_t *
+salvage_t::_Block(uint16_t block) const
+{
+    return (const uint8_t *)_disk->ReadBlock(block);
+}
+
+void
+salvage_t::_Classify()
+{
+    for (unsigned i = 0; i < NumBlocks(); i++) {
+        _kinds[i] = S_Classify(_Block(i), NumBlocks());
+    }
+}
+
+void
+salvage_t::_FindDirectories()
+{
+    for (unsigned key_block = 0; key_block < NumBlocks(); key_block++) {
+        if (_kinds[key_block] != salvage_block_volume_key && _kinds[key_block] != salvage_block_directory_key) {
+            continue;
+        }
+
+        auto header = &((const directory_block *)_Block(key_block))->key.header;
+        auto & directory = _directories[key_block];
+        directory.name = S_Name(&header->storage_type_and_name_length);
+        directory.blocks.push_back(key_block);
+
+        // Follow the chain as long as the next block is a directory block that points back.
+        for (;;) {
+            uint16_t last = directory.blocks.back();
+            uint16_t next = LE_Read16(((const directory_block *)_Block(last))->next);
+            if (next == 0 || _kinds[next] != salvage_block_directory ||
+                LE_Read16(((const directory_block *)_Block(next))->prev) != last ||
+                std::find(directory.blocks.begin(), directory.blocks.end(), next) != directory.blocks.end()) {
+                break;
+            }
+            directory.blocks.push_back(next);
+        }
+    }
+}
+
+void
+salvage_t::_ReadBitmap(uint16_t key_block)
+{
+    auto header = &((const directory_block *)_Block(key_block))->key.header;
+    unsigned bitmap_block = LE_Read16(header->bit_map_pointer);
+    unsigned total_blocks = std::min<unsigned>(LE_Read16(header->total_blocks), NumBlocks());
+    unsigned bitmap_blocks = (total_blocks + BLOCKS_PER_BITMAP_BLOCK - 1) / BLOCKS_PER_BITMAP_BLOCK;
+    if (bitmap_block < 2 || bitmap_block + bitmap_blocks > NumBlocks()) {
+        return;
+    }
+
+    _free.assign((NumBlocks() + 63) / 64, 0);
+    for (unsigned block = 0; block < total_blocks; block++) {
+        auto bitmap = _Block(bitmap_block + block / BLOCKS_PER_BITMAP_BLOCK);
+        auto bit = block % BLOCKS_PER_BITMAP_BLOCK;
+        if (bitmap[bit / 8] & (0x80 >> bit % 8)) {
+            _free[block / 64] |= 1ull << block % 64;
+        }
+    }
+
+    for (unsigned i = 0; i < bitmap_blocks; i++) {
+        _kinds[bitmap_block + i] = salvage_block_bitmap;
+        _Claim(bitmap_block + i);
+    }
+}
+
+void
+salvage_t::_AddDirectory(uint16_t key_block, const std::string & pathname,
+                         std::vector<std::pair<std::string, directory_entry>> & deleted)
+{
+    auto & directory = _directories[key_block];
+    directory.placed = true;
+    for (auto block : directory.blocks) {
+        _Claim(block);
+    }
+
+    std::vector<uint16_t> subdirectories;
+    std::vector<std::string> subdirectory_pathnames;
+
+    for (size_t i = 0; i < directory.blocks.size(); i++) {
+        auto block = (const directory_block *)_Block(directory.blocks[i]);
+        for (int slot = i == 0 ? 1 : 0; slot < ENTRIES_PER_BLOCK; slot++) {
+            auto entry = &block->any.entry[slot];
+            auto storage_type = entry->storage_type_and_name_length >> 4;
+            if (storage_type == storage_type_none) {
+                if (S_IsDeletedEntry(entry)) {
+                    deleted.emplace_back(pathname, *entry);
+                }
+                continue;
+            }
+
+            salvaged_file_t file;
+            file.pathname = (pathname == "/" ? "" : pathname) + "/" + S_EntryName(*entry);
+            file.entry = *entry;
+
+            switch (storage_type) {
+            case storage_type_seedling_file:
+            case storage_type_sapling_file:
+            case storage_type_tree_file:
+                _Layout(file, false);
+                _files.push_back(std::move(file));
+                break;
+            case storage_type_subdirectory: {
+                auto subdir = LE_Read16(entry->key_pointer);
+                auto itr = _directories.find(subdir);
+                if (itr == _directories.end() || itr->second.placed) {
+                    file.damaged = true;
+                }
+                else {
+                    subdirectories.push_back(subdir);
+                    subdirectory_pathnames.push_back(file.pathname);
+                }
+                _files.push_back(std::move(file));
+                break;
+            }
+            default:
+                break;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < subdirectories.size(); i++) {
+        if (!_directories[subdirectories[i]].placed) {
+            _AddDirectory(subdirectories[i], subdirectory_pathnames[i], deleted);
+        }
+    }
+}
+
+bool
+salvage_t::_Layout(salvaged_file_t & file, bool recover)
+{
+    auto        key_pointer = LE_Read16(file.entry.key_pointer);
+    uint32_t    eof         = LE_Read24(file.entry.eof);
+    size_t      num_blocks  = std::max<size_t>(1, (eof + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    std::vector<uint16_t> used;
+    auto usable = [&](uint16_t block) {
+        return recover ? _IsUsable(block) : block < NumBlocks();
+    };
+
+    // The first count pointers of an index block. A deleted file's have to be usable, with
+    // the halves of the block in one order or the other.
+    auto read_index = [&](uint16_t block, size_t count, std::vector<uint16_t> & pointers) {
+        auto data = _Block(block);
+        for (bool swapped : { false, true }) {
+            pointers.clear();
+            bool ok = true;
+            for (size_t i = 0; i < count && ok; i++) {
+                auto pointer = S_IndexPointer(data, i, swapped);
+                if (pointer != 0 && !usable(pointer)) {
+                    ok = !recover;
+                    file.damaged = !recover;
+                    pointer = 0;
+                }
+                pointers.push_back(pointer);
+            }
+            if (ok) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    if (key_pointer == 0 || !usable(key_pointer)) {
+        file.damaged = !recover;
+        return false;
+    }
+
+    std::vector<uint16_t> pointers;
+    switch (file.entry.storage_type_and_name_length >> 4) {
+    case storage_type_seedling_file:
+        file.blocks = { key_pointer };
+        break;
+    case storage_type_sapling_file:
+        used.push_back(key_pointer);
+        if (!read_index(key_pointer, std::min<size_t>(num_blocks, POINTERS_PER_INDEX_BLOCK), file.blocks)) {
+            return false;
+        }
+        break;
+    case storage_type_tree_file: {
+        std::vector<uint16_t> index_blocks;
+        auto count = std::min<size_t>((num_blocks + POINTERS_PER_INDEX_BLOCK - 1) / POINTERS_PER_INDEX_BLOCK,
+                                      MAX_INDEX_BLOCKS);
+        used.push_back(key_pointer);
+        if (!read_index(key_pointer, count, index_blocks)) {
+            return false;
+        }
+        file.blocks.clear();
+        for (size_t i = 0; i < index_blocks.size(); i++) {
+            auto first = i * POINTERS_PER_INDEX_BLOCK;
+            auto count = std::min<size_t>(num_blocks - first, POINTERS_PER_INDEX_BLOCK);
+            if (index_blocks[i] == 0) {
+                file.blocks.insert(file.blocks.end(), count, 0);
+                continue;
+            }
+            used.push_back(index_blocks[i]);
+            if (!read_index(index_blocks[i], count, pointers)) {
+                return false;
+            }
+            file.blocks.insert(file.blocks.end(), pointers.begin(), pointers.end());
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+
+    for (auto block : file.blocks) {
+        if (block != 0) {
+            used.push_back(block);
+        }
+    }
+
+    // A deleted file's blocks have to be its own.
+    std::sort(used.begin(), used.end());
+    if (recover && std::adjacent_find(used.begin(), used.end()) != used.end()) {
+        return false;
+    }
+
+    for (auto block : used) {
+        if (_IsClaimed(block)) {
+            file.damaged = true;
+        }
+        _Claim(block);
+    }
+
+    return true;
+}
+
+bool
+salvage_t::_Recover(const std::string & directory, const directory_entry & entry,
+                    std::vector<std::pair<std::string, directory_entry>> & deleted)
+{
+    salvaged_file_t file;
+    file.pathname = (directory == "/" ? "" : directory) + "/" + S_EntryName(entry);
+    file.entry = entry;
+    file.deleted = true;
+
+    auto name_length = S_Name(&entry.storage_type_and_name_length).length();
+    auto key_pointer = LE_Read16(entry.key_pointer);
+
+    if (entry.file_type == file_type_directory) {
+        // Its blocks have to be those of a directory that has not been placed.
+        auto itr = _directories.find(key_pointer);
+        if (itr == _directories.end() || itr->second.placed ||
+            !std::all_of(itr->second.blocks.begin(), itr->second.blocks.end(),
+                         [this](uint16_t block) { return _IsUsable(block); })) {
+            return false;
+        }
+
+        file.entry.storage_type_and_name_length = storage_type_subdirectory << 4 | name_length;
+        _files.push_back(file);
+        _AddDirectory(key_pointer, file.pathname, deleted);
+        return true;
+    }
+
+    size_t num_blocks = (LE_Read24(entry.eof) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t storage_type = num_blocks <= 1 ? storage_type_seedling_file :
+                           num_blocks <= POINTERS_PER_INDEX_BLOCK ? storage_type_sapling_file :
+                                                                    storage_type_tree_file;
+    file.entry.storage_type_and_name_length = storage_type << 4 | name_length;
+
+    if (!_Layout(file, true)) {
+        return false;
+    }
+
+    _files.push_back(std::move(file));
+
+    return true;
+}
+
+bool
+salvage_t::_IsClaimed(uint16_t block) const
+{
+    return _claimed[block / 64] >> block % 64 & 1;
+}
+
+bool
+salvage_t::_IsUsable(uint16_t block) const
+{
+    if (block >= NumBlocks() || _IsClaimed(block)) {
+        return false;
+    }
+
+    return _free.empty() || (_free[block / 64] >> block % 64 & 1);
+}
+
+void
+salvage_t::_Claim(uint16_t block)
+{
+    if (block < NumBlocks()) {
+        _claimed[block / 64] |= 1ull << block % 64;
+    }
+}
+
+} // namespace
+
+// eof
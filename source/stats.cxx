@@ -0,0 +1,216 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/stats.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include <stdio.h>
+
+namespace prodos
+{
+
+// Latencies are counted in buckets by powers of two: bucket n holds times of less than 2^n
+// nanoseconds but at least half that. The last bucket (about 9 minutes) holds the rest.
+static const unsigned   NUM_BUCKETS = 40;
+
+static const char *     stat_names[STAT_COUNT] = {
+    "getattr",
+    "open",
+    "read",
+    "release",
+    "getxattr",
+    "listxattr",
+    "opendir",
+    "readdir",
+    "releasedir",
+    "init",
+    "destroy",
+    "lseek",
+    "GetEntry",
+    "ReadAt",
+    "NextEntry",
+    "Catalog",
+};
+
+// Each counter only ever has one writer, its thread, so it is updated with plain relaxed
+// loads and stores. Being atomic just lets the report read it while it is being updated.
+struct stat_counters_t
+{
+    std::atomic<uint64_t>   calls[STAT_COUNT]                   = {};
+    std::atomic<uint64_t>   total_ns[STAT_COUNT]                = {};
+    std::atomic<uint64_t>   max_ns[STAT_COUNT]                  = {};
+    std::atomic<uint64_t>   buckets[STAT_COUNT][NUM_BUCKETS]    = {};
+};
+
+static void
+S_Add(std::atomic<uint64_t> & counter, uint64_t value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// The counters of live threads, and the sum of those of threads that have exited.
+static std::mutex                       registry_mutex;
+static std::vector<stat_counters_t *>   registry;
+static stat_counters_t                  retired;
+
+class stat_thread_t
+{
+public:
+    stat_thread_t()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        registry.push_back(&counters);
+    }
+
+    ~stat_thread_t()
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+        for (unsigned i = 0; i < STAT_COUNT; i++) {
+            S_Add(retired.calls[i], counters.calls[i]);
+            S_Add(retired.total_ns[i], counters.total_ns[i]);
+            retired.max_ns[i] = std::max(retired.max_ns[i].load(), counters.max_ns[i].load());
+            for (unsigned b = 0; b < NUM_BUCKETS; b++) {
+                S_Add(retired.buckets[i][b], counters.buckets[i][b]);
+            }
+        }
+        registry.erase(std::find(registry.begin(), registry.end(), &counters));
+    }
+
+    stat_counters_t     counters;
+};
+
+static thread_local stat_thread_t   thread_stats;
+
+void
+RecordStat(stat_id_t id, uint64_t nanoseconds)
+{
+    auto & counters = thread_stats.counters;
+    unsigned bucket = nanoseconds ? 64 - __builtin_clzll(nanoseconds) : 0;
+
+    S_Add(counters.calls[id], 1);
+    S_Add(counters.total_ns[id], nanoseconds);
+    S_Add(counters.buckets[id][std::min(bucket, NUM_BUCKETS - 1)], 1);
+    if (nanoseconds > counters.max_ns[id].load(std::memory_order_relaxed)) {
+        counters.max_ns[id].store(nanoseconds, std::memory_order_relaxed);
+    }
+}
+
+// Return the upper bound of the bucket that the given fraction of calls fall under, in
+// microseconds, but no more than the longest call.
+static double
+S_Percentile(const uint64_t * buckets, uint64_t calls, uint64_t max_ns, double fraction)
+{
+    uint64_t    target  = (uint64_t)(calls * fraction + 0.5);
+    uint64_t    count   = 0;
+    for (unsigned b = 0; b < NUM_BUCKETS; b++) {
+        count += buckets[b];
+        if (count >= std::max(target, (uint64_t)1)) {
+            return (double)std::min(1ULL << b, (unsigned long long)max_ns) / 1000;
+        }
+    }
+
+    return (double)max_ns / 1000;
+}
+
+static std::string
+S_FormatNanoseconds(uint64_t ns)
+{
+    char buffer[16];
+    if (ns < 1000) {
+        snprintf(buffer, sizeof(buffer), "%llu ns", (unsigned long long)ns);
+    }
+    else if (ns < 1000000) {
+        snprintf(buffer, sizeof(buffer), "%.1f us", ns / 1e3);
+    }
+    else if (ns < 1000000000) {
+        snprintf(buffer, sizeof(buffer), "%.1f ms", ns / 1e6);
+    }
+    else {
+        snprintf(buffer, sizeof(buffer), "%.1f s", ns / 1e9);
+    }
+
+    return buffer;
+}
+
+std::string
+StatsReport()
+{
+    uint64_t    calls[STAT_COUNT]                   = {};
+    uint64_t    total_ns[STAT_COUNT]                = {};
+    uint64_t    max_ns[STAT_COUNT]                  = {};
+    uint64_t    buckets[STAT_COUNT][NUM_BUCKETS]    = {};
+
+    {
+        std::lock_guard<std::mutex> lock(registry_mutex);
+
+        auto sum = [&](const stat_counters_t & counters) {
+            for (unsigned i = 0; i < STAT_COUNT; i++) {
+                calls[i] += counters.calls[i].load(std::memory_order_relaxed);
+                total_ns[i] += counters.total_ns[i].load(std::memory_order_relaxed);
+                max_ns[i] = std::max(max_ns[i], counters.max_ns[i].load(std::memory_order_relaxed));
+                for (unsigned b = 0; b < NUM_BUCKETS; b++) {
+                    buckets[i][b] += counters.buckets[i][b].load(std::memory_order_relaxed);
+                }
+            }
+        };
+
+        sum(retired);
+        for (auto counters : registry) {
+            sum(*counters);
+        }
+    }
+
+    std::string report;
+    char        line[160];
+
+    snprintf(line, sizeof(line), "%-12s %10s %12s %10s %10s %10s %10s %10s\n",
+             "operation", "calls", "total ms", "mean us", "p50 us", "p90 us", "p99 us", "max us");
+    report += line;
+
+    for (unsigned i = 0; i < STAT_COUNT; i++) {
+        if (calls[i] == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%-12s %10llu %12.3f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                 stat_names[i], (unsigned long long)calls[i], total_ns[i] / 1e6,
+                 total_ns[i] / 1e3 / calls[i],
+                 S_Percentile(buckets[i], calls[i], max_ns[i], 0.50),
+                 S_Percentile(buckets[i], calls[i], max_ns[i], 0.90),
+                 S_Percentile(buckets[i], calls[i], max_ns[i], 0.99),
+                 max_ns[i] / 1e3);
+        report += line;
+    }
+
+    for (unsigned i = 0; i < STAT_COUNT; i++) {
+        if (calls[i] == 0) {
+            continue;
+        }
+
+        snprintf(line, sizeof(line), "\n%s latency\n", stat_names[i]);
+        report += line;
+
+        auto most = *std::max_element(buckets[i], buckets[i] + NUM_BUCKETS);
+        for (unsigned b = 0; b < NUM_BUCKETS; b++) {
+            if (buckets[i][b] == 0) {
+                continue;
+            }
+            auto bar = std::string((buckets[i][b] * 40 + most - 1) / most, '#');
+            snprintf(line, sizeof(line), "  < %-9s %10llu %s\n", S_FormatNanoseconds(1ULL << b).c_str(),
+                     (unsigned long long)buckets[i][b], bar.c_str());
+            report += line;
+        }
+    }
+
+    return report;
+}
+
+} // namespace
+
+// eof
@@ -0,0 +1,143 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+#include "prodos/trace.hxx"
+
+#include "prodos/stats.hxx"
+#include "prodos/util.hxx"
+
+#include <mutex>
+
+#include <stdio.h>
+#include <string.h>
+
+namespace prodos
+{
+
+static const char       TRACE_MAGIC[8]  = { 'P', 'D', 'T', 'R', 'A', 'C', 'E', '1' };
+static const size_t     BUFFER_RECORDS  = 4096;
+
+std::atomic<bool>       tracing         = false;
+
+// Records are buffered and written a buffer at a time. Tracing is off by default, so the
+// lock is only taken when it is on.
+static std::mutex       trace_mutex;
+static FILE *           trace_file      = nullptr;
+static uint64_t         trace_start     = 0;
+static trace_record     trace_buffer[BUFFER_RECORDS];
+static size_t           trace_count     = 0;
+
+// The file's own buffer is flushed too, so that it is empty whenever the process may fork
+// (prodosfs does, after tracing has started); otherwise both processes would write it.
+static void
+S_Flush()
+{
+    if (trace_count > 0 && fwrite(trace_buffer, sizeof(trace_record), trace_count, trace_file) != trace_count) {
+        LOG(LOG_ERROR, "unable to write block trace");
+    }
+    fflush(trace_file);
+    trace_count = 0;
+}
+
+bool
+TraceStart(const std::string & pathname)
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file != nullptr) {
+        return false;
+    }
+
+    trace_file = fopen(pathname.c_str(), "wb");
+    if (trace_file == nullptr) {
+        LOG(LOG_ERROR, "unable to create block trace %s", pathname.c_str());
+        return false;
+    }
+
+    trace_header header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(trace_record);
+    fwrite(&header, sizeof(header), 1, trace_file);
+    fflush(trace_file);
+
+    trace_start = StatClock();
+    tracing = true;
+
+    return true;
+}
+
+void
+TraceStop()
+{
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file == nullptr) {
+        return;
+    }
+
+    tracing = false;
+    S_Flush();
+    fclose(trace_file);
+    trace_file = nullptr;
+}
+
+void
+TraceBlockSlow(unsigned block, trace_category_t category)
+{
+    auto now = StatClock();
+
+    std::lock_guard<std::mutex> lock(trace_mutex);
+
+    if (trace_file == nullptr) {
+        return;
+    }
+
+    auto & record = trace_buffer[trace_count++];
+    record = {};
+    record.nanoseconds = now - trace_start;
+    record.block = block;
+    record.category = category;
+
+    if (trace_count == BUFFER_RECORDS) {
+        S_Flush();
+    }
+}
+
+bool
+ReadTrace(const std::string & pathname, std::vector<trace_record> & records)
+{
+    FILE * file = fopen(pathname.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+
+    liberator_t<FILE *, int (*)(FILE *)> closer(file, fclose);
+
+    trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.record_size != sizeof(trace_record)) {
+        return false;
+    }
+
+    trace_record record;
+    while (fread(&record, sizeof(record), 1, file) == 1) {
+        records.push_back(record);
+    }
+
+    return true;
+}
+
+const char *
+TraceCategoryName(unsigned category)
+{
+    static const char * names[TRACE_CATEGORY_COUNT] = { "other", "directory", "index", "data", "bitmap" };
+    return category < TRACE_CATEGORY_COUNT ? names[category] : "unknown";
+}
+
+} // namespace
+
+// eof
@@ -15,7 +15,7 @@ namespace prodos
 
 static void LogNothing(int level, const char *format, ...) { }
 
-Logger LOG = LogNothing;
+std::atomic<Logger> LOG = LogNothing;
 
 void SetLogger(Logger func)
 {
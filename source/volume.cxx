@@ -9,6 +9,8 @@
 #include "prodos/block.hxx"
 #include "prodos/directory.hxx"
 #include "prodos/filetype.hxx"
+#include "prodos/probe.hxx"
+#include "prodos/stats.hxx"
 #include "prodos/util.hxx"
 
 #include <algorithm>
@@ -25,8 +27,6 @@
 namespace prodos
 {
 
-typedef std::vector<std::string>    strings_t;
-
 thread_local err_t error = err_none;
 
 static bool
@@ -37,19 +37,34 @@ S_IsVolumeDirectoryBlock(const void *addr)
            block->key.header.storage_type_and_name_length >> 4 == storage_type_volume_block;
 }
 
-static void
-S_Deobfuscate(const void *src_blk, void * dst_blk)
+static bool
+S_IsDirectoryKeyBlock(const directory_block * block)
+{
+    int type = block->key.header.storage_type_and_name_length >> 4;
+    return type == storage_type_volume_block || type == storage_type_subdir_block;
+}
+
+// Protected disks are obfuscated by XORing every byte with a password character (also XORed
+// with $7F), cycling through the password. The keystream is therefore the same for every
+// block, so it is expanded to a whole block once and reused.
+struct keystream_t
+{
+    alignas(16) uint8_t bytes[BLOCK_SIZE];
+};
+
+static std::unique_ptr<keystream_t>
+S_LoadKeystream()
 {
     char *  pw_file = getenv("PRODOSFS_PASSWORD_FILE");
     if (pw_file == nullptr) {
         LOG(LOG_DEBUG1, "PRODOSFS_PASSWORD_FILE env var not set");
-        return;
+        return nullptr;
     }
 
     int fd = open(pw_file, O_APPEND | O_CLOEXEC);
     if (fd < 0) {
         LOG(LOG_ERROR, "unable to open password file");
-        return;
+        return nullptr;
     }
 
     liberator_t<int, int (*)(int)> closer(fd, close);
@@ -57,11 +72,11 @@ S_Deobfuscate(const void *src_blk, void * dst_blk)
     struct stat st = {};
     if (fstat(fd, &st) < 0) {
         LOG(LOG_ERROR, "unable to stat password file");
-        return;
+        return nullptr;
     }
     else if ((st.st_mode & S_IFMT) != S_IFREG) {
         LOG(LOG_ERROR, "password file is not a regular file");
-        return;
+        return nullptr;
     }
     else if ((st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
         LOG(LOG_WARNING, "password file should only be readable/writable and only by owner");
@@ -72,11 +87,11 @@ S_Deobfuscate(const void *src_blk, void * dst_blk)
     auto n = read(fd, passwd, buflen - 1);
     if (n < 0) {
         LOG(LOG_ERROR, "unable to read from password file");
-        return;
+        return nullptr;
     }
     else if (n == 0) {
         LOG(LOG_ERROR, "password file is empty");
-        return;
+        return nullptr;
     }
     else {
         if (passwd[n - 1] == '\n') {
@@ -85,31 +100,75 @@ S_Deobfuscate(const void *src_blk, void * dst_blk)
         }
         if (n < 2) {
             LOG(LOG_ERROR, "password is too short");
-            return;
+            return nullptr;
         }
     }
 
-    auto cipher = (const unsigned char *)src_blk;
-    auto plain = (unsigned char *)dst_blk;
-    auto ptr = passwd;
+    // There's an off-by-one error in the program I wrote 30+ years
+    // ago, so the last character of the password is not used.
+    auto keystream = std::make_unique<keystream_t>();
     for (int i = 0; i < BLOCK_SIZE; i++) {
-        plain[i] = (char)(cipher[i] ^ (*ptr++ ^ 0x7F));
-
-        // There's an off-by-one error in the program I wrote 30+ years
-        // ago, so the last character of the password is not used.
-        if (*(ptr + 1) == 0) {
-            ptr = passwd;
-        }
+        keystream->bytes[i] = passwd[i % (n - 1)] ^ 0x7F;
     }
 
-    if (S_IsVolumeDirectoryBlock(plain)) {
-        return;
+    return keystream;
+}
+
+// Returns the keystream, or nullptr if there is no password. The password file is only read
+// the first time.
+static const keystream_t *
+S_Keystream()
+{
+    static const std::unique_ptr<keystream_t> keystream = S_LoadKeystream();
+    return keystream.get();
+}
+
+static void
+S_Deobfuscate(const void *src_blk, void * dst_blk, const keystream_t * keystream)
+{
+    typedef uint8_t vector_t __attribute__((vector_size(16)));
+
+    auto cipher = (const uint8_t *)src_blk;
+    auto plain = (uint8_t *)dst_blk;
+    auto key = (const vector_t *)keystream->bytes;
+    for (size_t i = 0; i < BLOCK_SIZE / sizeof(vector_t); i++) {
+        vector_t v;
+        memcpy(&v, cipher + i * sizeof(v), sizeof(v));
+        v ^= key[i];
+        memcpy(plain + i * sizeof(v), &v, sizeof(v));
     }
 }
 
 volume_t::volume_t(const std::string & pathname)
-    : _disk(pathname)
+    : volume_t(std::make_shared<disk_t>(pathname))
+{
+}
+
+volume_t::volume_t(std::shared_ptr<disk_t> disk)
+    : _disk(std::move(disk))
+{
+    _num_blocks = _disk->NumBlocks();
+    _Mount();
+}
+
+volume_t::volume_t(std::shared_ptr<disk_t> disk, const partition_t & partition)
+    : _disk(std::move(disk)),
+      _first_block(partition.first_block),
+      _num_blocks(partition.num_blocks),
+      _partition(true)
+{
+    _Mount();
+}
+
+void
+volume_t::_Mount()
 {
+    // The key is taken before anything is read, as an index written later has to be keyed
+    // by the image as it was when it was mounted.
+    if (!_partition && index_t::Key(_disk->Pathname(), &_index_key)) {
+        _SetIndex(index_t::Open(_disk->Pathname(), _index_key));
+    }
+
     _root = _GetVolumeDirectoryBlock();
     if (_root == nullptr) {
         throw std::runtime_error("unable to find volume directory block");
@@ -125,9 +184,301 @@ volume_t::volume_t(const std::string & pathname)
     else if (volume->EntryLength() != sizeof(directory_entry)) {
         throw std::runtime_error("unexpected entry length");
     }
-    else if (volume->TotalBlocks() != _disk.NumBlocks()) {
+    else if (_partition || _disk->IsEncoded() ? volume->TotalBlocks() > _num_blocks
+                                               : volume->TotalBlocks() != _num_blocks) {
+        // Partitions may be larger than their volumes (e.g. a 65535-block volume in a
+        // 32 MiB slice), as may encoded disks (e.g. a 35-track volume in a 40-track .nib),
+        // but a whole disk image must match exactly.
         throw std::runtime_error("unexpected total blocks");
     }
+
+    if (_disk->HeaderBlocks() != 0 && _disk->HeaderBlocks() != volume->TotalBlocks()) {
+        LOG(LOG_WARNING, "image header declares %u blocks but volume has %u",
+                         _disk->HeaderBlocks(), volume->TotalBlocks());
+    }
+}
+
+std::vector<partition_t>
+volume_t::FindPartitions(const disk_t & disk)
+{
+    const unsigned CFFA_PARTITION_BLOCKS = 65536;
+
+    std::vector<partition_t> partitions;
+    for (const auto & partition : disk.Partitions()) {
+        if (partition.type == "Apple_PRODOS") {
+            partitions.push_back(partition);
+        }
+    }
+
+    if (!partitions.empty() || disk.NumBlocks() <= CFFA_PARTITION_BLOCKS) {
+        return partitions;
+    }
+
+    // Only the first volume is checked, so that finding the partitions takes the same
+    // time however many there are.
+    auto block = (const directory_block *)disk.ReadBlock(2);
+    if (!S_IsVolumeDirectoryBlock(block) || LE_Read16(block->key.header.total_blocks) >= disk.NumBlocks()) {
+        return partitions;
+    }
+
+    for (unsigned first = 0; first < disk.NumBlocks(); first += CFFA_PARTITION_BLOCKS) {
+        partition_t partition;
+        partition.first_block = first;
+        partition.num_blocks = std::min(CFFA_PARTITION_BLOCKS, disk.NumBlocks() - first);
+        partitions.push_back(partition);
+    }
+
+    return partitions;
+}
+
+const void *
+volume_t::_ReadBlock(int index, trace_category_t category) const
+{
+    if (index < 0 || index >= _num_blocks) {
+        throw std::runtime_error("invalid block number");
+    }
+
+    if (!_deobfuscated.empty()) {
+        std::lock_guard<std::mutex> lock(_deobfuscate_mutex);
+        if (!_deobfuscated[index]) {
+            uint8_t plain[BLOCK_SIZE];
+            S_Deobfuscate(_disk->ReadBlock(_first_block + index), plain, S_Keystream());
+            _disk->WriteBlock(_first_block + index, plain);
+            _deobfuscated[index] = true;
+        }
+    }
+
+    TraceBlock(_first_block + index, category);
+
+    return _disk->ReadBlock(_first_block + index);
+}
+
+void
+volume_t::_WriteBlock(int index, const void * block)
+{
+    if (index < 0 || index >= _num_blocks) {
+        throw std::runtime_error("invalid block number");
+    }
+
+    _disk->WriteBlock(_first_block + index, block);
+
+    if (!_deobfuscated.empty()) {
+        std::lock_guard<std::mutex> lock(_deobfuscate_mutex);
+        _deobfuscated[index] = true;
+    }
+}
+
+bool
+volume_t::Save(const std::string & pathname) const
+{
+    // Blocks of an obfuscated disk that have not been read yet are still obfuscated.
+    for (unsigned i = 0; i < _deobfuscated.size(); i++) {
+        _ReadBlock(i);
+    }
+
+    return _disk->Save(pathname);
+}
+
+bool
+volume_t::WriteIndex() const
+{
+    if (_partition || _obfuscated) {
+        return false;
+    }
+
+    // Building the index reads every directory and index block, and decodes most of an
+    // encoded image, so that is not done for an index that cannot be written anyway.
+    auto directory = std::filesystem::path(index_t::Pathname(_disk->Pathname())).parent_path();
+    if (access(directory.empty() ? "." : directory.c_str(), W_OK) != 0) {
+        LOG(LOG_INFO, "not indexing, %s is not writable", directory.c_str());
+        return false;
+    }
+
+    auto index = index_t::Build(*this, _disk->IsConverted());
+
+    return index != nullptr && index->Save(_disk->Pathname(), _index_key);
+}
+
+void
+volume_t::_SetIndex(std::unique_ptr<index_t> index)
+{
+    _index = index.get();
+    if (index) {
+        _indexes.push_back(std::move(index));
+    }
+
+    // Refreshes are at least the watcher's quiet period apart, so a lookup that started on
+    // an index has long finished by the time it is this far back. File handles never use
+    // the extents of an index once it has been replaced.
+    if (_indexes.size() > MAX_INDEXES) {
+        _indexes.erase(_indexes.begin(), _indexes.end() - MAX_INDEXES);
+    }
+}
+
+bool
+volume_t::TrackChanges()
+{
+    if (_partition || _obfuscated || !_disk->TrackChanges()) {
+        return false;
+    }
+
+    // The index is what a refresh compares the directories with.
+    if (_index == nullptr) {
+        _SetIndex(index_t::Build(*this, _disk->IsConverted()));
+    }
+    _tracking = _index != nullptr;
+
+    return _tracking;
+}
+
+// Return true if the entry's location, type, size or blocks differ between two indexes.
+static bool
+S_IndexEntryChanged(const index_t & old_index, const index_entry & old_entry,
+                    const index_t & new_index, const index_entry & new_entry)
+{
+    if (old_entry.block != new_entry.block || old_entry.slot != new_entry.slot ||
+        old_entry.storage_type != new_entry.storage_type || old_entry.file_type != new_entry.file_type ||
+        old_entry.key_pointer != new_entry.key_pointer || old_entry.blocks_used != new_entry.blocks_used ||
+        old_entry.eof != new_entry.eof) {
+        return true;
+    }
+
+    size_t  old_count, new_count;
+    auto    old_extents = old_index.Extents(old_entry, &old_count);
+    auto    new_extents = new_index.Extents(new_entry, &new_count);
+
+    return old_count != new_count ||
+           (old_count > 0 && memcmp(old_extents, new_extents, old_count * sizeof(index_extent)) != 0);
+}
+
+static std::string
+S_ParentPath(const std::string & pathname)
+{
+    auto pos = pathname.rfind('/');
+    return pos == 0 || pos == std::string::npos ? "/" : pathname.substr(0, pos);
+}
+
+bool
+volume_t::Refresh(std::vector<volume_change_t> & changed)
+{
+    std::vector<bool> blocks;
+    if (!_tracking || !_disk->Remap(blocks)) {
+        return false;
+    }
+    index_t::Key(_disk->Pathname(), &_index_key);
+
+    auto old_index = _index.load();
+    if (old_index == nullptr) {
+        // The last refresh found the directories damaged, so there is nothing to compare
+        // with. Start over and report everything as changed, or just "/" while the
+        // directories are still damaged.
+        _SetIndex(index_t::Build(*this, _disk->IsConverted()));
+        _generation++;
+
+        auto index = _index.load();
+        for (size_t i = 0; index != nullptr && index->EntryAt(i); i++) {
+            changed.push_back({ index->PathnameOf(*index->EntryAt(i)) });
+        }
+        changed.push_back({ "/" });
+        std::sort(changed.begin(), changed.end());
+
+        return true;
+    }
+
+    auto block_changed = [&blocks, this](unsigned block) {
+        return block < _num_blocks && blocks[_first_block + block];
+    };
+    auto data_changed = [&](const index_t & index, const index_entry & entry) {
+        size_t count;
+        auto extents = index.Extents(entry, &count);
+        for (size_t i = 0; i < count; i++) {
+            for (unsigned j = 0; extents[i].disk_block != 0 && j < extents[i].count; j++) {
+                if (block_changed(extents[i].disk_block + j)) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    // Changes to file data alone leave the index as it is. Anything else may have changed
+    // the directories, so they are indexed again and compared.
+    std::vector<bool> data_blocks(_num_blocks);
+    for (size_t i = 0; auto entry = old_index->EntryAt(i); i++) {
+        size_t count;
+        auto extents = old_index->Extents(*entry, &count);
+        for (size_t j = 0; j < count; j++) {
+            for (unsigned k = 0; extents[j].disk_block != 0 && k < extents[j].count; k++) {
+                if (extents[j].disk_block + k < _num_blocks) {
+                    data_blocks[extents[j].disk_block + k] = true;
+                }
+            }
+        }
+    }
+
+    bool metadata_changed = false;
+    for (unsigned i = 0; i < _num_blocks; i++) {
+        metadata_changed |= block_changed(i) && !data_blocks[i];
+    }
+
+    std::unique_ptr<index_t> new_index;
+    if (metadata_changed) {
+        new_index = index_t::Build(*this, _disk->IsConverted());
+        if (new_index == nullptr) {
+            // The image is probably still being written. Everything is suspect until the
+            // next refresh, which will compare against an index built from scratch.
+            LOG(LOG_WARNING, "volume directories are damaged after image changed");
+        }
+    }
+
+    // The directory entries of a changed directory block may have changed in ways the index
+    // does not record (e.g. timestamps), so they are all reported, along with the directory.
+    auto current = metadata_changed ? new_index.get() : old_index;
+    for (size_t i = 0; auto entry = old_index->EntryAt(i); i++) {
+        auto pathname = old_index->PathnameOf(*entry);
+        auto now = current ? current->Find(pathname) : nullptr;
+        bool was_file = entry->storage_type >= storage_type_seedling_file && entry->storage_type <= storage_type_tree_file;
+        int old_file_type = was_file ? entry->file_type : -1;
+        if (now == nullptr) {
+            changed.push_back({ pathname, old_file_type });
+            changed.push_back({ S_ParentPath(pathname) });
+        }
+        else if (block_changed(now->block) ||
+                 (current != old_index && S_IndexEntryChanged(*old_index, *entry, *current, *now)) ||
+                 data_changed(*old_index, *entry)) {
+            changed.push_back({ pathname, old_file_type });
+            if (block_changed(now->block)) {
+                changed.push_back({ S_ParentPath(pathname) });
+            }
+        }
+    }
+
+    for (size_t i = 0; current != nullptr && current != old_index && current->EntryAt(i); i++) {
+        auto pathname = current->PathnameOf(*current->EntryAt(i));
+        if (old_index->Find(pathname) == nullptr) {
+            changed.push_back({ pathname });
+            changed.push_back({ S_ParentPath(pathname) });
+        }
+    }
+
+    if (block_changed(2) || (metadata_changed && current == nullptr)) {
+        changed.push_back({ "/" });
+    }
+
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+    if (metadata_changed) {
+        _SetIndex(std::move(new_index));
+        _generation++;
+
+        // Without an index there is nothing to compare the next refresh with, so start over.
+        if (_index == nullptr) {
+            _SetIndex(index_t::Build(*this, _disk->IsConverted()));
+        }
+    }
+
+    return true;
 }
 
 err_t
@@ -145,48 +496,106 @@ volume_t::ClearError()
 directory_block *
 volume_t::_GetVolumeDirectoryBlock()
 {
-    const void *    block   = _disk.ReadBlock(2);
+    // If the image declares its sector order there is no need to probe for it. Partitions
+    // are always in block order, and converting would affect the whole disk anyway.
+    if (_disk->Order() == disk_t::order_dos && !_partition) {
+        LOG(LOG_INFO, "converting track-and-sector disk to block disk");
+        _disk->Convert(disk_t::RWTS_TO_BLOCK);
+    }
+
+    // The index records whether the image had to be converted, so there is no probing.
+    auto index = _index.load();
+    if (index && index->IsConverted() && !_disk->IsConverted()) {
+        LOG(LOG_INFO, "converting track-and-sector disk to block disk");
+        _disk->Convert(disk_t::RWTS_TO_BLOCK);
+    }
+
+    const void *    block   = _ReadBlock(2, trace_directory);
 
     if (S_IsVolumeDirectoryBlock(block)) {
         return (directory_block *)block;
     }
 
-    char tmp_blk[BLOCK_SIZE];
-    S_Deobfuscate(block, tmp_blk);
+    if (index) {
+        LOG(LOG_WARNING, "ignoring index that does not match image");
+        _index = nullptr;
+        if (index->IsConverted()) {
+            return nullptr;
+        }
+    }
 
-    if (S_IsVolumeDirectoryBlock(tmp_blk)) {
-        LOG(LOG_INFO, "deobfuscated protected disk");
-        _disk.WriteBlock(2, tmp_blk);
-        return (directory_block *)_disk.ReadBlock(2);
+    auto        keystream   = S_Keystream();
+    uint8_t     tmp_blk[BLOCK_SIZE];
+
+    if (keystream != nullptr) {
+        S_Deobfuscate(block, tmp_blk, keystream);
+        if (S_IsVolumeDirectoryBlock(tmp_blk)) {
+            _StartDeobfuscation(tmp_blk);
+            return (directory_block *)_ReadBlock(2, trace_directory);
+        }
+    }
+
+    if (_disk->Order() != disk_t::order_unknown || _partition) {
+        return nullptr;
     }
 
-    block = _disk.ReadTrackSector(0, 11);
+    block = _disk->ReadTrackSector(0, 11);
     if (S_IsVolumeDirectoryBlock(block)) {
         LOG(LOG_INFO, "converting track-and-sector disk to block disk");
-        _disk.Convert(disk_t::RWTS_TO_BLOCK);
-        return (directory_block *)_disk.ReadBlock(2);
+        _disk->Convert(disk_t::RWTS_TO_BLOCK);
+        return (directory_block *)_ReadBlock(2, trace_directory);
     }
 
-    S_Deobfuscate(block, tmp_blk);
-    if (S_IsVolumeDirectoryBlock(tmp_blk)) {
-        LOG(LOG_INFO, "converting track-and-sector disk to block disk");
-        _disk.Convert(disk_t::RWTS_TO_BLOCK);
+    if (keystream != nullptr) {
+        S_Deobfuscate(block, tmp_blk, keystream);
+        if (S_IsVolumeDirectoryBlock(tmp_blk)) {
+            LOG(LOG_INFO, "converting track-and-sector disk to block disk");
+            _disk->Convert(disk_t::RWTS_TO_BLOCK);
 
-        block = _disk.ReadBlock(2);
-        S_Deobfuscate(block, tmp_blk);
-        LOG(LOG_INFO, "deobfuscated protected disk");
-        _disk.WriteBlock(2, tmp_blk);
-        return (directory_block *)_disk.ReadBlock(2);
+            S_Deobfuscate(_ReadBlock(2, trace_directory), tmp_blk, keystream);
+            _StartDeobfuscation(tmp_blk);
+            return (directory_block *)_ReadBlock(2, trace_directory);
+        }
     }
 
     return nullptr;
 }
 
+void
+volume_t::_StartDeobfuscation(const void * key_block)
+{
+    auto keystream = S_Keystream();
+
+    // Some protected disks only have the volume directory key block obfuscated, others have
+    // every block obfuscated. They are told apart by the next volume directory block, whose
+    // back pointer only makes sense in one form or the other.
+    bool    whole_disk  = false;
+    auto    next        = LE_Read16(((const directory_block *)key_block)->next);
+    if (next != 0 && next < _num_blocks) {
+        auto        raw     = (const directory_block *)_ReadBlock(next, trace_directory);
+        uint8_t     plain[BLOCK_SIZE];
+        S_Deobfuscate(raw, plain, keystream);
+        whole_disk = LE_Read16(raw->prev) != 2 && LE_Read16(((const directory_block *)plain)->prev) == 2;
+    }
+
+    _obfuscated = true;
+    if (whole_disk) {
+        // Blocks are deobfuscated in place as they are first read.
+        LOG(LOG_INFO, "deobfuscating protected disk");
+        _deobfuscated.assign(_num_blocks, false);
+    }
+    else {
+        LOG(LOG_INFO, "deobfuscated protected disk");
+    }
+
+    _WriteBlock(2, key_block);
+}
+
 std::string
 volume_t::Name() const
 {
     auto volume = volume_header_t::Create(&_root->key.header);
-    return volume->FileName();
+    return std::string(volume->FileName());
 }
 
 int
@@ -203,123 +612,377 @@ volume_t::TotalBlocks() const
     return volume->TotalBlocks();
 }
 
-static strings_t
-S_SplitPath(const std::string & pathname)
+// A pathname missing from the index is either not there or goes through a file, which are
+// told apart by looking up its parents.
+static err_t
+S_IndexMissError(const index_t & index, std::string_view pathname)
 {
-    strings_t path;
+    for (auto pos = pathname.find('/', 1); pos != std::string::npos; pos = pathname.find('/', pos + 1)) {
+        auto parent = index.Find(pathname.substr(0, pos));
+        if (parent == nullptr) {
+            break;
+        }
+        else if (parent->storage_type != storage_type_subdirectory) {
+            return err_directory_not_found;
+        }
+    }
 
-    size_t start = pathname[0] == '/' ? 1 : 0;
-    size_t pos = 0;
-    while ((pos = pathname.find('/', start)) != std::string::npos) {
-        path.push_back(pathname.substr(start, pos - 1));
-        start = pos + 1;
+    return err_file_not_found;
+}
+
+const directory_entry_t *
+volume_t::_IndexedEntry(const index_entry & indexed) const
+{
+    if (indexed.block >= _num_blocks || indexed.slot >= ENTRIES_PER_BLOCK) {
+        return nullptr;
     }
-    path.push_back(pathname.substr(start));
 
-    return path;
+    auto block = (const directory_block *)_ReadBlock(indexed.block, trace_directory);
+    auto entry = (const directory_entry_t *)&block->any.entry[indexed.slot];
+    if (entry->IsInactive() || entry->StorageType() != indexed.storage_type ||
+        entry->KeyPointer() != indexed.key_pointer) {
+        return nullptr;
+    }
+
+    return entry;
 }
 
 const entry_t *
-volume_t::GetEntry(const std::string & pathname) const
+volume_t::GetEntry(std::string_view pathname) const
 {
+    stat_timer_t timer(stat_get_entry);
+    // A string_view need not be NUL-terminated, so give tracers the length too (str(arg0, arg1)).
+    PRODOS_PROBE2(get_entry, pathname.data(), pathname.size());
+
     if (pathname == "/") {
         return (entry_t *)&_root->key.header;
     }
 
-    auto path = S_SplitPath(pathname);
-    auto itr = path.begin();
-    auto handle = new directory_handle_t(this, _root);
-    auto entry = handle->NextEntry();
+    auto index = _index.load();
+    if (index) {
+        auto indexed = index->Find(pathname);
+        if (indexed == nullptr) {
+            error = S_IndexMissError(*index, pathname);
+            return nullptr;
+        }
 
-    std::unique_ptr<directory_handle_t> defer_cleanup(handle);
+        // An entry that is not where the index says falls back to walking the directories.
+        auto entry = _IndexedEntry(*indexed);
+        if (entry != nullptr) {
+            return entry;
+        }
+    }
 
-    while (entry != nullptr && itr != path.end()) {
-        if (entry->NameMatches(*itr)) {
-            if (++itr == path.end()) {
-                return entry;
-            }
-            else if (entry->IsDirectory() == false) {
-                error = err_directory_not_found;
-                return nullptr;
-            }
+    // The names in the pathname are looked at in place, one at a time.
+    size_t start = !pathname.empty() && pathname[0] == '/' ? 1 : 0;
+    size_t end = pathname.find('/', start);
+    auto name = pathname.substr(start, end - start);
+
+    directory_handle_t handle(this, _root, 2);
+    auto entry = handle.FindEntry(name);
 
-            auto key_pointer = entry->KeyPointer();
-            auto key_block = (directory_block *)_disk.ReadBlock(key_pointer);
-            handle->_Open(key_block);
+    while (entry != nullptr) {
+        if (end == std::string_view::npos) {
+            return entry;
+        }
+        else if (entry->IsDirectory() == false) {
+            error = err_directory_not_found;
+            return nullptr;
         }
 
-        entry = handle->NextEntry();
-    }
+        start = end + 1;
+        end = pathname.find('/', start);
+        name = pathname.substr(start, end - start);
 
-    error = err_file_not_found;
+        auto key_pointer = entry->KeyPointer();
+        auto key_block = (directory_block *)_ReadBlock(key_pointer, trace_directory);
+        handle._Open(key_block, key_pointer);
+
+        entry = handle.FindEntry(name);
+    }
 
     return nullptr;
 }
 
-file_handle_t *
-volume_t::OpenFile(const std::string & pathname) const
+bool
+volume_t::OpenFile(std::string_view pathname, file_handle_t & handle) const
 {
     auto entry = GetEntry(pathname);
     if (entry == nullptr) {
-        return nullptr;
+        return false;
     }
     else if (entry->IsFile() == false) {
         error = err_unsupported_storage_type;
-        return nullptr;
+        return false;
     }
 
-    return new file_handle_t(this, (const directory_entry_t *)entry);
+    handle = file_handle_t(this, (const directory_entry_t *)entry);
+
+    // The generation is read first, so that extents from a newer index are never taken for
+    // out of date, only the other way around.
+    auto generation = _generation.load();
+    auto index = _index.load();
+    if (index) {
+        auto indexed = index->Find(pathname);
+        if (indexed && _IndexedEntry(*indexed) == entry) {
+            handle._extents = index->Extents(*indexed, &handle._extent_count);
+            handle._generation = generation;
+        }
+    }
+
+    return true;
 }
 
-directory_handle_t *
-volume_t::OpenDirectory(const std::string & pathname) const
+file_handle_t *
+volume_t::OpenFile(std::string_view pathname) const
+{
+    file_handle_t handle;
+    return OpenFile(pathname, handle) ? new file_handle_t(handle) : nullptr;
+}
+
+bool
+volume_t::OpenDirectory(std::string_view pathname, directory_handle_t & handle) const
 {
     if (pathname == "/") {
-        return new directory_handle_t(this, _root);
+        handle = directory_handle_t(this, _root, 2);
+        return true;
     }
 
     auto entry = GetEntry(pathname);
     if (entry == nullptr) {
-        return nullptr;
+        return false;
     }
 
     if (entry->IsDirectory() == false) {
         error = err_directory_not_found;
-        return nullptr;
+        return false;
     }
 
     auto dirent = (const directory_entry_t *)entry;
     auto pointer = dirent->KeyPointer();
-    auto key_block = (const directory_block *)_disk.ReadBlock(pointer);
+    auto key_block = (const directory_block *)_ReadBlock(pointer, trace_directory);
+    handle = directory_handle_t(this, key_block, pointer);
+
+    return true;
+}
+
+directory_handle_t *
+volume_t::OpenDirectory(std::string_view pathname) const
+{
+    directory_handle_t handle;
+    return OpenDirectory(pathname, handle) ? new directory_handle_t(handle) : nullptr;
+}
+
+bool
+volume_t::Walk(std::string_view pathname, const walk_visitor_t & visitor) const
+{
+    if (pathname == "/") {
+        return _Walk(2, "", visitor);
+    }
 
-    return new directory_handle_t(this, key_block);
+    auto entry = GetEntry(pathname);
+    if (entry == nullptr) {
+        return false;
+    }
+
+    return Walk((const directory_entry_t *)entry, pathname, visitor);
+}
+
+bool
+volume_t::Walk(const directory_entry_t * directory, std::string_view pathname, const walk_visitor_t & visitor) const
+{
+    if (directory->IsDirectory() == false) {
+        error = err_directory_not_found;
+        return false;
+    }
+
+    return _Walk(directory->KeyPointer(), pathname, visitor);
+}
+
+bool
+volume_t::_Walk(uint16_t key_pointer, std::string_view pathname, const walk_visitor_t & visitor) const
+{
+    // Where the walk is in each directory from the one walked down to the current one. The
+    // pathnames are all built in one buffer, which is cut back to a directory's own pathname
+    // before each of its entries' names is added.
+    struct frame_t
+    {
+        const directory_block *     block;
+        int                         slot;
+        int                         file_count;
+        int                         found;
+        size_t                      pathname_length;
+    };
+
+    // A damaged directory could otherwise link blocks in a loop, or into itself.
+    size_t visited = 0;
+    auto enter = [&](uint16_t pointer) -> const directory_block * {
+        if (pointer == 0 || pointer >= _num_blocks || ++visited > _num_blocks) {
+            return nullptr;
+        }
+        return (const directory_block *)_ReadBlock(pointer, trace_directory);
+    };
+
+    std::string path(pathname);
+    std::vector<frame_t> stack;
+
+    auto push = [&](uint16_t pointer) {
+        auto block = enter(pointer);
+        if (block == nullptr || !S_IsDirectoryKeyBlock(block)) {
+            return false;
+        }
+        stack.push_back({ block, 1, LE_Read16(block->key.header.file_count), 0, path.size() });
+        return true;
+    };
+
+    if (push(key_pointer) == false) {
+        error = err_directory_structure_damaged;
+        return false;
+    }
+
+    while (!stack.empty()) {
+        auto & frame = stack.back();
+        if (frame.found == frame.file_count) {
+            stack.pop_back();
+            continue;
+        }
+        else if (frame.slot == ENTRIES_PER_BLOCK) {
+            auto next = LE_Read16(frame.block->next);
+            if (next == 0) {
+                stack.pop_back();
+                continue;
+            }
+            else if ((frame.block = enter(next)) == nullptr) {
+                error = err_directory_structure_damaged;
+                return false;
+            }
+            frame.slot = 0;
+            continue;
+        }
+
+        auto entry = (const directory_entry_t *)&frame.block->any.entry[frame.slot++];
+        if (entry->IsInactive()) {
+            continue;
+        }
+        frame.found++;
+
+        path.resize(frame.pathname_length);
+        path += '/';
+        path += entry->FileName();
+
+        auto action = visitor(entry, path, stack.size() - 1);
+        if (action == walk_stop) {
+            break;
+        }
+        else if (action == walk_continue && entry->IsDirectory() && push(entry->KeyPointer()) == false) {
+            error = err_directory_structure_damaged;
+            return false;
+        }
+    }
+
+    return true;
 }
 
 const void *
-volume_t::GetBlock(int index) const
+volume_t::GetBlock(int index, trace_category_t category) const
 {
     static uint8_t sparse_block[BLOCK_SIZE] = {};
-    return index ? _disk.ReadBlock(index) : sparse_block;
+    return index ? _ReadBlock(index, category) : sparse_block;
+}
+
+void
+volume_t::WillNeed(unsigned index, unsigned count) const
+{
+    if (index < _num_blocks) {
+        _disk->WillNeed(_first_block + index, std::min(count, _num_blocks - index));
+    }
+}
+
+void
+volume_t::Prefault() const
+{
+    const unsigned BLOCKS_PER_BITMAP_BLOCK = BLOCK_SIZE * 8;
+
+    uint16_t bitmap = LE_Read16(_root->key.header.bit_map_pointer);
+    WillNeed(bitmap, (TotalBlocks() + BLOCKS_PER_BITMAP_BLOCK - 1) / BLOCKS_PER_BITMAP_BLOCK);
+
+    std::vector<uint16_t> blocks;
+    auto index = _index.load();
+    if (index) {
+        for (size_t i = 0; i < index->EntryCount(); i++) {
+            auto entry = index->EntryAt(i);
+            blocks.push_back(entry->block);
+            if (entry->storage_type == storage_type_subdirectory) {
+                blocks.push_back(entry->key_pointer);
+            }
+        }
+    }
+    else {
+        // Reading the blocks faults them in, so there is nothing more to do with them.
+        std::vector<uint16_t> directories = { 2 };
+        size_t visited = 0;
+        while (!directories.empty() && visited < _num_blocks) {
+            uint16_t pointer = directories.back();
+            directories.pop_back();
+            for (; pointer != 0 && pointer < _num_blocks && visited < _num_blocks; visited++) {
+                auto block = (const directory_block *)_ReadBlock(pointer, trace_directory);
+                for (unsigned slot = 0; slot < ENTRIES_PER_BLOCK; slot++) {
+                    auto entry = (const directory_entry_t *)&block->any.entry[slot];
+                    if (entry->IsDirectory()) {
+                        directories.push_back(entry->KeyPointer());
+                    }
+                }
+                pointer = LE_Read16(block->next);
+            }
+        }
+    }
+
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    for (size_t i = 0; i < blocks.size(); ) {
+        size_t count = 1;
+        while (i + count < blocks.size() && blocks[i + count] == blocks[i] + count) {
+            count++;
+        }
+        WillNeed(blocks[i], count);
+        i += count;
+    }
 }
 
 int
 volume_t::CountBlocksUsed() const
 {
     uint16_t pointer = LE_Read16(_root->key.header.bit_map_pointer);
-    auto blocks = _disk.NumBlocks();
+    auto blocks = TotalBlocks();
     auto used = 0;
 
     while (blocks > 0) {
-        auto bitmap = (const uint8_t *)_disk.ReadBlock(pointer++);
+        auto bitmap = (const uint8_t *)_ReadBlock(pointer++, trace_bitmap);
         for (auto i = 0; i < BLOCK_SIZE && blocks > 0; i++) {
-            used += sizeof(uint8_t) - __builtin_popcount(bitmap[i]);
-            blocks -= sizeof(uint8_t);
+            used += 8 - __builtin_popcount(bitmap[i]);
+            blocks -= std::min(blocks, 8);
         }
     }
 
     return used;
 }
 
+bool
+volume_t::IsBlockFree(unsigned block) const
+{
+    const unsigned BLOCKS_PER_BITMAP_BLOCK = BLOCK_SIZE * 8;
+
+    if (block >= (unsigned)TotalBlocks()) {
+        return false;
+    }
+
+    uint16_t pointer = LE_Read16(_root->key.header.bit_map_pointer) + block / BLOCKS_PER_BITMAP_BLOCK;
+    auto bitmap = (const uint8_t *)_ReadBlock(pointer, trace_bitmap);
+    auto bit = block % BLOCKS_PER_BITMAP_BLOCK;
+
+    return bitmap[bit / 8] & (0x80 >> bit % 8);
+}
+
 int
 volume_t::CountRootDirectoryBlocks() const
 {
@@ -329,7 +992,7 @@ volume_t::CountRootDirectoryBlocks() const
     uint16_t pointer = LE_Read16(block->next);
     while (pointer != 0) {
         num_blocks++;
-        block = (const directory_block *)_disk.ReadBlock(pointer);
+        block = (const directory_block *)_ReadBlock(pointer, trace_directory);
         pointer = LE_Read16(block->next);
     }
 
@@ -339,9 +1002,11 @@ volume_t::CountRootDirectoryBlocks() const
 std::string *
 volume_t::Catalog(const std::string & pathname) const
 {
+    stat_timer_t timer(stat_catalog);
+
     auto pathdir = std::filesystem::path(pathname).parent_path();
-    auto dh = OpenDirectory(pathdir);
-    if (dh == nullptr) {
+    directory_handle_t dh;
+    if (OpenDirectory(pathdir.native(), dh) == false) {
         return nullptr;
     }
 
@@ -356,26 +1021,19 @@ volume_t::Catalog(const std::string & pathname) const
     output->append(line);
 
     const directory_entry_t * entry = nullptr;
-    while ((entry = dh->NextEntry()) != nullptr) {
-        char subtype[16] = {};
-        uint8_t type = entry->FileType();
-        switch (type) {
-            case file_type_binary:
-                if (entry->AuxType() != 0) {
-                    sprintf(subtype, "A=$%04X", entry->AuxType());
-                }
-                break;
-            default:
-                subtype[0] = 0;
-        }
-        sprintf(line, " %-15s  %3s  %6d  %-15s  %-15s  %7d  %7s\n",
-                entry->FileName().c_str(),
-                GetFileTypeInfo(entry->FileType())->name.c_str(),
+    while ((entry = dh.NextEntry()) != nullptr) {
+        char buffer[8];
+        auto subtype = FileSubtype(entry->FileType(), entry->AuxType(), buffer);
+        auto name = entry->FileName();
+        auto type_name = GetFileTypeInfo(entry->FileType())->name;
+        sprintf(line, " %-15.*s  %3.*s  %6d  %-15s  %-15s  %7d  %7.*s\n",
+                (int)name.length(), name.data(),
+                (int)type_name.length(), type_name.data(),
                 entry->BlocksUsed(),
                 entry->LastModTimestamp().AsString().c_str(),
                 entry->CreationTimestamp().AsString().c_str(),
                 entry->Eof(),
-                subtype);
+                (int)subtype.length(), subtype.data());
         output->append(line);
     }
 
@@ -385,8 +1043,7 @@ volume_t::Catalog(const std::string & pathname) const
                   total_blocks - blocks_used, blocks_used, total_blocks);
     output->append(line);
 
-    dh->Close();
-    delete dh;
+    dh.Close();
 
     return output;
 }
@@ -405,7 +1062,7 @@ bool volume_t::Rename(const std::string & name)
     memcpy(_root->key.header.volume_name, s.c_str(), FILENAME_LENGTH);
     _root->key.header.storage_type_and_name_length &= 0b1111'0000;
     _root->key.header.storage_type_and_name_length |= s.length();
-    _disk.WriteBlock(2, _root);
+    _WriteBlock(2, _root);
 
     return true;
 }
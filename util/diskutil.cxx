@@ -6,10 +6,25 @@
 
 #include "prodos.hxx"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
+#include <fcntl.h>
+#include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <time.h>
+#include <unistd.h>
 
 static auto S_Normalize(int argc, char *argv[]) -> int
 {
@@ -122,6 +137,837 @@ static auto S_Rename(int argc, char *argv[]) -> int
     return EXIT_SUCCESS;
 }
 
+static auto S_Index(int argc, char *argv[]) -> int
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: diskutil index <image_in>\n");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<prodos::volume_t> volume(S_OpenVolume(argv[2]));
+    if (volume->WriteIndex() == false) {
+        fprintf(stderr, "diskutil: unable to index volume\n");
+        return EXIT_FAILURE;
+    }
+
+    prodos::index_key key;
+    auto index = prodos::index_t::Key(argv[2], &key) ? prodos::index_t::Open(argv[2], key) : nullptr;
+    if (index == nullptr) {
+        fprintf(stderr, "diskutil: image changed while it was indexed\n");
+        return EXIT_FAILURE;
+    }
+
+    printf("diskutil: wrote %s, %zu entries, %zu extents\n",
+           prodos::index_t::Pathname(argv[2]).c_str(), index->EntryCount(), index->ExtentCount());
+
+    return EXIT_SUCCESS;
+}
+
+// Collect the pathnames of all files in a directory and its subdirectories.
+static void S_FindFiles(const prodos::volume_t & volume, const std::string & dir, std::vector<std::string> & files)
+{
+    auto found = volume.Walk(dir, [&](const prodos::directory_entry_t * entry, std::string_view pathname, int) {
+        if (entry->IsDirectory() == false) {
+            files.emplace_back(pathname);
+        }
+        return prodos::walk_continue;
+    });
+
+    if (!found) {
+        fprintf(stderr, "diskutil: unable to walk directory %s\n", dir.c_str());
+    }
+}
+
+// How the files of a volume are laid out on the disk.
+struct layout_stats_t
+{
+    size_t  files           = 0;
+    size_t  fragmented      = 0;
+    size_t  data_blocks     = 0;
+    size_t  data_extents    = 0;
+    size_t  index_blocks    = 0;
+    size_t  free_blocks     = 0;
+    size_t  free_runs       = 0;
+    size_t  largest_run     = 0;
+};
+
+// Work out the layout of every file, and of the free space, printing a line per file if
+// asked to.
+static void S_MeasureLayout(const prodos::volume_t & volume, layout_stats_t & stats, bool print_files)
+{
+    static const char * storage_types[] = { "", "seedling", "sapling", "tree" };
+
+    std::vector<std::string> files;
+    S_FindFiles(volume, "/", files);
+    stats.files = files.size();
+
+    if (print_files) {
+        printf(" %-40s %-8s  %6s  %5s  %7s  %10s\n\n",
+               "PATHNAME", "STORAGE", "BLOCKS", "INDEX", "EXTENTS", "CONTIGUOUS");
+    }
+
+    for (const auto & file : files) {
+        auto entry = (const prodos::directory_entry_t *)volume.GetEntry(file);
+        prodos::file_handle_t fh;
+        if (entry == nullptr || volume.OpenFile(file, fh) == false) {
+            fprintf(stderr, "diskutil: unable to open %s\n", file.c_str());
+            continue;
+        }
+
+        prodos::file_layout_t layout;
+        fh.Layout(&layout);
+
+        // Sparse runs take no room, so only the others count as pieces.
+        size_t blocks = 0, extents = 0;
+        for (const auto & extent : layout.extents) {
+            if (extent.disk_block != 0) {
+                blocks += extent.count;
+                extents++;
+            }
+        }
+
+        if (print_files) {
+            // The share of the steps from one data block to the next that are to the next block.
+            double contiguous = blocks > 1 ? 100.0 * (blocks - extents) / (blocks - 1) : 100.0;
+
+            printf(" %-40s %-8s  %6d  %5zu  %7zu  %9.1f%%\n", file.c_str(),
+                   storage_types[entry->StorageType()], entry->BlocksUsed(),
+                   layout.index_blocks.size(), extents, contiguous);
+        }
+
+        stats.fragmented += extents > 1;
+        stats.data_blocks += blocks;
+        stats.data_extents += extents;
+        stats.index_blocks += layout.index_blocks.size();
+    }
+
+    size_t run = 0;
+    for (int block = 0; block < volume.TotalBlocks(); block++) {
+        if (volume.IsBlockFree(block)) {
+            stats.free_blocks++;
+            stats.free_runs += run == 0;
+            stats.largest_run = std::max(stats.largest_run, ++run);
+        }
+        else {
+            run = 0;
+        }
+    }
+}
+
+static void S_PrintLayout(const layout_stats_t & stats)
+{
+    printf("files:         %zu, %zu fragmented (%.1f%%)\n", stats.files, stats.fragmented,
+           stats.files ? 100.0 * stats.fragmented / stats.files : 0.0);
+    printf("data blocks:   %zu in %zu extents (%.1f blocks per extent)\n", stats.data_blocks,
+           stats.data_extents, stats.data_extents ? (double)stats.data_blocks / stats.data_extents : 0.0);
+    printf("index blocks:  %zu (%.1f%% of the blocks of files)\n", stats.index_blocks,
+           stats.data_blocks + stats.index_blocks ?
+               100.0 * stats.index_blocks / (stats.data_blocks + stats.index_blocks) : 0.0);
+    printf("free blocks:   %zu in %zu runs, the largest %zu\n", stats.free_blocks, stats.free_runs,
+           stats.largest_run);
+}
+
+// Report how the files are laid out on the disk: how many pieces each is in, how much room
+// their index blocks take, and how broken up the free space is.
+static auto S_Layout(int argc, char *argv[]) -> int
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: diskutil layout <image_in>\n");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<prodos::volume_t> volume(S_OpenVolume(argv[2]));
+
+    layout_stats_t stats;
+    S_MeasureLayout(*volume, stats, true);
+    printf("\n");
+    S_PrintLayout(stats);
+
+    return EXIT_SUCCESS;
+}
+
+// Write a copy of a volume with every directory and file in one piece, and compare the
+// layouts of the two.
+static auto S_Optimize(int argc, char *argv[]) -> int
+{
+    if (argc != 4) {
+        fprintf(stderr, "usage: diskutil optimize <image_in> <image_out>\n");
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<prodos::volume_t> volume(S_OpenVolume(argv[2]));
+
+    try {
+        if (prodos::volume_builder_t::Optimize(*volume, argv[3]) == false) {
+            fprintf(stderr, "diskutil: error %d\n", errno);
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception & ex) {
+        fprintf(stderr, "diskutil: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<prodos::volume_t> optimized(S_OpenVolume(argv[3]));
+
+    layout_stats_t before, after;
+    S_MeasureLayout(*volume, before, false);
+    S_MeasureLayout(*optimized, after, false);
+
+    printf("before:\n");
+    S_PrintLayout(before);
+    printf("\nafter:\n");
+    S_PrintLayout(after);
+
+    return EXIT_SUCCESS;
+}
+
+// A file or directory on the host to be packed into an image.
+struct host_entry_t
+{
+    std::filesystem::path       path;
+    prodos::entry_info_t        info;
+    bool                        is_directory    = false;
+    uintmax_t                   size            = 0;
+    std::vector<host_entry_t>   children;
+};
+
+// Get a ProDOS attribute of a host file, as prodosfs exports it. Files on most host file
+// systems can only have it in the user namespace, so that is tried too.
+static bool S_GetHostAttribute(const std::filesystem::path & path, const char *name, std::string & value)
+{
+    for (auto prefix : { "prodos.", "user.prodos." }) {
+        char buffer[256];
+        auto length = getxattr(path.c_str(), (std::string(prefix) + name).c_str(), buffer, sizeof(buffer));
+        if (length >= 0) {
+            value.assign(buffer, length);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool S_ParseTimestamp(const std::string & str, prodos::timestamp_t & timestamp)
+{
+    static const char * months[] = { "JAN", "FEB", "MAR", "APR", "MAY", "JUN",
+                                     "JUL", "AUG", "SEP", "OCT", "NOV", "DEC" };
+
+    char month[4] = {};
+    if (sscanf(str.c_str(), "%d-%3s-%d %d:%d", &timestamp.day, month, &timestamp.year,
+               &timestamp.hour, &timestamp.minute) != 5) {
+        return false;
+    }
+
+    for (int i = 0; i < 12; i++) {
+        if (strcmp(month, months[i]) == 0) {
+            timestamp.month = i + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static prodos::timestamp_t S_HostTimestamp(time_t time)
+{
+    struct tm tm = {};
+    localtime_r(&time, &tm);
+
+    return { tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min };
+}
+
+static uint8_t S_ParseAccess(const std::string & str)
+{
+    uint8_t access = 0;
+    if (str.find("READ") != std::string::npos)      access |= 0b0000'0001;
+    if (str.find("WRITE") != std::string::npos)     access |= 0b0000'0010;
+    if (str.find("BACKUP") != std::string::npos)    access |= 0b0010'0000;
+    if (str.find("RENAME") != std::string::npos)    access |= 0b0100'0000;
+    if (str.find("DESTROY") != std::string::npos)   access |= 0b1000'0000;
+
+    return access;
+}
+
+// Work out the directory entry of a host file from its name, its stat data and the ProDOS
+// attributes it was given. The name may have a file type suffix, e.g. "STARTUP:BAS", as
+// prodosfs shows names with the -e option. Returns false if the name is not a valid ProDOS name.
+static bool S_HostEntryInfo(const std::filesystem::path & path, bool is_directory, prodos::entry_info_t & info)
+{
+    std::string name = path.filename().string();
+    std::string type_name;
+    auto pos = name.rfind(':');
+    if (pos != std::string::npos) {
+        type_name = name.substr(pos + 1);
+        name.resize(pos);
+    }
+
+    std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+    info.name = name;
+
+    std::string value;
+    if (is_directory) {
+        info.file_type = prodos::file_type_directory;
+    }
+    else if (S_GetHostAttribute(path, "file_type", value) && value.size() > 1 && value[0] == '$') {
+        info.file_type = strtoul(value.c_str() + 1, nullptr, 16);
+    }
+    else {
+        info.file_type = prodos::file_type_binary;
+        for (int type = 0; type < 256 && !type_name.empty(); type++) {
+            if (prodos::GetFileTypeInfo(type)->name == type_name) {
+                info.file_type = type;
+                break;
+            }
+        }
+    }
+
+    if (S_GetHostAttribute(path, "aux_type", value) && value.size() > 1 && value[0] == '$') {
+        info.aux_type = strtoul(value.c_str() + 1, nullptr, 16);
+    }
+    if (S_GetHostAttribute(path, "access", value)) {
+        info.access = S_ParseAccess(value);
+    }
+    if (S_GetHostAttribute(path, "version", value)) {
+        info.version = atoi(value.c_str());
+    }
+    if (S_GetHostAttribute(path, "min_version", value)) {
+        info.min_version = atoi(value.c_str());
+    }
+
+    struct stat st = {};
+    stat(path.c_str(), &st);
+    info.modified = S_HostTimestamp(st.st_mtime);
+    if (!S_GetHostAttribute(path, "creation_timestamp", value) || !S_ParseTimestamp(value, info.created)) {
+        info.created = info.modified;
+    }
+
+    return prodos::IsValidName(info.name);
+}
+
+// List what can be packed of a host directory, and of its subdirectories, in name order.
+// Returns the number of blocks it would take at most.
+static size_t S_ListHostDirectory(const std::filesystem::path & dir, std::vector<host_entry_t> & entries)
+{
+    std::error_code ec;
+    for (const auto & dirent : std::filesystem::directory_iterator(dir, ec)) {
+        host_entry_t entry;
+        entry.path = dirent.path();
+        entry.is_directory = dirent.is_directory(ec);
+        if (entry.is_directory && dirent.is_symlink(ec)) {
+            // It could lead back up the tree, and around and around.
+            fprintf(stderr, "diskutil: skipping %s, a link to a directory\n", entry.path.c_str());
+            continue;
+        }
+        if (!entry.is_directory && !dirent.is_regular_file(ec)) {
+            fprintf(stderr, "diskutil: skipping %s, not a file or directory\n", entry.path.c_str());
+            continue;
+        }
+        if (!S_HostEntryInfo(entry.path, entry.is_directory, entry.info)) {
+            fprintf(stderr, "diskutil: skipping %s, not a valid ProDOS name\n", entry.path.c_str());
+            continue;
+        }
+        entry.size = entry.is_directory ? 0 : dirent.file_size(ec);
+        entries.push_back(std::move(entry));
+    }
+    if (ec) {
+        fprintf(stderr, "diskutil: %s: %s\n", dir.c_str(), ec.message().c_str());
+    }
+
+    std::sort(entries.begin(), entries.end(),
+              [](const host_entry_t & a, const host_entry_t & b) { return a.info.name < b.info.name; });
+
+    // Names differ only in case on the host, but not in ProDOS.
+    for (size_t i = 1; i < entries.size(); ) {
+        if (entries[i].info.name == entries[i - 1].info.name) {
+            fprintf(stderr, "diskutil: skipping %s, the same name as %s\n",
+                    entries[i].path.c_str(), entries[i - 1].path.c_str());
+            entries.erase(entries.begin() + i);
+        }
+        else {
+            i++;
+        }
+    }
+
+    size_t blocks = 0;
+    for (auto & entry : entries) {
+        if (entry.is_directory) {
+            blocks += S_ListHostDirectory(entry.path, entry.children);
+            blocks += prodos::volume_builder_t::DirectoryBlocks(entry.children.size());
+        }
+        else {
+            blocks += prodos::volume_builder_t::FileBlocks(entry.size);
+        }
+    }
+
+    return blocks;
+}
+
+// Add the entries of a host directory to a directory of the volume, each directory followed
+// by what is in it, as diskutil optimize lays a volume out.
+static void S_PackDirectory(prodos::volume_builder_t & builder, uint16_t directory,
+                            const std::vector<host_entry_t> & entries, std::vector<uint8_t> & buffer)
+{
+    for (const auto & entry : entries) {
+        if (entry.is_directory) {
+            auto subdir = builder.AddDirectory(directory, entry.info, entry.children.size());
+            S_PackDirectory(builder, subdir, entry.children, buffer);
+            continue;
+        }
+
+        // The size may have changed since the directory was listed.
+        if (entry.size > prodos::FILE_SIZE_MAX) {
+            throw std::runtime_error("file too large: " + entry.path.string());
+        }
+        buffer.resize(entry.size + 1);
+        int fd = open(entry.path.c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t size = fd < 0 ? -1 : read(fd, buffer.data(), buffer.size());
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (size < 0) {
+            throw std::runtime_error(entry.path.string() + ": " + strerror(errno));
+        }
+        else if ((size_t)size != entry.size) {
+            throw std::runtime_error(entry.path.string() + ": file changed while packing");
+        }
+
+        builder.AddFile(directory, entry.info, buffer.data(), size);
+    }
+}
+
+// Build a ProDOS-order image from a host directory. The volume takes the name and
+// attributes of the directory, and each file and subdirectory those it has as prodos.*
+// extended attributes, or else what it has on the host. The image is the smallest of a 5.25"
+// disk, a 3.5" disk or a 32 MiB volume that holds everything, unless its size is given.
+static auto S_Pack(int argc, char *argv[]) -> int
+{
+    if (argc != 4 && argc != 5) {
+        fprintf(stderr, "usage: diskutil pack <host_dir> <image_out> [total_blocks]\n");
+        return EXIT_FAILURE;
+    }
+
+    const unsigned standard_sizes[] = { 280, 1600, 65535 };
+
+    std::filesystem::path dir = argv[2];
+    if (!std::filesystem::is_directory(dir)) {
+        fprintf(stderr, "diskutil: %s is not a directory\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    prodos::entry_info_t volume_info;
+    std::string name;
+    if (!S_GetHostAttribute(dir, "volume_name", name)) {
+        // Make a name of what it can of the directory's, e.g. "disk-1" becomes "DISK1".
+        auto base = std::filesystem::absolute(dir).lexically_normal();
+        if (!base.has_filename()) {
+            base = base.parent_path();
+        }
+        for (char c : base.filename().string()) {
+            if (isalnum(c) || c == '.') {
+                name += toupper(c);
+            }
+        }
+        if (name.empty() || !isalpha(name[0])) {
+            name.insert(0, "V");
+        }
+        name.resize(std::min<size_t>(name.size(), 15));
+    }
+    // Its own name is not the volume's, so only the rest of what is worked out counts.
+    S_HostEntryInfo(dir, true, volume_info);
+    volume_info.name = name;
+    volume_info.file_type = 0;
+    if (!prodos::IsValidName(name)) {
+        fprintf(stderr, "diskutil: invalid volume name - %s\n", name.c_str());
+        return EXIT_FAILURE;
+    }
+
+    std::vector<host_entry_t> entries;
+    size_t needed = 2 + S_ListHostDirectory(dir, entries) +
+                    std::max(4u, prodos::volume_builder_t::DirectoryBlocks(entries.size()));
+
+    unsigned total_blocks = 0;
+    if (argc == 5) {
+        total_blocks = strtoul(argv[4], nullptr, 0);
+    }
+    else {
+        for (auto size : standard_sizes) {
+            if (needed + (size + 4095) / 4096 <= size) {
+                total_blocks = size;
+                break;
+            }
+        }
+        if (total_blocks == 0) {
+            fprintf(stderr, "diskutil: files take more than %u blocks\n", standard_sizes[2]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    try {
+        prodos::volume_builder_t builder(total_blocks);
+        std::vector<uint8_t> buffer;
+
+        auto root = builder.Format(volume_info, entries.size());
+        S_PackDirectory(builder, root, entries, buffer);
+        builder.Finish();
+
+        if (builder.Save(argv[3]) == false) {
+            fprintf(stderr, "diskutil: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
+
+        printf("diskutil: wrote /%s, %u blocks, %u free\n", name.c_str(), builder.TotalBlocks(),
+               builder.FreeBlocks());
+    }
+    catch (const std::exception & ex) {
+        fprintf(stderr, "diskutil: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static std::string S_AccessString(uint8_t access)
+{
+    std::string str;
+    for (auto [bit, name] : { std::pair(0b0000'0001, "READ"), std::pair(0b0000'0010, "WRITE"),
+                              std::pair(0b0010'0000, "BACKUP"), std::pair(0b0100'0000, "RENAME"),
+                              std::pair(0b1000'0000, "DESTROY") }) {
+        if (access & bit) {
+            str += str.empty() ? "" : " | ";
+            str += name;
+        }
+    }
+
+    return str;
+}
+
+// Give a host file the attributes of a ProDOS entry, in the user namespace, where diskutil
+// pack finds them, and its modification time.
+static void S_SetHostAttributes(const std::filesystem::path & path, const prodos::directory_entry_t * entry)
+{
+    char buffer[16];
+    auto set = [&](const char *name, const std::string & value) {
+        setxattr(path.c_str(), (std::string("user.prodos.") + name).c_str(), value.data(), value.size(), 0);
+    };
+
+    set("file_type", std::string(prodos::GetFileTypeInfo(entry->FileType())->type));
+    snprintf(buffer, sizeof(buffer), "$%04X", entry->AuxType());
+    set("aux_type", buffer);
+    set("access", S_AccessString(entry->Access()));
+    set("version", std::to_string(entry->Version()));
+    set("min_version", std::to_string(entry->MinVersion()));
+    auto created = entry->CreationTimestamp();
+    if (created.month >= 1 && created.month <= 12) {
+        set("creation_timestamp", created.AsString());
+    }
+
+    auto modified = entry->LastModTimestamp();
+    if (modified.month >= 1 && modified.month <= 12) {
+        // ProDOS years are 0-99, and by convention those before 40 are 20xx.
+        struct tm tm = {};
+        tm.tm_year = modified.year < 40 ? modified.year + 100 : modified.year;
+        tm.tm_mon = modified.month - 1;
+        tm.tm_mday = modified.day;
+        tm.tm_hour = modified.hour;
+        tm.tm_min = modified.minute;
+        tm.tm_isdst = -1;
+        struct timespec times[2] = { { 0, UTIME_OMIT }, { mktime(&tm), 0 } };
+        utimensat(AT_FDCWD, path.c_str(), times, 0);
+    }
+}
+
+// Scan an image for what can be salvaged of its directories and files, including deleted
+// ones, and list it. If a directory is given, copy everything found into it, with the ProDOS
+// attributes that diskutil pack uses to make an image of it again.
+static auto S_Salvage(int argc, char *argv[]) -> int
+{
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: diskutil salvage <image_in> [host_dir_out]\n");
+        return EXIT_FAILURE;
+    }
+
+    static const char * kind_names[] = { "other", "empty", "volume directory", "subdirectory key",
+                                         "directory", "index", "bitmap" };
+    static_assert(std::size(kind_names) == prodos::SALVAGE_BLOCK_KINDS);
+
+    std::unique_ptr<prodos::salvage_t> salvage;
+    try {
+        salvage = std::make_unique<prodos::salvage_t>(argv[2]);
+        salvage->Scan();
+    }
+    catch (const std::exception & ex) {
+        fprintf(stderr, "diskutil: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    unsigned kinds[prodos::SALVAGE_BLOCK_KINDS] = {};
+    for (unsigned block = 0; block < salvage->NumBlocks(); block++) {
+        kinds[salvage->BlockKind(block)]++;
+    }
+    printf("blocks:");
+    for (int kind = 0; kind < prodos::SALVAGE_BLOCK_KINDS; kind++) {
+        printf("%s %u %s", kind ? "," : "", kinds[kind], kind_names[kind]);
+    }
+    printf("%s\n\n", salvage->HasBitmap() ? "" : " (no volume bitmap, all blocks taken as free)");
+
+    std::filesystem::path out_dir = argc == 4 ? argv[3] : "";
+    std::set<std::filesystem::path> written;
+    unsigned files = 0, directories = 0, deleted = 0, damaged = 0;
+
+    for (const auto & file : salvage->Files()) {
+        auto entry = (const prodos::directory_entry_t *)&file.entry;
+        std::string flags = file.deleted ? "deleted" : "";
+        if (file.damaged) {
+            flags += flags.empty() ? "damaged" : ", damaged";
+        }
+        printf(" %-40s %-4s %8u  %s\n", file.pathname.c_str(),
+               std::string(prodos::GetFileTypeInfo(entry->FileType())->name).c_str(), entry->Eof(), flags.c_str());
+
+        directories += file.IsDirectory();
+        files += !file.IsDirectory();
+        deleted += file.deleted;
+        damaged += file.damaged;
+
+        if (out_dir.empty()) {
+            continue;
+        }
+
+        // A deleted entry can have the name of one in use, so later ones are numbered.
+        auto path = out_dir / file.pathname.substr(1);
+        for (int n = 1; written.count(path); n++) {
+            path = out_dir / (file.pathname.substr(1) + "." + std::to_string(n));
+        }
+        written.insert(path);
+
+        // The names are valid ProDOS names, which cannot climb out of the directory, but the
+        // image is not to be trusted, so that is made sure of.
+        auto relative = path.lexically_normal().lexically_relative(out_dir.lexically_normal());
+        if (relative.empty() || *relative.begin() == "..") {
+            fprintf(stderr, "diskutil: %s: outside of %s, skipped\n", file.pathname.c_str(), out_dir.c_str());
+            continue;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(file.IsDirectory() ? path : path.parent_path(), ec);
+        if (!file.IsDirectory()) {
+            auto data = salvage->Read(file);
+            FILE * fp = fopen(path.c_str(), "wb");
+            if (fp == nullptr || fwrite(data.data(), 1, data.size(), fp) != data.size() || fclose(fp) != 0) {
+                fprintf(stderr, "diskutil: %s: %s\n", path.c_str(), strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+        S_SetHostAttributes(path, entry);
+    }
+
+    printf("\n%u files, %u directories, %u deleted, %u damaged, %u deleted but unrecoverable\n",
+           files, directories, deleted, damaged, salvage->Unrecoverable());
+
+    return EXIT_SUCCESS;
+}
+
+// Check the consistency of images, several at a time. Each image is reported when it is
+// done, as "<image>: ok" or followed by what is wrong with it.
+static auto S_Check(int argc, char *argv[]) -> int
+{
+    int first = 2;
+    unsigned threads = std::thread::hardware_concurrency();
+    if (argc > 3 && strcmp(argv[2], "-j") == 0) {
+        threads = atoi(argv[3]);
+        first = 4;
+    }
+    if (argc <= first || threads < 1) {
+        fprintf(stderr, "usage: diskutil check [-j threads] <image_in>...\n");
+        return EXIT_FAILURE;
+    }
+
+    std::atomic<int>    next        = first;
+    std::atomic<size_t> damaged     = 0;
+    std::atomic<size_t> unreadable  = 0;
+    std::mutex          output_mutex;
+
+    // Partitioned disks are checked a partition at a time.
+    auto check = [&](const std::string & name, std::function<prodos::volume_t *()> open) {
+        std::string report = name + ": ";
+        try {
+            std::unique_ptr<prodos::volume_t> volume(open());
+            prodos::volume_checker_t checker(*volume);
+            if (checker.Check()) {
+                char line[128];
+                snprintf(line, sizeof(line), "ok, %u directories, %u files, %u of %d blocks used\n",
+                         checker.Directories(), checker.Files(), checker.BlocksUsed(), volume->TotalBlocks());
+                report += line;
+            }
+            else {
+                report += std::to_string(checker.ProblemCount()) + " problems\n";
+                for (const auto & problem : checker.Problems()) {
+                    report += "    " + problem + "\n";
+                }
+                if (checker.ProblemCount() > checker.Problems().size()) {
+                    report += "    ...\n";
+                }
+                damaged++;
+            }
+        }
+        catch (const std::exception & ex) {
+            report += std::string("unable to mount, ") + ex.what() + "\n";
+            unreadable++;
+        }
+
+        std::lock_guard<std::mutex> lock(output_mutex);
+        fputs(report.c_str(), stdout);
+    };
+
+    auto checker = [&]() {
+        for (int i = next++; i < argc; i = next++) {
+            std::shared_ptr<prodos::disk_t> disk;
+            std::vector<prodos::partition_t> partitions;
+            try {
+                disk = std::make_shared<prodos::disk_t>(argv[i]);
+                partitions = prodos::volume_t::FindPartitions(*disk);
+            }
+            catch (const std::exception & ex) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                printf("%s: unable to open, %s\n", argv[i], ex.what());
+                unreadable++;
+                continue;
+            }
+
+            if (partitions.empty()) {
+                check(argv[i], [&]() { return new prodos::volume_t(disk); });
+            }
+            for (size_t j = 0; j < partitions.size(); j++) {
+                check(std::string(argv[i]) + " partition " + std::to_string(j + 1),
+                      [&]() { return new prodos::volume_t(disk, partitions[j]); });
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<unsigned>(threads, argc - first); i++) {
+        workers.emplace_back(checker);
+    }
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    if (argc - first > 1) {
+        printf("\n%d images, %zu damaged, %zu unable to mount\n", argc - first, damaged.load(),
+               unreadable.load());
+    }
+
+    return damaged || unreadable ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Read random ranges of every file from several threads at once, sharing one handle per
+// file, and check them against the contents read by a single thread. Each round opens the
+// volume afresh so that blocks which are decoded on first read are decoded concurrently too.
+static auto S_Stress(int argc, char *argv[]) -> int
+{
+    if (argc < 3 || argc > 5) {
+        fprintf(stderr, "usage: diskutil stress <image_in> [max_threads [seconds]]\n");
+        return EXIT_FAILURE;
+    }
+
+    unsigned max_threads = argc > 3 ? atoi(argv[3]) : std::thread::hardware_concurrency();
+    unsigned seconds = argc > 4 ? atoi(argv[4]) : 2;
+    if (max_threads < 1 || seconds < 1) {
+        fprintf(stderr, "diskutil: invalid thread count or duration\n");
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string>            files;
+    std::vector<std::vector<uint8_t>>   contents;
+    {
+        std::unique_ptr<prodos::volume_t> volume(S_OpenVolume(argv[2]));
+        S_FindFiles(*volume, "/", files);
+        std::vector<std::string> found;
+        found.swap(files);
+        for (const auto & file : found) {
+            auto entry = (const prodos::directory_entry_t *)volume->GetEntry(file);
+            std::unique_ptr<prodos::file_handle_t> fh(volume->OpenFile(file));
+            if (entry == nullptr || fh == nullptr) {
+                fprintf(stderr, "diskutil: unable to open %s\n", file.c_str());
+                continue;
+            }
+
+            std::vector<uint8_t> data(entry->Eof());
+            if (fh->ReadAt(0, data.data(), data.size()) != (ssize_t)data.size()) {
+                fprintf(stderr, "diskutil: unable to read %s\n", file.c_str());
+                return EXIT_FAILURE;
+            }
+
+            files.push_back(file);
+            contents.push_back(std::move(data));
+        }
+    }
+
+    if (files.empty()) {
+        fprintf(stderr, "diskutil: volume has no files\n");
+        return EXIT_FAILURE;
+    }
+
+    size_t failures = 0;
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+        std::unique_ptr<prodos::volume_t> volume(S_OpenVolume(argv[2]));
+        std::vector<std::unique_ptr<prodos::file_handle_t>> handles;
+        for (const auto & file : files) {
+            handles.emplace_back(volume->OpenFile(file));
+            if (handles.back() == nullptr) {
+                fprintf(stderr, "diskutil: unable to reopen %s\n", file.c_str());
+                return EXIT_FAILURE;
+            }
+        }
+
+        std::atomic<bool>   stop        = false;
+        std::atomic<size_t> bytes_read  = 0;
+        std::atomic<size_t> mismatches  = 0;
+
+        auto reader = [&](unsigned seed) {
+            uint32_t state = seed * 2654435761u + 1;
+            auto random = [&state]() {
+                state ^= state << 13;
+                state ^= state >> 17;
+                state ^= state << 5;
+                return state;
+            };
+
+            std::vector<uint8_t> buffer(64 * 1024);
+            size_t total = 0;
+            while (!stop) {
+                auto index = random() % files.size();
+                const auto & expected = contents[index];
+                size_t offset = random() % (expected.size() + 1);
+                size_t length = random() % (buffer.size() + 1);
+                auto n = handles[index]->ReadAt(offset, buffer.data(), length);
+                size_t expected_n = std::min(length, expected.size() - offset);
+                if (n != (ssize_t)expected_n || memcmp(buffer.data(), expected.data() + offset, n) != 0) {
+                    mismatches++;
+                }
+                total += n > 0 ? n : 0;
+            }
+            bytes_read += total;
+        };
+
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; i++) {
+            workers.emplace_back(reader, i);
+        }
+        std::this_thread::sleep_for(std::chrono::seconds(seconds));
+        stop = true;
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        printf("%3u threads: %10.1f MiB/s, %zu mismatches\n", threads,
+               bytes_read / (1024.0 * 1024.0) / seconds, mismatches.load());
+        failures += mismatches;
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
     if (argc < 2) {
@@ -134,12 +980,33 @@ int main(int argc, char *argv[])
     if (cmd == "catalog") {
         ev = S_Catalog(argc, argv);
     }
+    else if (cmd == "check") {
+        ev = S_Check(argc, argv);
+    }
+    else if (cmd == "index") {
+        ev = S_Index(argc, argv);
+    }
+    else if (cmd == "layout") {
+        ev = S_Layout(argc, argv);
+    }
     else if (cmd == "normalize") {
         ev = S_Normalize(argc, argv);
     }
+    else if (cmd == "optimize") {
+        ev = S_Optimize(argc, argv);
+    }
+    else if (cmd == "pack") {
+        ev = S_Pack(argc, argv);
+    }
     else if (cmd == "rename") {
         ev = S_Rename(argc, argv);
     }
+    else if (cmd == "salvage") {
+        ev = S_Salvage(argc, argv);
+    }
+    else if (cmd == "stress") {
+        ev = S_Stress(argc, argv);
+    }
     else {
         fprintf(stderr, "diskutil: unrecognized command -- %s\n", cmd.c_str());
         return EXIT_FAILURE;
@@ -0,0 +1,141 @@
+/*
+** prodosfs - A mountable read-only filesystem for Apple II ProDOS 8 disk images.
+**
+** Copyright 2024 by Javier Alvarado.
+*/
+
+/*
+** Replays a block trace recorded with "prodosfs -t <trace file>" against a disk image, which
+** need not be the one it was recorded from (e.g. the same disk as a .po, a ShrinkIt archive,
+** or a WOZ image), and reports how fast the reads are and how well they would be cached.
+*/
+
+#include "prodos.hxx"
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace prodos;
+
+// Count the hits of a least-recently-used cache of the given number of blocks.
+static uint64_t S_LruHits(const std::vector<trace_record> & records, size_t capacity)
+{
+    std::list<uint32_t>                                                 lru;
+    std::unordered_map<uint32_t, std::list<uint32_t>::iterator>       cached;
+    uint64_t                                                            hits = 0;
+
+    for (const auto & record : records) {
+        auto itr = cached.find(record.block);
+        if (itr != cached.end()) {
+            hits++;
+            lru.splice(lru.begin(), lru, itr->second);
+            continue;
+        }
+
+        if (lru.size() == capacity) {
+            cached.erase(lru.back());
+            lru.pop_back();
+        }
+        lru.push_front(record.block);
+        cached[record.block] = lru.begin();
+    }
+
+    return hits;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "usage: prodos_replay <trace_file> <image_file> [passes]\n");
+        return EXIT_FAILURE;
+    }
+
+    int passes = argc > 3 ? atoi(argv[3]) : 3;
+    if (passes < 1) {
+        fprintf(stderr, "prodos_replay: invalid number of passes -- %s\n", argv[3]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<trace_record> records;
+    if (!ReadTrace(argv[1], records)) {
+        fprintf(stderr, "prodos_replay: not a block trace -- %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    // Mount the image as prodosfs would, so that it is converted to block order if need be.
+    std::shared_ptr<disk_t>     disk;
+    std::unique_ptr<volume_t>   volume;
+    try {
+        disk = std::make_shared<disk_t>(argv[2]);
+        if (volume_t::FindPartitions(*disk).empty()) {
+            volume = std::make_unique<volume_t>(disk);
+        }
+    }
+    catch (const std::exception & ex) {
+        fprintf(stderr, "prodos_replay: %s\n", ex.what());
+        return EXIT_FAILURE;
+    }
+
+    uint64_t                        categories[TRACE_CATEGORY_COUNT] = {};
+    std::unordered_set<uint32_t>    distinct;
+    size_t                          out_of_range = 0;
+    for (const auto & record : records) {
+        categories[std::min<unsigned>(record.category, TRACE_CATEGORY_COUNT - 1)]++;
+        distinct.insert(record.block);
+        out_of_range += record.block >= disk->NumBlocks();
+    }
+
+    printf("trace:     %zu reads of %zu distinct blocks over %.3f s\n", records.size(), distinct.size(),
+           records.empty() ? 0.0 : records.back().nanoseconds / 1e9);
+    for (unsigned i = 0; i < TRACE_CATEGORY_COUNT; i++) {
+        if (categories[i]) {
+            printf("           %-10s %10llu\n", TraceCategoryName(i), (unsigned long long)categories[i]);
+        }
+    }
+    if (out_of_range) {
+        printf("           %zu reads past the end of the image are skipped\n", out_of_range);
+    }
+
+    uint64_t lookups_before, misses_before;
+    disk->DecodeCounts(&lookups_before, &misses_before);
+
+    uint8_t checksum = 0;
+    for (int pass = 1; pass <= passes; pass++) {
+        auto start = StatClock();
+        for (const auto & record : records) {
+            if (record.block < disk->NumBlocks()) {
+                auto block = (const uint8_t *)disk->ReadBlock(record.block);
+                checksum ^= block[record.block % BLOCK_SIZE];
+            }
+        }
+        auto elapsed = (StatClock() - start) / 1e9;
+
+        printf("pass %d:    %.3f ms, %.0f reads/s, %.1f MiB/s\n", pass, elapsed * 1e3,
+               records.size() / elapsed, records.size() * BLOCK_SIZE / elapsed / (1024 * 1024));
+    }
+
+    uint64_t lookups, misses;
+    disk->DecodeCounts(&lookups, &misses);
+    lookups -= lookups_before;
+    misses -= misses_before;
+    if (lookups) {
+        printf("decoding:  %llu of %llu reads decoded a unit first (%.1f%% hits)\n",
+               (unsigned long long)misses, (unsigned long long)lookups, 100.0 * (lookups - misses) / lookups);
+    }
+
+    for (size_t capacity : { 16, 64, 256, 1024, 4096 }) {
+        auto hits = S_LruHits(records, capacity);
+        printf("LRU %4zu:  %5.1f%% hits\n", capacity, records.empty() ? 0.0 : 100.0 * hits / records.size());
+    }
+
+    // Keep the block reads from being optimized away.
+    static volatile uint8_t sink;
+    sink = checksum;
+
+    return EXIT_SUCCESS;
+}